@@ -0,0 +1,503 @@
+/*
+ * Summarizer output filter
+ *
+ * Collects the response body of any location and replaces it with its
+ * summary, fetched by an in-memory subrequest to a summarizer_pass location
+ * that gets the collected body as an inline document. The header is held
+ * until the summary is in; if there is none, the body goes out as it was.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+/* TYPES */
+
+typedef enum {
+    SMRZR_FILTER_READ = 0,
+    SMRZR_FILTER_WAIT,
+    SMRZR_FILTER_PASS
+} smrzr_filter_phase_t;
+
+typedef struct {
+    ngx_flag_t                     enable;
+    ngx_str_t                      uri;
+    size_t                         max_size;
+    ngx_hash_t                     types;
+    ngx_array_t                  * types_keys;
+} ngx_http_summarizer_filter_loc_conf_t;
+
+typedef struct {
+    smrzr_filter_phase_t           phase;
+    off_t                          size;
+    ngx_chain_t                  * body;
+    ngx_chain_t                 ** last_out;
+    ngx_str_t                      summary;
+    unsigned                       finished:1;
+    unsigned                       summarized:1;
+} ngx_http_summarizer_filter_ctx_t;
+
+
+/* PROTOTYPES */
+
+static void      * ngx_http_summarizer_filter_create_loc_conf(ngx_conf_t *cf);
+static char      * ngx_http_summarizer_filter_merge_loc_conf(ngx_conf_t *cf,
+                       void *parent, void *child);
+static ngx_int_t   ngx_http_summarizer_filter_init(ngx_conf_t *cf);
+
+static ngx_int_t   ngx_http_summarizer_header_filter(ngx_http_request_t *r);
+static ngx_int_t   ngx_http_summarizer_body_filter(ngx_http_request_t *r,
+                       ngx_chain_t *in);
+static ngx_int_t   ngx_http_summarizer_filter_done(ngx_http_request_t *sr,
+                       void *data, ngx_int_t rc);
+
+/* in ngx_http_summarizer_module.c */
+ngx_int_t          ngx_http_summarizer_subrequest_summary(
+                       ngx_http_request_t *sr, ngx_str_t *value);
+
+/* LOCALS */
+
+static ngx_str_t ngx_http_summarizer_filter_default_types[] = {
+    ngx_string("text/plain"),
+    ngx_string("text/html"),
+    ngx_null_string
+};
+
+static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
+static ngx_http_output_body_filter_pt    ngx_http_next_body_filter;
+
+/* MODULE GLOBALS */
+
+static ngx_command_t ngx_http_summarizer_filter_commands[] = {
+
+    { ngx_string("summarizer_filter"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_summarizer_filter_loc_conf_t, enable),
+      NULL },
+
+    { ngx_string("summarizer_filter_pass"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_summarizer_filter_loc_conf_t, uri),
+      NULL },
+
+    { ngx_string("summarizer_filter_max_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_summarizer_filter_loc_conf_t, max_size),
+      NULL },
+
+    { ngx_string("summarizer_filter_types"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_http_types_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_summarizer_filter_loc_conf_t, types_keys),
+      &ngx_http_summarizer_filter_default_types[0] },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_summarizer_filter_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_http_summarizer_filter_init,       /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    ngx_http_summarizer_filter_create_loc_conf, /* create location conf */
+    ngx_http_summarizer_filter_merge_loc_conf   /* merge location conf */
+};
+
+
+ngx_module_t ngx_http_summarizer_filter_module = {
+    NGX_MODULE_V1,
+    &ngx_http_summarizer_filter_module_ctx,   /* module context */
+    ngx_http_summarizer_filter_commands,      /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+/* FUNCTION DEFINITIONS */
+
+/* location conf creation */
+static void*
+ngx_http_summarizer_filter_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_summarizer_filter_loc_conf_t  *conf;
+
+    if(NULL == (conf = ngx_pcalloc(cf->pool,
+                           sizeof(ngx_http_summarizer_filter_loc_conf_t))))
+    {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->uri = { 0, NULL };
+     *     conf->types = { NULL };
+     *     conf->types_keys = NULL;
+     */
+
+    conf->enable = NGX_CONF_UNSET;
+    conf->max_size = NGX_CONF_UNSET_SIZE;
+
+    return conf;
+}
+
+/* location conf merge */
+static char*
+ngx_http_summarizer_filter_merge_loc_conf(ngx_conf_t *cf, void *parent,
+    void *child)
+{
+    ngx_http_summarizer_filter_loc_conf_t *prev = parent;
+    ngx_http_summarizer_filter_loc_conf_t *conf = child;
+
+    ngx_conf_merge_value(conf->enable, prev->enable, 0);
+    ngx_conf_merge_str_value(conf->uri, prev->uri, "");
+    ngx_conf_merge_size_value(conf->max_size, prev->max_size, 1024 * 1024);
+
+    if (ngx_http_merge_types(cf, &conf->types_keys, &conf->types,
+                             &prev->types_keys, &prev->types,
+                             ngx_http_summarizer_filter_default_types)
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    if (conf->enable && conf->uri.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"summarizer_filter\" requires "
+                           "\"summarizer_filter_pass\"");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+static ngx_int_t
+ngx_http_summarizer_filter_init(ngx_conf_t *cf)
+{
+    ngx_http_next_header_filter = ngx_http_top_header_filter;
+    ngx_http_top_header_filter = ngx_http_summarizer_header_filter;
+
+    ngx_http_next_body_filter = ngx_http_top_body_filter;
+    ngx_http_top_body_filter = ngx_http_summarizer_body_filter;
+
+    return NGX_OK;
+}
+
+/* header is held back until the body has been collected */
+static ngx_int_t
+ngx_http_summarizer_header_filter(ngx_http_request_t *r)
+{
+    ngx_http_summarizer_filter_loc_conf_t  * conf;
+    ngx_http_summarizer_filter_ctx_t       * ctx;
+
+    if (r != r->main
+        || r->header_only
+        || r->headers_out.status != NGX_HTTP_OK
+        || (r->headers_out.content_encoding
+            && r->headers_out.content_encoding->value.len))
+    {
+        return ngx_http_next_header_filter(r);
+    }
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_summarizer_filter_module);
+
+    if (!conf->enable
+        || (r->headers_out.content_length_n != -1
+            && r->headers_out.content_length_n > (off_t) conf->max_size)
+        || ngx_http_test_content_type(r, &conf->types) == NULL)
+    {
+        return ngx_http_next_header_filter(r);
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_summarizer_filter_module);
+
+    if (ctx) {
+        ngx_http_set_ctx(r, NULL, ngx_http_summarizer_filter_module);
+        return ngx_http_next_header_filter(r);
+    }
+
+    if (NULL == (ctx = ngx_pcalloc(r->pool,
+                           sizeof(ngx_http_summarizer_filter_ctx_t))))
+    {
+        return NGX_ERROR;
+    }
+
+    ctx->last_out = &ctx->body;
+
+    ngx_http_set_ctx(r, ctx, ngx_http_summarizer_filter_module);
+
+    r->main_filter_need_in_memory = 1;
+    r->allow_ranges = 0;
+
+    return NGX_OK;
+}
+
+/* copy body buffers; NGX_DECLINED once the body exceeds max size */
+static ngx_int_t
+ngx_http_summarizer_filter_read(
+    ngx_http_request_t                 * r,
+    ngx_http_summarizer_filter_ctx_t   * ctx,
+    ngx_chain_t                       ** in)
+{
+    ngx_http_summarizer_filter_loc_conf_t  * conf;
+    ngx_chain_t                            * cl;
+    ngx_buf_t                              * b;
+    size_t                                   size;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_summarizer_filter_module);
+
+    for ( /* void */ ; *in; *in = (*in)->next) {
+
+        size = ngx_buf_size((*in)->buf);
+
+        if (ctx->size + size > conf->max_size) {
+            return NGX_DECLINED;
+        }
+
+        if (size) {
+            if (NULL == (b = ngx_create_temp_buf(r->pool, size))) {
+                return NGX_ERROR;
+            }
+
+            b->last = ngx_cpymem(b->pos, (*in)->buf->pos, size);
+            (*in)->buf->pos += size;
+
+            if (NULL == (cl = ngx_alloc_chain_link(r->pool))) {
+                return NGX_ERROR;
+            }
+
+            cl->buf = b;
+            cl->next = NULL;
+
+            *ctx->last_out = cl;
+            ctx->last_out = &cl->next;
+
+            ctx->size += size;
+        }
+
+        if ((*in)->buf->last_buf) {
+            return NGX_OK;
+        }
+    }
+
+    return NGX_AGAIN;
+}
+
+/* issue the summarizer subrequest, the response waits for it */
+static ngx_int_t
+ngx_http_summarizer_filter_summarize(
+    ngx_http_request_t                 * r,
+    ngx_http_summarizer_filter_ctx_t   * ctx)
+{
+    ngx_http_summarizer_filter_loc_conf_t  * conf;
+    ngx_http_request_body_t                * rb;
+    ngx_http_post_subrequest_t             * ps;
+    ngx_http_request_t                     * sr;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_summarizer_filter_module);
+
+    if (NULL == (rb = ngx_pcalloc(r->pool, sizeof(ngx_http_request_body_t))))
+    {
+        return NGX_ERROR;
+    }
+
+    if (NULL == (ps = ngx_palloc(r->pool, sizeof(ngx_http_post_subrequest_t))))
+    {
+        return NGX_ERROR;
+    }
+
+    rb->bufs = ctx->body;
+
+    ps->handler = ngx_http_summarizer_filter_done;
+    ps->data = ctx;
+
+    if (ngx_http_subrequest(r, &conf->uri, &r->args, &sr, ps,
+                            NGX_HTTP_SUBREQUEST_IN_MEMORY
+                            |NGX_HTTP_SUBREQUEST_WAITED)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    /* a GET carrying the collected body */
+    sr->request_body = rb;
+
+    ctx->phase = SMRZR_FILTER_WAIT;
+
+    return NGX_OK;
+}
+
+/* the summary, or the failure, of the summarizer subrequest */
+static ngx_int_t
+ngx_http_summarizer_filter_done(ngx_http_request_t *sr, void *data,
+    ngx_int_t rc)
+{
+    ngx_http_summarizer_filter_ctx_t   * ctx = data;
+
+    if (ctx->finished) {
+        return rc;
+    }
+
+    ctx->finished = 1;
+
+    if (ngx_http_summarizer_subrequest_summary(sr, &ctx->summary) == NGX_OK) {
+        ctx->summarized = 1;
+        return rc;
+    }
+
+    ngx_log_error(NGX_LOG_WARN, sr->connection->log, 0,
+                  "summarizer filter subrequest \"%V\" failed: %i, "
+                  "passing %O bytes", &sr->uri, rc, ctx->size);
+
+    return rc;
+}
+
+/* send the header and the summary, or the collected body if there is
+ * none */
+static ngx_int_t
+ngx_http_summarizer_filter_send(
+    ngx_http_request_t                 * r,
+    ngx_http_summarizer_filter_ctx_t   * ctx)
+{
+    ngx_buf_t                              * b;
+    ngx_chain_t                            * cl;
+    ngx_int_t                                rc;
+
+    if (NULL == (b = ngx_calloc_buf(r->pool))) {
+        return NGX_ERROR;
+    }
+
+    if (NULL == (cl = ngx_alloc_chain_link(r->pool))) {
+        return NGX_ERROR;
+    }
+
+    b->last_buf = 1;
+
+    cl->buf = b;
+    cl->next = NULL;
+
+    if (ctx->summarized) {
+        ngx_str_set(&r->headers_out.content_type, "text/plain");
+        r->headers_out.content_type_len = r->headers_out.content_type.len;
+        r->headers_out.content_type_lowcase = NULL;
+        ngx_str_set(&r->headers_out.charset, "utf-8");
+
+        ngx_http_clear_content_length(r);
+        r->headers_out.content_length_n = ctx->summary.len;
+
+        ngx_http_clear_accept_ranges(r);
+        ngx_http_clear_last_modified(r);
+        ngx_http_clear_etag(r);
+
+        if (ctx->summary.len) {
+            b->pos = ctx->summary.data;
+            b->last = ctx->summary.data + ctx->summary.len;
+            b->memory = 1;
+        }
+
+        ctx->body = cl;
+
+    } else {
+        *ctx->last_out = cl;
+    }
+
+    rc = ngx_http_next_header_filter(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_next_body_filter(r, ctx->body);
+}
+
+static ngx_int_t
+ngx_http_summarizer_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
+{
+    ngx_int_t                           rc;
+    ngx_chain_t                       * cl;
+    ngx_http_summarizer_filter_ctx_t  * ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_summarizer_filter_module);
+
+    if (ctx == NULL) {
+        return ngx_http_next_body_filter(r, in);
+    }
+
+    switch (ctx->phase) {
+
+    case SMRZR_FILTER_READ:
+
+        if (in == NULL) {
+            return ngx_http_next_body_filter(r, in);
+        }
+
+        cl = in;
+
+        rc = ngx_http_summarizer_filter_read(r, ctx, &cl);
+
+        if (rc == NGX_AGAIN) {
+            return NGX_OK;
+        }
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (rc == NGX_DECLINED || ctx->body == NULL) {
+
+            /* too large or empty: the original response goes out as is */
+
+            ctx->phase = SMRZR_FILTER_PASS;
+
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "summarizer filter passes %O bytes", ctx->size);
+
+            rc = ngx_http_next_header_filter(r);
+
+            if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+                return rc;
+            }
+
+            *ctx->last_out = cl;
+
+            return ngx_http_next_body_filter(r, ctx->body);
+        }
+
+        return ngx_http_summarizer_filter_summarize(r, ctx);
+
+    case SMRZR_FILTER_WAIT:
+
+        /* the main request is posted once the subrequest is done */
+        if (!ctx->finished) {
+            return NGX_OK;
+        }
+
+        ctx->phase = SMRZR_FILTER_PASS;
+
+        return ngx_http_summarizer_filter_send(r, ctx);
+
+    default: /* SMRZR_FILTER_PASS */
+
+        return ngx_http_next_body_filter(r, in);
+    }
+}
@@ -0,0 +1,177 @@
+/*
+ * Content fingerprints of documents, memoized per file version
+ *
+ * A file is hashed once per (inode, name, mtime, size); the result is kept
+ * in a zone so that every worker reuses it until the file changes. Least
+ * recently used entries are dropped when the zone is full.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_md5.h>
+#include "ngx_http_summarizer_zone.h"
+#include "ngx_http_summarizer_fingerprint.h"
+
+#define SMRZR_FP_KEY_LEN       (sizeof(ngx_file_uniq_t) + sizeof(uint32_t))
+
+static char  s_smrzr_fp_directive[] = "summarizer_dedup";
+
+/* FUNCTION DEFINITIONS */
+
+/* a file is known by its inode and its name */
+static void
+s_smrzr_fp_key(smrzr_fp_file_t * file, u_char * buf, ngx_str_t * key)
+{
+    ngx_memcpy(buf, &file->uniq, sizeof(ngx_file_uniq_t));
+    ngx_memcpy(buf + sizeof(ngx_file_uniq_t), &file->name_hash,
+               sizeof(uint32_t));
+
+    key->len = SMRZR_FP_KEY_LEN;
+    key->data = buf;
+}
+
+ngx_int_t
+smrzr_fp_lookup(
+    smrzr_zone_t        * zone,
+    smrzr_fp_file_t     * file)
+{
+    smrzr_fp_node_t     * fn;
+    u_char                buf[SMRZR_FP_KEY_LEN];
+    ngx_str_t             key;
+    ngx_int_t             rc = NGX_DECLINED;
+
+    s_smrzr_fp_key(file, buf, &key);
+
+    ngx_shmtx_lock(&zone->shpool->mutex);
+
+    fn = (smrzr_fp_node_t *) smrzr_zone_find(zone, &key);
+
+    if(NULL != fn && fn->mtime == file->mtime && fn->size == file->size) {
+        smrzr_zone_touch(zone, &fn->zn);
+
+        ngx_memcpy(file->fp, fn->fp, SMRZR_FP_LEN);
+        rc = NGX_OK;
+    }
+
+    ngx_shmtx_unlock(&zone->shpool->mutex);
+
+    return(rc);
+}
+
+void
+smrzr_fp_store(
+    smrzr_zone_t        * zone,
+    smrzr_fp_file_t     * file)
+{
+    smrzr_fp_node_t     * fn;
+    u_char                buf[SMRZR_FP_KEY_LEN];
+    ngx_str_t             key;
+
+    s_smrzr_fp_key(file, buf, &key);
+
+    ngx_shmtx_lock(&zone->shpool->mutex);
+
+    if(NULL != (fn = (smrzr_fp_node_t *) smrzr_zone_find(zone, &key))) {
+        /* a new version of the file */
+        smrzr_zone_touch(zone, &fn->zn);
+
+    } else {
+        fn = (smrzr_fp_node_t *) smrzr_zone_insert(zone, &key,
+                                                   sizeof(smrzr_fp_node_t),
+                                                   NULL, NULL);
+        if(NULL == fn) {
+            ngx_shmtx_unlock(&zone->shpool->mutex);
+            return;
+        }
+    }
+
+    fn->mtime = file->mtime;
+    fn->size = file->size;
+    ngx_memcpy(fn->fp, file->fp, SMRZR_FP_LEN);
+
+    ngx_shmtx_unlock(&zone->shpool->mutex);
+}
+
+void
+smrzr_fp_read(
+    smrzr_fp_file_t     * file,
+    ngx_log_t           * log)
+{
+    ngx_fd_t              fd;
+    ssize_t               n;
+    ngx_md5_t             md5;
+    ngx_file_info_t       fi;
+
+    file->err = 0;
+
+    fd = ngx_open_file(file->path, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if(NGX_INVALID_FILE == fd) {
+        file->err = ngx_errno;
+        ngx_log_error(NGX_LOG_ERR, log, file->err,
+            ngx_open_file_n " \"%s\" failed", file->path);
+        return;
+    }
+
+    ngx_md5_init(&md5);
+
+    for( ;; ) {
+        n = ngx_read_fd(fd, file->buf, file->buf_size);
+
+        if(n == -1) {
+            file->err = ngx_errno;
+            ngx_log_error(NGX_LOG_ERR, log, file->err,
+                ngx_read_fd_n " \"%s\" failed", file->path);
+            break;
+        }
+
+        if(n == 0) {
+            break;
+        }
+
+        ngx_md5_update(&md5, file->buf, n);
+    }
+
+    /* the hash must belong to the version it is memoized for */
+    if(0 == file->err
+       && (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR
+           || ngx_file_mtime(&fi) != file->mtime
+           || ngx_file_size(&fi) != file->size))
+    {
+        file->err = NGX_EAGAIN;
+        ngx_log_error(NGX_LOG_INFO, log, 0,
+            "\"%s\" changed while fingerprinting", file->path);
+    }
+
+    ngx_close_file(fd);
+
+    ngx_md5_final(file->fp, &md5);
+}
+
+void
+smrzr_fp_chain(
+    ngx_chain_t         * in,
+    u_char              * fp)
+{
+    ngx_md5_t             md5;
+
+    ngx_md5_init(&md5);
+
+    for( ; in; in = in->next) {
+        ngx_md5_update(&md5, in->buf->pos, in->buf->last - in->buf->pos);
+    }
+
+    ngx_md5_final(fp, &md5);
+}
+
+smrzr_zone_t*
+smrzr_fp_zone_create(
+    ngx_conf_t          * cf,
+    ngx_str_t           * name,
+    size_t                size,
+    void                * tag)
+{
+    /* the zone is a memo, dropping entries is fine */
+    return(smrzr_zone_create(cf, name, size, tag, s_smrzr_fp_directive));
+}
@@ -0,0 +1,59 @@
+/*
+ * Content fingerprints of documents, memoized per file version
+ */
+
+#ifndef NGX_HTTP_SUMMARIZER_FINGERPRINT_H
+#define NGX_HTTP_SUMMARIZER_FINGERPRINT_H
+
+/* TYPES */
+
+#define SMRZR_FP_LEN           16      /* md5 */
+
+/* Memo entry, in a summarizer_dedup zone: a file version and its
+ * fingerprint */
+typedef struct {
+    smrzr_zone_node_t  zn;             /* key: file uniq and name hash */
+    time_t             mtime;
+    off_t              size;
+    u_char             fp[SMRZR_FP_LEN];
+} smrzr_fp_node_t;
+
+/* A file version and its fingerprint */
+typedef struct {
+    u_char           * path;           /* null terminated */
+    ngx_file_uniq_t    uniq;
+    uint32_t           name_hash;
+    time_t             mtime;
+    off_t              size;
+    u_char           * buf;            /* read buffer, allocated by caller */
+    size_t             buf_size;
+    u_char             fp[SMRZR_FP_LEN];
+    ngx_err_t          err;
+} smrzr_fp_file_t;
+
+/* PROTOTYPES */
+
+/* create zone, or get the one of the same name */
+smrzr_zone_t*
+smrzr_fp_zone_create(ngx_conf_t * cf, ngx_str_t * name, size_t size,
+                     void * tag);
+
+/* fill in the memoized fingerprint of the file version; NGX_DECLINED if
+ * there is none */
+ngx_int_t
+smrzr_fp_lookup(smrzr_zone_t * zone, smrzr_fp_file_t * file);
+
+/* memoize the fingerprint of the file version */
+void
+smrzr_fp_store(smrzr_zone_t * zone, smrzr_fp_file_t * file);
+
+/* hash the file; does not allocate, so it may run in a thread pool. err is
+ * NGX_EAGAIN if the file changed meanwhile. */
+void
+smrzr_fp_read(smrzr_fp_file_t * file, ngx_log_t * log);
+
+/* hash in-memory buffers */
+void
+smrzr_fp_chain(ngx_chain_t * in, u_char * fp);
+
+#endif /* NGX_HTTP_SUMMARIZER_FINGERPRINT_H */
@@ -0,0 +1,125 @@
+/*
+ * Ranking state of growing documents, kept per file for incremental
+ * summaries
+ *
+ * The daemon returns an opaque state with a summary, covering the file up
+ * to some offset; sent back with the next request for the file it lets
+ * the daemon rank only what was appended since. States are kept in a zone
+ * keyed by ratio and file name, and are dropped least recently used first
+ * when it is full.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_md5.h>
+#include "ngx_http_summarizer_zone.h"
+#include "ngx_http_summarizer_incr.h"
+
+static char  s_smrzr_incr_directive[] = "summarizer_incremental";
+
+/* FUNCTION DEFINITIONS */
+
+/* the key is as long as the file name, its md5 is kept instead */
+static void
+s_smrzr_incr_key(ngx_str_t * key, u_char * md5)
+{
+    ngx_md5_t             ctx;
+
+    ngx_md5_init(&ctx);
+    ngx_md5_update(&ctx, key->data, key->len);
+    ngx_md5_final(md5, &ctx);
+}
+
+ngx_int_t
+smrzr_incr_lookup(
+    smrzr_zone_t        * zone,
+    smrzr_incr_state_t  * st,
+    ngx_pool_t          * pool)
+{
+    smrzr_incr_node_t   * in;
+    u_char                md5[SMRZR_INCR_KEY_LEN];
+    ngx_str_t             key;
+    ngx_int_t             rc = NGX_DECLINED;
+
+    s_smrzr_incr_key(&st->key, md5);
+
+    key.len = SMRZR_INCR_KEY_LEN;
+    key.data = md5;
+
+    ngx_shmtx_lock(&zone->shpool->mutex);
+
+    in = (smrzr_incr_node_t *) smrzr_zone_find(zone, &key);
+
+    if(NULL == in || in->uniq != st->uniq) {
+        goto done;
+    }
+
+    if(NULL == (st->state.data = ngx_pnalloc(pool, in->len))) {
+        rc = NGX_ERROR;
+        goto done;
+    }
+
+    ngx_memcpy(st->state.data, in->data, in->len);
+    st->state.len = in->len;
+    st->offset = in->offset;
+
+    smrzr_zone_touch(zone, &in->zn);
+
+    rc = NGX_OK;
+
+done:
+
+    ngx_shmtx_unlock(&zone->shpool->mutex);
+
+    return(rc);
+}
+
+void
+smrzr_incr_store(
+    smrzr_zone_t        * zone,
+    smrzr_incr_state_t  * st)
+{
+    smrzr_zone_node_t   * zn;
+    smrzr_incr_node_t   * in;
+    u_char                md5[SMRZR_INCR_KEY_LEN];
+    ngx_str_t             key;
+
+    s_smrzr_incr_key(&st->key, md5);
+
+    key.len = SMRZR_INCR_KEY_LEN;
+    key.data = md5;
+
+    ngx_shmtx_lock(&zone->shpool->mutex);
+
+    /* states differ in size, the previous one is not reused */
+    if(NULL != (zn = smrzr_zone_find(zone, &key))) {
+        smrzr_zone_free(zone, zn);
+    }
+
+    zn = smrzr_zone_insert(zone, &key,
+                           offsetof(smrzr_incr_node_t, data) + st->state.len,
+                           NULL, NULL);
+
+    if(NULL != zn) {
+        in = (smrzr_incr_node_t *) zn;
+
+        in->uniq = st->uniq;
+        in->offset = st->offset;
+        in->len = st->state.len;
+        ngx_memcpy(in->data, st->state.data, st->state.len);
+    }
+
+    ngx_shmtx_unlock(&zone->shpool->mutex);
+}
+
+smrzr_zone_t*
+smrzr_incr_zone_create(
+    ngx_conf_t          * cf,
+    ngx_str_t           * name,
+    size_t                size,
+    void                * tag)
+{
+    /* a dropped state only costs a full summary */
+    return(smrzr_zone_create(cf, name, size, tag, s_smrzr_incr_directive));
+}
@@ -0,0 +1,49 @@
+/*
+ * Ranking state of growing documents, kept per file for incremental
+ * summaries
+ */
+
+#ifndef NGX_HTTP_SUMMARIZER_INCR_H
+#define NGX_HTTP_SUMMARIZER_INCR_H
+
+/* TYPES */
+
+#define SMRZR_INCR_KEY_LEN     16      /* md5 of ratio and file name */
+
+/* State entry, in a summarizer_incremental zone; the state follows the
+ * node */
+typedef struct {
+    smrzr_zone_node_t  zn;             /* key: md5 of ratio and name */
+    ngx_file_uniq_t    uniq;
+    off_t              offset;
+    size_t             len;
+    u_char             data[1];
+} smrzr_incr_node_t;
+
+/* The state of the daemon's ranking over the first offset bytes of a
+ * file */
+typedef struct {
+    ngx_str_t          key;            /* ratio and file name */
+    ngx_file_uniq_t    uniq;
+    off_t              offset;
+    ngx_str_t          state;          /* opaque to nginx */
+} smrzr_incr_state_t;
+
+/* PROTOTYPES */
+
+/* create zone, or get the one of the same name */
+smrzr_zone_t*
+smrzr_incr_zone_create(ngx_conf_t * cf, ngx_str_t * name, size_t size,
+                       void * tag);
+
+/* fill in offset and state (copied to pool) for the key and uniq;
+ * NGX_DECLINED if there are none, e.g. the file was replaced */
+ngx_int_t
+smrzr_incr_lookup(smrzr_zone_t * zone, smrzr_incr_state_t * st,
+                  ngx_pool_t * pool);
+
+/* keep the state for the key, replacing the previous one */
+void
+smrzr_incr_store(smrzr_zone_t * zone, smrzr_incr_state_t * st);
+
+#endif /* NGX_HTTP_SUMMARIZER_INCR_H */
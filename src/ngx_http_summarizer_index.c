@@ -0,0 +1,207 @@
+/*
+ * Precomputed summary index
+ *
+ * Built offline by util/smrzr_build_index.py and mapped read-only by every
+ * worker; summaries are sent from the index file with sendfile.
+ */
+
+#include <sys/mman.h>
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "ngx_http_summarizer_index.h"
+
+/* LOCAL GLOBALS */
+
+static const size_t szhdr = sizeof(smrzr_index_header_t),
+                    szent = sizeof(smrzr_index_entry_t);
+
+/* FUNCTION DEFINITIONS */
+
+#define INDEX_OFF(hi, lo)  (((uint64_t)ntohl(hi) << 32) | ntohl(lo))
+
+#define INDEX_RATIO(ratio) ((uint32_t)((ratio) * 100 + 0.5))
+
+/* create index descriptor */
+smrzr_index_t*
+smrzr_index_create(
+    ngx_conf_t     * cf,
+    ngx_str_t      * path)
+{
+    smrzr_index_t  * idx;
+
+    if(NULL == (idx = ngx_pcalloc(cf->pool, sizeof(smrzr_index_t)))) {
+        return(NULL);
+    }
+
+    idx->path = *path;
+
+    /* relative to prefix; result is null terminated */
+    if(NGX_OK != ngx_conf_full_name(cf->cycle, &idx->path, 0)) {
+        return(NULL);
+    }
+
+    idx->fd = NGX_INVALID_FILE;
+
+    return(idx);
+}
+
+/* open and map index (worker start) */
+ngx_int_t
+smrzr_index_open(
+    smrzr_index_t  * idx,
+    ngx_log_t      * log)
+{
+    ngx_file_info_t          fi;
+    smrzr_index_header_t   * hdr;
+
+    idx->log = log;
+
+    idx->fd = ngx_open_file(idx->path.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if(NGX_INVALID_FILE == idx->fd) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+            ngx_open_file_n " \"%V\" failed", &idx->path);
+        return(NGX_ERROR);
+    }
+
+    if(NGX_FILE_ERROR == ngx_fd_info(idx->fd, &fi)) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+            ngx_fd_info_n " \"%V\" failed", &idx->path);
+        goto failed;
+    }
+
+    idx->size = (size_t)ngx_file_size(&fi);
+
+    if(idx->size < szhdr) {
+        ngx_log_error(NGX_LOG_ALERT, log, 0,
+            "summarizer index \"%V\" is too small", &idx->path);
+        goto failed;
+    }
+
+    idx->addr = mmap(NULL, idx->size, PROT_READ, MAP_SHARED, idx->fd, 0);
+
+    if(MAP_FAILED == idx->addr) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+            "mmap(\"%V\") failed", &idx->path);
+        idx->addr = NULL;
+        goto failed;
+    }
+
+    hdr = (smrzr_index_header_t*)idx->addr;
+
+    if(SMRZR_INDEX_MAGIC != ntohl(hdr->magic)
+       || SMRZR_INDEX_VERSION != ntohl(hdr->version)
+       || (idx->size - szhdr) / szent < ntohl(hdr->count))
+    {
+        ngx_log_error(NGX_LOG_ALERT, log, 0,
+            "summarizer index \"%V\" is invalid", &idx->path);
+        goto failed;
+    }
+
+    idx->count = ntohl(hdr->count);
+
+    ngx_log_error(NGX_LOG_INFO, log, 0,
+        "summarizer index \"%V\": %uD summaries", &idx->path, idx->count);
+
+    return(NGX_OK);
+
+failed:
+
+    smrzr_index_close(idx);
+
+    return(NGX_ERROR);
+}
+
+/* unmap and close index (worker exit) */
+void
+smrzr_index_close(smrzr_index_t * idx)
+{
+    if(NULL != idx->addr) {
+        munmap(idx->addr, idx->size);
+        idx->addr = NULL;
+    }
+
+    if(NGX_INVALID_FILE != idx->fd) {
+        ngx_close_file(idx->fd);
+        idx->fd = NGX_INVALID_FILE;
+    }
+
+    idx->count = 0;
+}
+
+/* find summary; NGX_DECLINED if absent */
+ngx_int_t
+smrzr_index_lookup(
+    smrzr_index_t  * idx,
+    ngx_str_t      * name,
+    float            ratio,
+    off_t          * offset,
+    size_t         * len)
+{
+    smrzr_index_entry_t    * ent, * e;
+    uint32_t                 hash, r;
+    ngx_uint_t               lo, hi, mid;
+    uint64_t                 off, slen;
+
+    if(0 == idx->count) {
+        return(NGX_DECLINED);
+    }
+
+    ent = (smrzr_index_entry_t*)(idx->addr + szhdr);
+
+    hash = ngx_crc32_long(name->data, name->len);
+    r = INDEX_RATIO(ratio);
+
+    /* lower bound of (hash, ratio) */
+    lo = 0;
+    hi = idx->count;
+
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        e = &ent[mid];
+
+        if(ntohl(e->hash) < hash
+           || (ntohl(e->hash) == hash && ntohl(e->ratio) < r))
+        {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    /* crc32 collisions: compare names */
+    for( ; lo < idx->count; ++lo) {
+        e = &ent[lo];
+
+        if(ntohl(e->hash) != hash || ntohl(e->ratio) != r) {
+            break;
+        }
+
+        off = INDEX_OFF(e->name_off_hi, e->name_off_lo);
+
+        if(ntohl(e->name_len) != name->len
+           || off + name->len > idx->size
+           || 0 != ngx_memcmp(idx->addr + off, name->data, name->len))
+        {
+            continue;
+        }
+
+        off = INDEX_OFF(e->summary_off_hi, e->summary_off_lo);
+        slen = ntohl(e->summary_len);
+
+        if(off + slen > idx->size) {
+            ngx_log_error(NGX_LOG_ERR, idx->log, 0,
+                "summarizer index \"%V\": entry %ui out of bounds",
+                &idx->path, lo);
+            return(NGX_DECLINED);
+        }
+
+        *offset = (off_t)off;
+        *len = (size_t)slen;
+
+        return(NGX_OK);
+    }
+
+    return(NGX_DECLINED);
+}
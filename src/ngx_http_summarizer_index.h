@@ -0,0 +1,68 @@
+/*
+ * Precomputed summary index
+ */
+
+#ifndef NGX_HTTP_SUMMARIZER_INDEX_H
+#define NGX_HTTP_SUMMARIZER_INDEX_H
+
+/* TYPES */
+
+#define SMRZR_INDEX_MAGIC      0x534d5249   /* "SMRI" */
+#define SMRZR_INDEX_VERSION    1
+
+/*
+ * File layout; all integers in network byte order:
+ *
+ *   header  = magic [4] . version [4] . count [4] . reserved [4]
+ *   entries = count * entry, sorted by (hash, ratio)
+ *   data    = file names and summaries, anywhere after the entries
+ */
+
+typedef struct {
+    uint32_t           magic;
+    uint32_t           version;
+    uint32_t           count;
+    uint32_t           reserved;
+} smrzr_index_header_t;
+
+typedef struct {
+    uint32_t           hash;           /* crc32 of the file name */
+    uint32_t           ratio;          /* ratio * 100, rounded */
+    uint32_t           name_off_hi;
+    uint32_t           name_off_lo;
+    uint32_t           summary_off_hi;
+    uint32_t           summary_off_lo;
+    uint32_t           name_len;
+    uint32_t           summary_len;
+} smrzr_index_entry_t;
+
+/* An index mapped by a worker */
+typedef struct {
+    ngx_str_t          path;           /* null terminated */
+    ngx_fd_t           fd;
+    u_char           * addr;
+    size_t             size;
+    uint32_t           count;
+    ngx_log_t        * log;
+} smrzr_index_t;
+
+/* PROTOTYPES */
+
+/* create index descriptor */
+smrzr_index_t*
+smrzr_index_create(ngx_conf_t * cf, ngx_str_t * path);
+
+/* open and map index (worker start) */
+ngx_int_t
+smrzr_index_open(smrzr_index_t * idx, ngx_log_t * log);
+
+/* unmap and close index (worker exit) */
+void
+smrzr_index_close(smrzr_index_t * idx);
+
+/* find summary; NGX_DECLINED if absent */
+ngx_int_t
+smrzr_index_lookup(smrzr_index_t * idx, ngx_str_t * name, float ratio,
+                   off_t * offset, size_t * len);
+
+#endif /* NGX_HTTP_SUMMARIZER_INDEX_H */
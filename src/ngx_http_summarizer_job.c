@@ -0,0 +1,290 @@
+/*
+ * Summaries of asynchronous requests, kept for later retrieval
+ *
+ * Jobs are kept in a zone keyed by their id, in the order they were
+ * created. Expired jobs, and then the oldest finished ones, make room for
+ * new jobs and summaries; pending jobs are only dropped once expired.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "ngx_http_summarizer_zone.h"
+#include "ngx_http_summarizer_job.h"
+
+#if (NGX_OPENSSL)
+#include <openssl/rand.h>
+#endif
+
+/* the id is hex of as many random bytes */
+#define SMRZR_JOB_ID_RAND_LEN  (SMRZR_JOB_ID_LEN / 2)
+
+static char      s_smrzr_job_directive[] = "summarizer_jobs";
+
+#if !(NGX_OPENSSL)
+static ngx_fd_t  s_smrzr_job_urandom = NGX_INVALID_FILE;
+#endif
+
+/* FUNCTION DEFINITIONS */
+
+/* ids are what a job is fetched by, so they must not be guessable */
+static ngx_int_t
+s_smrzr_job_random(u_char * buf, size_t len, ngx_log_t * log)
+{
+#if (NGX_OPENSSL)
+
+    if(1 != RAND_bytes(buf, (int) len)) {
+        ngx_log_error(NGX_LOG_ALERT, log, 0,
+            "summarizer job RAND_bytes() failed");
+        return(NGX_ERROR);
+    }
+
+    return(NGX_OK);
+
+#else
+
+    ssize_t               n;
+
+    if(NGX_INVALID_FILE == s_smrzr_job_urandom) {
+        ngx_log_error(NGX_LOG_ALERT, log, 0,
+            "summarizer job ids need /dev/urandom");
+        return(NGX_ERROR);
+    }
+
+    n = read(s_smrzr_job_urandom, buf, len);
+
+    if(n != (ssize_t) len) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+            "summarizer job read(/dev/urandom) failed");
+        return(NGX_ERROR);
+    }
+
+    return(NGX_OK);
+
+#endif
+}
+
+ngx_int_t
+smrzr_job_init_process(ngx_log_t * log)
+{
+#if !(NGX_OPENSSL)
+
+    if(NGX_INVALID_FILE != s_smrzr_job_urandom) {
+        return(NGX_OK);
+    }
+
+    s_smrzr_job_urandom = ngx_open_file("/dev/urandom", NGX_FILE_RDONLY,
+                                        NGX_FILE_OPEN, 0);
+
+    if(NGX_INVALID_FILE == s_smrzr_job_urandom) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+            ngx_open_file_n " \"/dev/urandom\" failed");
+        return(NGX_ERROR);
+    }
+
+#endif
+
+    return(NGX_OK);
+}
+
+void
+smrzr_job_exit_process(void)
+{
+#if !(NGX_OPENSSL)
+
+    if(NGX_INVALID_FILE != s_smrzr_job_urandom) {
+        (void) ngx_close_file(s_smrzr_job_urandom);
+        s_smrzr_job_urandom = NGX_INVALID_FILE;
+    }
+
+#endif
+}
+
+static void
+s_smrzr_job_cleanup(smrzr_zone_t * zone, smrzr_zone_node_t * zn)
+{
+    smrzr_job_node_t    * jn = (smrzr_job_node_t *) zn;
+
+    if(NULL != jn->data) {
+        ngx_slab_free_locked(zone->shpool, jn->data);
+    }
+}
+
+/* expired or finished jobs make room, but not the one given */
+static ngx_int_t
+s_smrzr_job_evictable(smrzr_zone_node_t * zn, void * keep)
+{
+    smrzr_job_node_t    * jn = (smrzr_job_node_t *) zn;
+
+    return((void *) jn != keep
+           && (SMRZR_JOB_PENDING != jn->state || jn->expires <= ngx_time()));
+}
+
+ngx_int_t
+smrzr_job_create(
+    smrzr_zone_t        * zone,
+    u_char              * id,
+    time_t                valid,
+    ngx_log_t           * log)
+{
+    smrzr_job_node_t    * jn;
+    u_char                rnd[SMRZR_JOB_ID_RAND_LEN];
+    ngx_str_t             key;
+    ngx_uint_t            i;
+
+    if(NGX_OK != s_smrzr_job_random(rnd, sizeof(rnd), log)) {
+        return(NGX_ERROR);
+    }
+
+    ngx_hex_dump(id, rnd, sizeof(rnd));
+
+    key.len = SMRZR_JOB_ID_LEN;
+    key.data = id;
+
+    ngx_shmtx_lock(&zone->shpool->mutex);
+
+    /* keep the zone from filling up with expired jobs */
+    for(i = 0; i < 2; i++) {
+        jn = (smrzr_job_node_t *) smrzr_zone_oldest(zone);
+
+        if(NULL == jn || jn->expires > ngx_time()) {
+            break;
+        }
+
+        smrzr_zone_free(zone, &jn->zn);
+    }
+
+    jn = (smrzr_job_node_t *) smrzr_zone_insert(zone, &key,
+                                                sizeof(smrzr_job_node_t),
+                                                s_smrzr_job_evictable, NULL);
+    if(NULL == jn) {
+        ngx_shmtx_unlock(&zone->shpool->mutex);
+        return(NGX_DECLINED);
+    }
+
+    jn->state = SMRZR_JOB_PENDING;
+    jn->expires = ngx_time() + valid;
+
+    ngx_shmtx_unlock(&zone->shpool->mutex);
+
+    return(NGX_OK);
+}
+
+void
+smrzr_job_finish(
+    smrzr_zone_t        * zone,
+    u_char              * id,
+    ngx_uint_t            status,
+    ngx_str_t           * summary,
+    time_t                valid,
+    ngx_log_t           * log)
+{
+    smrzr_job_node_t    * jn;
+    ngx_str_t             key;
+
+    key.len = SMRZR_JOB_ID_LEN;
+    key.data = id;
+
+    ngx_shmtx_lock(&zone->shpool->mutex);
+
+    jn = (smrzr_job_node_t *) smrzr_zone_find(zone, &key);
+
+    /* expired and dropped meanwhile */
+    if(NULL == jn) {
+        ngx_shmtx_unlock(&zone->shpool->mutex);
+        return;
+    }
+
+    jn->state = (NULL != summary) ? SMRZR_JOB_DONE : SMRZR_JOB_FAILED;
+    jn->status = status;
+    jn->expires = ngx_time() + valid;
+
+    if(NULL != summary && 0 != summary->len) {
+        jn->data = smrzr_zone_alloc(zone, summary->len,
+                                    s_smrzr_job_evictable, jn);
+
+        if(NULL == jn->data) {
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                "summarizer job %*s: no room for a %uz bytes summary",
+                (size_t) SMRZR_JOB_ID_LEN, id, summary->len);
+
+            jn->state = SMRZR_JOB_FAILED;
+            jn->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+        } else {
+            ngx_memcpy(jn->data, summary->data, summary->len);
+            jn->len = summary->len;
+        }
+    }
+
+    ngx_shmtx_unlock(&zone->shpool->mutex);
+}
+
+ngx_int_t
+smrzr_job_get(
+    smrzr_zone_t        * zone,
+    ngx_str_t           * id,
+    ngx_pool_t          * pool,
+    smrzr_job_t         * job)
+{
+    smrzr_job_node_t    * jn;
+    ngx_int_t             rc = NGX_DECLINED;
+
+    if(SMRZR_JOB_ID_LEN != id->len) {
+        return(NGX_DECLINED);
+    }
+
+    ngx_shmtx_lock(&zone->shpool->mutex);
+
+    jn = (smrzr_job_node_t *) smrzr_zone_find(zone, id);
+
+    if(NULL == jn || jn->expires <= ngx_time()) {
+        goto done;
+    }
+
+    job->state = jn->state;
+    job->status = jn->status;
+    job->summary.len = jn->len;
+    job->summary.data = NULL;
+
+    if(0 != jn->len) {
+        if(NULL == (job->summary.data = ngx_pnalloc(pool, jn->len))) {
+            rc = NGX_ERROR;
+            goto done;
+        }
+
+        ngx_memcpy(job->summary.data, jn->data, jn->len);
+    }
+
+    rc = NGX_OK;
+
+done:
+
+    ngx_shmtx_unlock(&zone->shpool->mutex);
+
+    return(rc);
+}
+
+smrzr_zone_t*
+smrzr_job_zone_get(ngx_shm_zone_t * shm_zone)
+{
+    return(smrzr_zone_get(shm_zone, s_smrzr_job_directive));
+}
+
+smrzr_zone_t*
+smrzr_job_zone_create(
+    ngx_conf_t          * cf,
+    ngx_str_t           * name,
+    size_t                size,
+    void                * tag)
+{
+    smrzr_zone_t        * zone;
+
+    zone = smrzr_zone_create(cf, name, size, tag, s_smrzr_job_directive);
+
+    if(NULL != zone) {
+        zone->cleanup = s_smrzr_job_cleanup;
+    }
+
+    return(zone);
+}
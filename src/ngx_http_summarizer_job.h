@@ -0,0 +1,71 @@
+/*
+ * Summaries of asynchronous requests, kept for later retrieval
+ */
+
+#ifndef NGX_HTTP_SUMMARIZER_JOB_H
+#define NGX_HTTP_SUMMARIZER_JOB_H
+
+/* TYPES */
+
+#define SMRZR_JOB_ID_LEN       32      /* hex */
+
+typedef enum {
+    SMRZR_JOB_PENDING = 0,
+    SMRZR_JOB_DONE,
+    SMRZR_JOB_FAILED
+} smrzr_job_state_t;
+
+/* A job and, once done, its summary, in a summarizer_jobs zone */
+typedef struct {
+    smrzr_zone_node_t  zn;             /* key: the id */
+    smrzr_job_state_t  state;
+    ngx_uint_t         status;         /* http status when finished */
+    time_t             expires;
+    size_t             len;
+    u_char           * data;
+} smrzr_job_node_t;
+
+/* A job as read from the zone */
+typedef struct {
+    smrzr_job_state_t  state;
+    ngx_uint_t         status;
+    ngx_str_t          summary;        /* copy, in the caller's pool */
+} smrzr_job_t;
+
+/* PROTOTYPES */
+
+/* create zone, or get the one of the same name */
+smrzr_zone_t*
+smrzr_job_zone_create(ngx_conf_t * cf, ngx_str_t * name, size_t size,
+                      void * tag);
+
+/* the job zone of a shared memory zone, NULL if it is not one */
+smrzr_zone_t*
+smrzr_job_zone_get(ngx_shm_zone_t * shm_zone);
+
+/* open what job ids are drawn from, in a worker */
+ngx_int_t
+smrzr_job_init_process(ngx_log_t * log);
+
+void
+smrzr_job_exit_process(void);
+
+/* add a pending job, kept for valid seconds, and write its new random id;
+ * NGX_DECLINED if the zone is full of live jobs, NGX_ERROR if there was
+ * no randomness */
+ngx_int_t
+smrzr_job_create(smrzr_zone_t * zone, u_char * id, time_t valid,
+                 ngx_log_t * log);
+
+/* record the outcome of a job, kept for valid seconds from now; a summary
+ * that does not fit in the zone fails the job */
+void
+smrzr_job_finish(smrzr_zone_t * zone, u_char * id, ngx_uint_t status,
+                 ngx_str_t * summary, time_t valid, ngx_log_t * log);
+
+/* copy a job out; NGX_DECLINED if it is unknown or expired */
+ngx_int_t
+smrzr_job_get(smrzr_zone_t * zone, ngx_str_t * id, ngx_pool_t * pool,
+              smrzr_job_t * job);
+
+#endif /* NGX_HTTP_SUMMARIZER_JOB_H */
@@ -0,0 +1,142 @@
+/*
+ * Lead sentences of a document, the in-nginx fallback summary
+ */
+
+#include <ctype.h>
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "ngx_http_summarizer_lead.h"
+
+/* FUNCTION DEFINITIONS */
+
+/* end of sentence: terminator followed by white space, or blank line */
+#define IS_SENTENCE_END(p, i, len) \
+    ((((p)[i] == '.' || (p)[i] == '!' || (p)[i] == '?') \
+      && ((i) + 1 == (len) || isspace((p)[(i) + 1]))) \
+     || ((p)[i] == '\n' && (i) + 1 < (len) && (p)[(i) + 1] == '\n'))
+
+/* offset just past the n-th sentence, or len; *count gets the sentences
+ * seen */
+static size_t
+s_smrzr_lead_scan(u_char * p, size_t len, ngx_uint_t n, ngx_uint_t * count)
+{
+    size_t         i;
+    ngx_uint_t     in_sentence = 0;
+
+    *count = 0;
+
+    for(i = 0; i < len; ++i) {
+        if(IS_SENTENCE_END(p, i, len)) {
+            if(in_sentence && ++(*count) == n) {
+                return(i + 1);
+            }
+            in_sentence = 0;
+        } else if(!isspace(p[i])) {
+            in_sentence = 1;
+        }
+    }
+
+    if(in_sentence) {
+        ++(*count);
+    }
+
+    return(len);
+}
+
+/* length of the first ratio % of sentences, at least one */
+size_t
+smrzr_lead_cut(u_char * p, size_t len, float ratio)
+{
+    ngx_uint_t     total, want;
+
+    (void)s_smrzr_lead_scan(p, len, 0, &total);
+
+    want = (ngx_uint_t)(total * ratio / 100 + 0.999);
+
+    if(0 == want) {
+        want = 1;
+    }
+
+    return(s_smrzr_lead_scan(p, len, want, &total));
+}
+
+/* read up to max bytes of the file and cut it after ratio % of sentences */
+void
+smrzr_lead_read(
+    smrzr_lead_t   * lead,
+    ngx_log_t      * log)
+{
+    ngx_fd_t         fd;
+    ssize_t          n;
+    size_t           len = 0;
+
+    lead->len = 0;
+    lead->err = 0;
+
+    fd = ngx_open_file(lead->path, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if(NGX_INVALID_FILE == fd) {
+        lead->err = ngx_errno;
+        ngx_log_error(NGX_LOG_ERR, log, lead->err,
+            ngx_open_file_n " \"%s\" failed", lead->path);
+        return;
+    }
+
+    while(len < lead->max) {
+        n = ngx_read_fd(fd, lead->buf + len, lead->max - len);
+
+        if(n == -1) {
+            lead->err = ngx_errno;
+            ngx_log_error(NGX_LOG_ERR, log, lead->err,
+                ngx_read_fd_n " \"%s\" failed", lead->path);
+            break;
+        }
+
+        if(n == 0) {
+            break;
+        }
+
+        len += n;
+    }
+
+    ngx_close_file(fd);
+
+    if(0 == lead->err) {
+        lead->len = smrzr_lead_cut(lead->buf, len, lead->ratio);
+    }
+}
+
+off_t
+smrzr_lead_align(
+    ngx_file_t     * file,
+    off_t            offset,
+    u_char         * buf,
+    size_t           size)
+{
+    ssize_t          n;
+    size_t           i;
+
+    n = ngx_read_file(file, buf, size, offset);
+
+    if(n <= 0) {
+        return(offset);
+    }
+
+    /* the window end is not the end of a sentence */
+    for(i = 0; i + 1 < (size_t)n; ++i) {
+        if(IS_SENTENCE_END(buf, i, (size_t)n)) {
+            break;
+        }
+    }
+
+    if(i + 1 >= (size_t)n) {
+        return(offset);
+    }
+
+    for(++i; i < (size_t)n && isspace(buf[i]); ++i) {
+        /* void */
+    }
+
+    return(offset + i);
+}
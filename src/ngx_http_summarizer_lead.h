@@ -0,0 +1,35 @@
+/*
+ * Lead sentences of a document, the in-nginx fallback summary
+ */
+
+#ifndef NGX_HTTP_SUMMARIZER_LEAD_H
+#define NGX_HTTP_SUMMARIZER_LEAD_H
+
+/* TYPES */
+
+typedef struct {
+    u_char           * path;           /* null terminated */
+    float              ratio;
+    u_char           * buf;            /* max bytes, allocated by caller */
+    size_t             max;
+    size_t             len;            /* out: length of the lead */
+    ngx_err_t          err;            /* out: open/read error */
+} smrzr_lead_t;
+
+/* PROTOTYPES */
+
+/* length of the first ratio % of sentences in p */
+size_t
+smrzr_lead_cut(u_char * p, size_t len, float ratio);
+
+/* start of the first sentence after offset, looking at most size bytes
+ * ahead (buf is scratch space of size bytes); offset if there is none */
+off_t
+smrzr_lead_align(ngx_file_t * file, off_t offset, u_char * buf, size_t size);
+
+/* read up to max bytes of the file and cut it after ratio % of sentences;
+ * does not allocate, so it may run in a thread pool */
+void
+smrzr_lead_read(smrzr_lead_t * lead, ngx_log_t * log);
+
+#endif /* NGX_HTTP_SUMMARIZER_LEAD_H */
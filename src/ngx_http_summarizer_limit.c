@@ -0,0 +1,311 @@
+/*
+ * Per client budget of document bytes sent for summarization
+ *
+ * A leaky bucket per key, like limit_req, but filled with the size of the
+ * documents instead of one per request and drained at rate bytes per
+ * second. Buckets live in an rbtree in the zone; idle ones are expired
+ * from the tail of an LRU queue.
+ *
+ * A bucket keeps the bytes of each priority apart and drains the lowest
+ * priority number first, so a request only waits for the documents of its
+ * own and more urgent priorities. Across keys, the zone counts the bytes
+ * of the delayed requests of each priority, and a request holds back
+ * while more urgent ones of any key are delayed. A priority nobody was
+ * delayed at for a minute is taken as idle, in case a worker died with
+ * delayed requests.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "ngx_http_summarizer_zone.h"
+#include "ngx_http_summarizer_limit.h"
+
+static char  s_smrzr_limit_directive[] = "summarizer_limit_zone";
+
+/* FUNCTION DEFINITIONS */
+
+/* bytes drained in ms */
+static uint64_t
+s_smrzr_limit_drained(uint64_t rate, ngx_msec_int_t ms)
+{
+    if(ms <= 0) {
+        return(0);
+    }
+
+    return((ms >= 3600000) ? (uint64_t) -1 : rate * (uint64_t) ms / 1000);
+}
+
+/* drain the bucket for ms, most urgent bytes first */
+static void
+s_smrzr_limit_drain(smrzr_limit_node_t * ln, uint64_t rate, ngx_msec_int_t ms)
+{
+    uint64_t             drained;
+    ngx_uint_t           i;
+
+    drained = s_smrzr_limit_drained(rate, ms);
+
+    for(i = 0; i < SMRZR_LIMIT_CLASSES && drained; i++) {
+
+        if(ln->excess[i] > drained) {
+            ln->excess[i] -= drained;
+            return;
+        }
+
+        drained -= ln->excess[i];
+        ln->excess[i] = 0;
+    }
+}
+
+/* bytes waiting at priority and above */
+static uint64_t
+s_smrzr_limit_excess(smrzr_limit_node_t * ln, ngx_uint_t priority)
+{
+    uint64_t             excess = 0;
+    ngx_uint_t           i;
+
+    for(i = 0; i <= priority; i++) {
+        excess += ln->excess[i];
+    }
+
+    return(excess);
+}
+
+/* forget the delayed bytes of idle priorities */
+static void
+s_smrzr_limit_idle(smrzr_limit_shctx_t * sh, ngx_msec_t now)
+{
+    ngx_uint_t           i;
+
+    for(i = 0; i < SMRZR_LIMIT_CLASSES; i++) {
+        if(0 != sh->waiting[i]
+           && (ngx_msec_int_t) (now - sh->waited[i]) >= 60000)
+        {
+            sh->waiting[i] = 0;
+        }
+    }
+}
+
+/* free up to two idle buckets */
+static void
+s_smrzr_limit_expire(smrzr_limit_zone_t * zone, ngx_msec_t now)
+{
+    smrzr_limit_node_t  * ln;
+    ngx_msec_int_t        ms;
+    ngx_uint_t            n;
+
+    for(n = 0; n < 2; n++) {
+
+        ln = (smrzr_limit_node_t *) smrzr_zone_oldest(zone->zone);
+
+        if(NULL == ln) {
+            return;
+        }
+
+        ms = (ngx_msec_int_t) (now - ln->last);
+
+        if(ms < 60000
+           || s_smrzr_limit_excess(ln, SMRZR_LIMIT_CLASSES - 1)
+              > s_smrzr_limit_drained(zone->rate, ms))
+        {
+            return;
+        }
+
+        smrzr_zone_free(zone->zone, &ln->zn);
+    }
+}
+
+ngx_int_t
+smrzr_limit_account(
+    smrzr_limit_zone_t  * zone,
+    ngx_str_t           * key,
+    ngx_uint_t            priority,
+    uint64_t              cost,
+    uint64_t              burst,
+    ngx_msec_t          * delay,
+    ngx_log_t           * log)
+{
+    uint64_t              excess;
+    ngx_msec_t            now;
+    ngx_slab_pool_t     * shpool;
+    smrzr_limit_node_t  * ln;
+
+    now = ngx_current_msec;
+    shpool = zone->zone->shpool;
+
+    priority = ngx_min(priority, SMRZR_LIMIT_CLASSES - 1);
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    s_smrzr_limit_expire(zone, now);
+
+    ln = (smrzr_limit_node_t *) smrzr_zone_find(zone->zone, key);
+
+    if(NULL != ln) {
+        smrzr_zone_touch(zone->zone, &ln->zn);
+
+        s_smrzr_limit_drain(ln, zone->rate,
+                            (ngx_msec_int_t) (now - ln->last));
+
+    } else {
+        ln = (smrzr_limit_node_t *)
+                 smrzr_zone_insert(zone->zone, key, sizeof(smrzr_limit_node_t),
+                                   NULL, NULL);
+
+        if(NULL == ln) {
+            ngx_shmtx_unlock(&shpool->mutex);
+
+            ngx_log_error(NGX_LOG_ALERT, log, 0,
+                "could not allocate node%s", shpool->log_ctx);
+            return(NGX_ERROR);
+        }
+    }
+
+    ln->last = now;
+
+    /* less urgent documents don't hold this one up */
+    excess = s_smrzr_limit_excess(ln, priority);
+
+    if(SMRZR_LIMIT_NO_BURST != burst && excess > burst) {
+        /* rejected documents never reach the daemon, nothing to charge */
+        ngx_shmtx_unlock(&shpool->mutex);
+
+        return(NGX_BUSY);
+    }
+
+    ln->excess[priority] += cost;
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    if(NULL != delay) {
+        /* wait for the documents ahead of this one */
+        *delay = (ngx_msec_t) (excess * 1000 / zone->rate);
+    }
+
+    return(NGX_OK);
+}
+
+uint64_t
+smrzr_limit_ahead(smrzr_limit_zone_t * zone, ngx_uint_t priority)
+{
+    smrzr_limit_shctx_t * sh;
+    uint64_t              ahead = 0;
+    ngx_uint_t            i;
+
+    priority = ngx_min(priority, SMRZR_LIMIT_CLASSES - 1);
+
+    if(0 == priority) {
+        return(0);
+    }
+
+    sh = (smrzr_limit_shctx_t *) zone->zone->sh;
+
+    ngx_shmtx_lock(&zone->zone->shpool->mutex);
+
+    s_smrzr_limit_idle(sh, ngx_current_msec);
+
+    for(i = 0; i < priority; i++) {
+        ahead += sh->waiting[i];
+    }
+
+    ngx_shmtx_unlock(&zone->zone->shpool->mutex);
+
+    return(ahead);
+}
+
+void
+smrzr_limit_wait(
+    smrzr_limit_zone_t  * zone,
+    ngx_uint_t            priority,
+    uint64_t              cost,
+    ngx_uint_t            delayed)
+{
+    smrzr_limit_shctx_t * sh;
+    uint64_t            * waiting;
+
+    priority = ngx_min(priority, SMRZR_LIMIT_CLASSES - 1);
+
+    sh = (smrzr_limit_shctx_t *) zone->zone->sh;
+
+    ngx_shmtx_lock(&zone->zone->shpool->mutex);
+
+    waiting = &sh->waiting[priority];
+
+    if(delayed) {
+        *waiting += cost;
+        sh->waited[priority] = ngx_current_msec;
+
+    } else {
+        /* may have been forgotten as idle meanwhile */
+        *waiting -= ngx_min(cost, *waiting);
+    }
+
+    ngx_shmtx_unlock(&zone->zone->shpool->mutex);
+}
+
+static ngx_int_t
+s_smrzr_limit_reuse(smrzr_zone_t * zone, smrzr_zone_t * ozone)
+{
+    smrzr_limit_zone_t  * lz = zone->data;
+    smrzr_limit_zone_t  * olz = ozone->data;
+
+    if(lz->key.value.len != olz->key.value.len
+       || 0 != ngx_strncmp(lz->key.value.data, olz->key.value.data,
+                           lz->key.value.len))
+    {
+        ngx_log_error(NGX_LOG_EMERG, zone->shm_zone->shm.log, 0,
+            "summarizer_limit_zone \"%V\" uses the \"%V\" key "
+            "while previously it used the \"%V\" key",
+            &zone->shm_zone->shm.name, &lz->key.value, &olz->key.value);
+        return(NGX_ERROR);
+    }
+
+    return(NGX_OK);
+}
+
+smrzr_limit_zone_t*
+smrzr_limit_zone_get(ngx_shm_zone_t * shm_zone)
+{
+    smrzr_zone_t        * zone;
+
+    if(NULL == (zone = smrzr_zone_get(shm_zone, s_smrzr_limit_directive))) {
+        return(NULL);
+    }
+
+    return(zone->data);
+}
+
+smrzr_limit_zone_t*
+smrzr_limit_zone_create(
+    ngx_conf_t          * cf,
+    ngx_str_t           * name,
+    size_t                size,
+    void                * tag)
+{
+    smrzr_limit_zone_t  * lz;
+    smrzr_zone_t        * zone;
+
+    if(NULL == (lz = ngx_pcalloc(cf->pool, sizeof(smrzr_limit_zone_t)))) {
+        return(NULL);
+    }
+
+    zone = smrzr_zone_create(cf, name, size, tag, s_smrzr_limit_directive);
+
+    if(NULL == zone) {
+        return(NULL);
+    }
+
+    if(NULL != zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "summarizer_limit_zone \"%V\" is already defined", name);
+        return(NULL);
+    }
+
+    zone->sh_size = sizeof(smrzr_limit_shctx_t);
+    zone->reuse = s_smrzr_limit_reuse;
+    zone->data = lz;
+
+    lz->zone = zone;
+
+    return(lz);
+}
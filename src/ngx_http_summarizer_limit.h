@@ -0,0 +1,67 @@
+/*
+ * Per client budget of document bytes sent for summarization
+ */
+
+#ifndef NGX_HTTP_SUMMARIZER_LIMIT_H
+#define NGX_HTTP_SUMMARIZER_LIMIT_H
+
+/* TYPES */
+
+#define SMRZR_LIMIT_NO_BURST   ((uint64_t) -1)
+#define SMRZR_LIMIT_CLASSES    4       /* priorities, 0 drains first */
+#define SMRZR_LIMIT_RECHECK    100     /* ms, a delayed request looks again
+                                          for more urgent ones */
+
+/* Leaky bucket of one key */
+typedef struct {
+    smrzr_zone_node_t  zn;             /* key: the value of the key */
+    ngx_msec_t         last;
+    uint64_t           excess[SMRZR_LIMIT_CLASSES]; /* bytes not drained
+                                                       yet, per priority */
+} smrzr_limit_node_t;
+
+typedef struct {
+    smrzr_zone_shctx_t zone;
+    uint64_t           waiting[SMRZR_LIMIT_CLASSES]; /* bytes of delayed
+                                                        requests, all keys */
+    ngx_msec_t         waited[SMRZR_LIMIT_CLASSES];  /* last one delayed */
+} smrzr_limit_shctx_t;
+
+/* A summarizer_limit_zone */
+typedef struct {
+    smrzr_zone_t             * zone;
+    uint64_t                   rate;   /* bytes per second */
+    ngx_http_complex_value_t   key;
+} smrzr_limit_zone_t;
+
+/* PROTOTYPES */
+
+/* create zone; rate and key are set by the caller */
+smrzr_limit_zone_t*
+smrzr_limit_zone_create(ngx_conf_t * cf, ngx_str_t * name, size_t size,
+                        void * tag);
+
+/* the limit zone of a shared memory zone, NULL if it is not one */
+smrzr_limit_zone_t*
+smrzr_limit_zone_get(ngx_shm_zone_t * shm_zone);
+
+/* charge cost bytes to key at a priority. NGX_BUSY if more than burst bytes
+ * of the same or a lower priority were already waiting; otherwise *delay is
+ * the time to drain them. burst SMRZR_LIMIT_NO_BURST charges
+ * unconditionally. */
+ngx_int_t
+smrzr_limit_account(smrzr_limit_zone_t * zone, ngx_str_t * key,
+                    ngx_uint_t priority, uint64_t cost, uint64_t burst,
+                    ngx_msec_t * delay, ngx_log_t * log);
+
+/* bytes of delayed requests of a more urgent priority, of any key */
+uint64_t
+smrzr_limit_ahead(smrzr_limit_zone_t * zone, ngx_uint_t priority);
+
+/* count the cost bytes of a request at a priority as delayed, or
+ * (delayed 0) no longer */
+void
+smrzr_limit_wait(smrzr_limit_zone_t * zone, ngx_uint_t priority,
+                 uint64_t cost, ngx_uint_t delayed);
+
+#endif /* NGX_HTTP_SUMMARIZER_LIMIT_H */
@@ -5,7 +5,17 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_http.h>
+#include <zlib.h>
 #include "ngx_http_summarizer_proto.h"
+#include "ngx_http_summarizer_shm.h"
+#include "ngx_http_summarizer_index.h"
+#include "ngx_http_summarizer_lead.h"
+#include "ngx_http_summarizer_zone.h"
+#include "ngx_http_summarizer_limit.h"
+#include "ngx_http_summarizer_fingerprint.h"
+#include "ngx_http_summarizer_trace.h"
+#include "ngx_http_summarizer_job.h"
+#include "ngx_http_summarizer_incr.h"
 
 /* TYPES */
 
@@ -15,38 +25,448 @@ typedef enum {
     SMRZR_ARG_COUNT
 } smrzr_args_t;
 
+/* look this far past a split point for the end of a sentence */
+#define SMRZR_SPLIT_WINDOW     4096
+
+/* read size when fingerprinting a document */
+#define SMRZR_FP_BUF_SIZE      65536
+
+/* smaller inline documents are not worth deflating */
+#define SMRZR_DEFLATE_MIN_LEN  1024
+
+/* a trace as text: the times, then request and response in hex */
+#define SMRZR_TRACE_TEXT_LEN   (128 + 2 * (SMRZR_TRACE_REQ_MAX             \
+                                           + SMRZR_TRACE_RESP_MAX))
+
+/* the summary cache follows the upstream cache of nginx-1.11.6 */
+#if (NGX_HTTP_CACHE && nginx_version >= 1011006)
+#define NGX_HTTP_SUMMARIZER_CACHE  1
+#endif
+
+/* summarizer_mirror and summarizer_cache_refresh_ahead are rejected
+ * before nginx-1.13.1, which has no background subrequests */
+#if (nginx_version >= 1013001)
+#define SMRZR_SUBREQUEST_BACKGROUND  NGX_HTTP_SUBREQUEST_BACKGROUND
+#else
+#define SMRZR_SUBREQUEST_BACKGROUND  0
+#endif
+
+/* per worker state of a daemon pool (upstream) */
+typedef struct {
+    ngx_http_upstream_srv_conf_t * upstream;
+    ngx_http_upstream_init_peer_pt init_peer;
+    ngx_uint_t                     fails;
+    time_t                         open_until;
+} ngx_http_summarizer_pool_t;
+
+typedef struct {
+    ngx_array_t                    indexes;  /* smrzr_index_t* */
+    ngx_array_t                    pools;    /* ngx_http_summarizer_pool_t */
+#if (NGX_HTTP_SUMMARIZER_CACHE)
+    ngx_array_t                    caches;   /* ngx_http_file_cache_t* */
+#endif
+} ngx_http_summarizer_main_conf_t;
+
+/* a point of a peer on the summarizer_hash_filename ring */
+typedef struct {
+    uint32_t                       hash;
+    ngx_uint_t                     peer;     /* in the list of peers */
+} ngx_http_summarizer_chash_point_t;
+
+/* upstream {} block */
+typedef struct {
+    ngx_uint_t                     bound;    /* * 100 */
+    ngx_uint_t                     npoints;
+    ngx_http_summarizer_chash_point_t * points;
+} ngx_http_summarizer_srv_conf_t;
+
 typedef struct {
     ngx_http_upstream_conf_t       upstream;
-    ngx_int_t                      arg_idx[SMRZR_ARG_COUNT];
+    ngx_int_t                      arg_idx[SMRZR_ARG_COUNT];  /* legacy */
+    ngx_http_complex_value_t     * file;
+    ngx_http_complex_value_t     * ratio;
+    ngx_int_t                      ratio_fixed;               /* * 100 */
+    smrzr_shm_t                  * shm;
+    smrzr_index_t                * index;
+    ngx_http_complex_value_t     * deadline;
+    ngx_http_complex_value_t     * priority;
+    ngx_uint_t                     breaker_fails;
+    time_t                         breaker_timeout;
+    ngx_str_t                      lead_root;
+    size_t                         lead_max_size;
+    ngx_shm_zone_t               * limit_zone;
+    uint64_t                       limit_burst;
+    ngx_flag_t                     limit_nodelay;
+    off_t                          split_size;
+    ngx_uint_t                     split_parts;
+    ngx_http_upstream_srv_conf_t * mirror;
+    ngx_uint_t                     mirror_percent;            /* * 100 */
+    ngx_http_upstream_conf_t     * mirror_upstream; /* same, to mirror */
+    smrzr_trace_zone_t           * trace;
+    ngx_uint_t                     trace_every;
+    ngx_shm_zone_t               * trace_show;
+    smrzr_zone_t                 * jobs;
+    time_t                         jobs_valid;
+    ngx_shm_zone_t               * jobs_show;
+    ngx_flag_t                     deflate;
+    smrzr_zone_t                 * incremental;
+    ngx_array_t                  * sets;     /* summarizer_set, this
+                                                location only */
+#if (NGX_HTTP_SUMMARIZER_CACHE)
+    ngx_http_complex_value_t       cache_key;
+    ngx_http_upstream_conf_t     * nocache_upstream; /* same, cache off */
+    smrzr_zone_t                 * dedup;
+    ngx_uint_t                     refresh_ahead;             /* * 100 */
+    ngx_uint_t                     refresh_min_uses;
+    ngx_http_upstream_conf_t     * refresh_upstream; /* same, no lookup */
+#endif
 } ngx_http_summarizer_loc_conf_t;
 
+/* summarizer_set $var <uri> */
+typedef struct {
+    ngx_int_t                      index;
+    ngx_http_complex_value_t       uri;
+} ngx_http_summarizer_set_t;
+
+#if (NGX_HTTP_SUMMARIZER_CACHE)
+/* a cache node held by a summarizer_cache_refresh_ahead subrequest */
 typedef struct {
+    ngx_http_file_cache_t        * cache;
+    ngx_http_file_cache_node_t   * node;
+} ngx_http_summarizer_refresh_t;
+#endif
+
+typedef struct ngx_http_summarizer_ctx_s {
     ngx_http_request_t           * request;
     smrzr_status_t                 status;
     size_t                         len;
+    smrzr_shm_t                  * shm;
+    smrzr_shm_map_t              * shm_map;
+    u_char                       * shm_data;
+    ngx_str_t                      limit_key;  /* charged on reply */
+    uint64_t                       limit_delayed; /* bytes counted as
+                                                     delayed in the zone */
+    ngx_str_t                      fingerprint; /* hex, cache key */
+    ngx_uint_t                     priority;
+    uint32_t                       hash;       /* summarizer_hash_filename */
+    unsigned                       shm_requested:1;
+    unsigned                       prioritized:1; /* priority is sent */
+    unsigned                       hashed:1;
+    unsigned                       incremental:1; /* state is requested */
+    ngx_str_t                      state_key;  /* ratio and file name */
+    ngx_file_uniq_t                state_uniq;
+
+    /* the arguments and the file they name, looked up once */
+    unsigned                       args_parsed:1;
+    unsigned                       doc_looked_up:1;
+    ngx_int_t                      args_rc;
+    smrzr_input_t                  args;       /* file name and ratio */
+    ngx_int_t                      doc_rc;
+    ngx_str_t                      doc_path;   /* of the file name */
+    ngx_open_file_info_t           doc_info;
+
+    /* comparison with a summarizer_mirror copy */
+    unsigned                       mirror:1;   /* the copy */
+    unsigned                       measured:1;
+    ngx_msec_t                     start;
+    ngx_msec_t                     elapsed;
+    ngx_int_t                      rc;
+    struct ngx_http_summarizer_ctx_s * mirror_ctx;
+
+    smrzr_trace_rec_t            * trace;      /* sampled by summarizer_trace */
+
+    /* summarizer_deflate; len is the inflated length then */
+    unsigned                       accept_deflate:1;
+    unsigned                       deflated:1;
+    size_t                         zlen;       /* deflated length */
+    z_stream                     * zstream;
+
+    /* map-reduce of a split document */
+    unsigned                       range:1;    /* a range subrequest */
+    unsigned                       done:1;     /* range summary received */
+    unsigned                       finished:1;
+    unsigned                       failed:1;
+    unsigned                       merge:1;    /* parent ranks the ranges */
+    off_t                          range_offset;
+    uint32_t                       range_len;
+    ngx_str_t                      out;        /* summary of the range */
+    ngx_chain_t                  * doc;        /* summaries of the ranges */
+    struct ngx_http_summarizer_ctx_s ** ranges;
+    ngx_uint_t                     parts;
+    ngx_uint_t                     pending;    /* ranges, or sets */
+
+    /* summarizer_set subrequests issued, pending as above */
+    unsigned                       sets:1;
+
+    /* summarizer_cache_refresh_ahead, summarized again for the cache */
+    unsigned                       refresh:1;
+
+    /* a summarizer_jobs request, summarized after the reply */
+    unsigned                       job:1;
 } ngx_http_summarizer_ctx_t;
 
+/* a summarizer_set subrequest */
+typedef struct {
+    ngx_http_summarizer_ctx_t    * ctx;
+    ngx_int_t                      index;
+    unsigned                       finished:1;
+} ngx_http_summarizer_set_req_t;
+
+/* peer of a pool with circuit breaker */
+typedef struct {
+    ngx_http_summarizer_pool_t   * pool;
+    ngx_http_summarizer_loc_conf_t * slcf;
+    void                         * data;
+    ngx_event_get_peer_pt          get;
+    ngx_event_free_peer_pt         free;
+} ngx_http_summarizer_breaker_peer_t;
+
+/* peer of a summarizer_hash_filename pool */
+typedef struct {
+    ngx_http_upstream_rr_peer_data_t   rrp;   /* first, for round robin */
+    ngx_http_summarizer_srv_conf_t   * conf;
+    uint32_t                           hash;
+    uintptr_t                        * seen;  /* peers over their load */
+    ngx_uint_t                         nseen;
+} ngx_http_summarizer_chash_peer_t;
+
+/* a summarizer_jobs job on a daemon connection of its own; it has its own
+ * pool and log, as it outlives the client request */
+typedef struct {
+    ngx_pool_t                   * pool;
+    ngx_log_t                      log;
+    ngx_peer_connection_t          peer;
+    ngx_addr_t                   * addrs;   /* daemons, tried in turn */
+    ngx_uint_t                     naddrs;
+    ngx_uint_t                     first;
+    ngx_uint_t                     tries;
+    ngx_chain_t                  * request; /* as built, for retries */
+    ngx_chain_t                  * out;     /* left to send */
+    ngx_buf_t                    * header;
+    ngx_str_t                      summary;
+    size_t                         summary_len;
+    ngx_msec_t                     connect_timeout;
+    ngx_msec_t                     send_timeout;
+    ngx_msec_t                     read_timeout;
+    smrzr_zone_t                 * zone;
+    time_t                         valid;
+    u_char                         id[SMRZR_JOB_ID_LEN];
+} ngx_http_summarizer_job_t;
+
 
 /* PROTOTYPES */
 
+static ngx_int_t   ngx_http_summarizer_init(ngx_conf_t *cf);
+static void      * ngx_http_summarizer_create_main_conf(ngx_conf_t *cf);
+static void      * ngx_http_summarizer_create_srv_conf(ngx_conf_t *cf);
 static void      * ngx_http_summarizer_create_loc_conf(ngx_conf_t *cf);
 static char      * ngx_http_summarizer_merge_loc_conf(ngx_conf_t *cf, void 
                        *parent, void *child);
 
 static ngx_int_t   ngx_http_summarizer_handler(ngx_http_request_t *r);
+static ngx_int_t   ngx_http_summarizer_parse_args(ngx_http_request_t *r,
+                       ngx_http_summarizer_loc_conf_t *slcf,
+                       smrzr_input_t *input);
+static smrzr_input_t * ngx_http_summarizer_args(ngx_http_request_t *r,
+                       ngx_http_summarizer_ctx_t *ctx);
+static ngx_open_file_info_t * ngx_http_summarizer_doc_info(
+                       ngx_http_request_t *r, ngx_http_summarizer_ctx_t *ctx);
+static ngx_int_t   ngx_http_summarizer_priority(ngx_http_request_t *r,
+                       ngx_http_summarizer_loc_conf_t *slcf,
+                       ngx_uint_t *priority);
 static ngx_int_t   ngx_http_summarizer_create_request(ngx_http_request_t *r);
+static ngx_int_t   ngx_http_summarizer_incremental(ngx_http_request_t *r,
+                       ngx_http_summarizer_loc_conf_t *slcf,
+                       ngx_http_summarizer_ctx_t *ctx, smrzr_input_t *input);
 static ngx_int_t   ngx_http_summarizer_reinit_request(ngx_http_request_t *r);
 static ngx_int_t   ngx_http_summarizer_process_header(ngx_http_request_t *r);
 #if 0
 static ngx_int_t   ngx_http_summarizer_filter_init(void *data);
 static ngx_int_t   ngx_http_summarizer_filter(void *data, ssize_t bytes);
 #endif
+static ngx_int_t   ngx_http_summarizer_shm_filter_init(void *data);
+static ngx_int_t   ngx_http_summarizer_shm_filter(void *data, ssize_t bytes);
+static ngx_int_t   ngx_http_summarizer_input_filter_init(void *data);
+#if (NGX_HTTP_SUMMARIZER_CACHE)
+static ngx_int_t   ngx_http_summarizer_create_key(ngx_http_request_t *r);
+#endif
 static void        ngx_http_summarizer_abort_request(ngx_http_request_t *r);
 static void        ngx_http_summarizer_finalize_request(ngx_http_request_t *r, 
 ngx_int_t rc);
 
+static void        ngx_http_summarizer_start(ngx_http_request_t *r);
+static ngx_int_t   ngx_http_summarizer_map(ngx_http_request_t *r);
+static ngx_int_t   ngx_http_summarizer_range_done(ngx_http_request_t *sr,
+                       void *data, ngx_int_t rc);
+static void        ngx_http_summarizer_reduce(ngx_http_request_t *r);
+static ngx_int_t   ngx_http_summarizer_range_filter_init(void *data);
+static ngx_int_t   ngx_http_summarizer_range_filter(void *data,
+                       ssize_t bytes);
+static void        ngx_http_summarizer_mirror(ngx_http_request_t *r,
+                       ngx_http_summarizer_loc_conf_t *slcf,
+                       ngx_http_summarizer_ctx_t *ctx, ngx_chain_t *doc);
+static ngx_int_t   ngx_http_summarizer_mirror_done(ngx_http_request_t *sr,
+                       void *data, ngx_int_t rc);
+static void        ngx_http_summarizer_mirror_log(ngx_http_request_t *r,
+                       ngx_http_summarizer_ctx_t *ctx);
+static ngx_int_t   ngx_http_summarizer_mirror_filter_init(void *data);
+static ngx_int_t   ngx_http_summarizer_inflate_filter_init(void *data);
+static ngx_int_t   ngx_http_summarizer_inflate_filter(void *data,
+                                                      ssize_t bytes);
+static ngx_int_t   ngx_http_summarizer_inflate_init(
+                                          ngx_http_summarizer_ctx_t *ctx);
+static ngx_int_t   ngx_http_summarizer_inflate(ngx_http_summarizer_ctx_t *ctx,
+                                               ngx_buf_t *b);
+static ngx_int_t   ngx_http_summarizer_deflate(ngx_http_request_t *r,
+                                               ngx_chain_t *doc, size_t len,
+                                               ngx_chain_t **out);
+static void      * ngx_http_summarizer_zalloc(void *opaque, u_int items,
+                                              u_int size);
+static void        ngx_http_summarizer_zfree(void *opaque, void *address);
+static ngx_int_t   ngx_http_summarizer_mirror_filter(void *data,
+                       ssize_t bytes);
+static ngx_int_t   ngx_http_summarizer_file_info(ngx_http_request_t *r,
+                       ngx_str_t *name, ngx_str_t *path,
+                       ngx_open_file_info_t *of);
+#if (NGX_HTTP_SUMMARIZER_CACHE)
+static ngx_int_t   ngx_http_summarizer_fingerprint(ngx_http_request_t *r);
+static void        ngx_http_summarizer_refresh_ahead(ngx_http_request_t *r);
+static ngx_int_t   ngx_http_summarizer_refresh_done(ngx_http_request_t *sr,
+                       void *data, ngx_int_t rc);
+static void        ngx_http_summarizer_refresh_release(void *data);
+static ngx_int_t   ngx_http_summarizer_fingerprint_set(ngx_http_request_t *r,
+                       u_char *fp);
+#if (NGX_THREADS)
+static void        ngx_http_summarizer_fingerprint_thread(void *data,
+                       ngx_log_t *log);
+static void        ngx_http_summarizer_fingerprint_event(ngx_event_t *ev);
+#endif
+#endif
+#if (NGX_THREADS)
+static ngx_int_t   ngx_http_summarizer_thread_pool(ngx_http_request_t *r,
+                       ngx_thread_pool_t **tp);
+#endif
+static void        ngx_http_summarizer_limit_request(ngx_http_request_t *r);
+static void        ngx_http_summarizer_limit_delay(ngx_http_request_t *r);
+static void        ngx_http_summarizer_limit_cleanup(void *data);
+static uint64_t    ngx_http_summarizer_limit_cost(ngx_http_request_t *r,
+                       ngx_http_summarizer_ctx_t *ctx);
+
+static ngx_int_t   ngx_http_summarizer_trace_handler(ngx_http_request_t *r);
+static ngx_int_t   ngx_http_summarizer_jobs_handler(ngx_http_request_t *r);
+static void        ngx_http_summarizer_job_start(ngx_http_request_t *r);
+static ngx_int_t   ngx_http_summarizer_job_run(ngx_http_request_t *r,
+                       ngx_http_summarizer_loc_conf_t *slcf, u_char *id);
+static ngx_int_t   ngx_http_summarizer_job_request(ngx_http_request_t *r,
+                       ngx_http_summarizer_loc_conf_t *slcf,
+                       ngx_http_summarizer_ctx_t *ctx, ngx_chain_t **out);
+static ngx_file_t *ngx_http_summarizer_job_file(
+                       ngx_http_summarizer_job_t *job, ngx_file_t *from);
+static ngx_int_t   ngx_http_summarizer_job_rewind(
+                       ngx_http_summarizer_job_t *job);
+static ngx_int_t   ngx_http_summarizer_job_peers(
+                       ngx_http_summarizer_job_t *job,
+                       ngx_http_upstream_srv_conf_t *us);
+static void        ngx_http_summarizer_job_connect(
+                       ngx_http_summarizer_job_t *job);
+static void        ngx_http_summarizer_job_next(
+                       ngx_http_summarizer_job_t *job);
+static void        ngx_http_summarizer_job_write_handler(ngx_event_t *wev);
+static void        ngx_http_summarizer_job_send(
+                       ngx_http_summarizer_job_t *job);
+static void        ngx_http_summarizer_job_read_handler(ngx_event_t *rev);
+static void        ngx_http_summarizer_job_recv(
+                       ngx_http_summarizer_job_t *job);
+static ngx_int_t   ngx_http_summarizer_job_header(
+                       ngx_http_summarizer_job_t *job);
+static void        ngx_http_summarizer_job_finalize(
+                       ngx_http_summarizer_job_t *job, ngx_uint_t status);
+ngx_int_t          ngx_http_summarizer_subrequest_summary(
+                       ngx_http_request_t *sr, ngx_str_t *value);
+static ngx_int_t   ngx_http_summarizer_set_handler(ngx_http_request_t *r);
+static ngx_int_t   ngx_http_summarizer_set_done(ngx_http_request_t *sr,
+                       void *data, ngx_int_t rc);
+static ngx_int_t   ngx_http_summarizer_set_variable(ngx_http_request_t *r,
+                       ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_msec_int_t ngx_http_summarizer_elapsed(ngx_http_request_t *r);
+static ngx_int_t   ngx_http_summarizer_deadline(ngx_http_request_t *r,
+                       ngx_http_summarizer_loc_conf_t *slcf,
+                       uint32_t *deadline);
+
+static ngx_int_t   ngx_http_summarizer_lead_handler(ngx_http_request_t *r);
+static ngx_int_t   ngx_http_summarizer_lead_send(ngx_http_request_t *r,
+                       smrzr_lead_t *lead);
+#if (NGX_THREADS)
+static void        ngx_http_summarizer_lead_thread(void *data, ngx_log_t *log);
+static void        ngx_http_summarizer_lead_event(ngx_event_t *ev);
+#endif
+
+static ngx_int_t   ngx_http_summarizer_breaker_init_peer(ngx_http_request_t *r,
+                       ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t   ngx_http_summarizer_breaker_get_peer(ngx_peer_connection_t
+                       *pc, void *data);
+#if (nginx_version >= 1009000)
+static ngx_int_t   ngx_http_summarizer_chash_init(ngx_conf_t *cf,
+                       ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t   ngx_http_summarizer_chash_init_peer(ngx_http_request_t *r,
+                       ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t   ngx_http_summarizer_chash_get_peer(ngx_peer_connection_t
+                       *pc, void *data);
+static int ngx_libc_cdecl ngx_http_summarizer_chash_cmp(const void *one,
+                       const void *two);
+#endif
+static void        ngx_http_summarizer_breaker_free_peer(ngx_peer_connection_t
+                       *pc, void *data, ngx_uint_t state);
+
 static char      * ngx_http_summarizer_pass(ngx_conf_t *cf, ngx_command_t *cmd, 
                        void *conf);
+static char      * ngx_http_summarizer_index(ngx_conf_t *cf, ngx_command_t *cmd,
+                       void *conf);
+static char      * ngx_http_summarizer_args_index(ngx_conf_t *cf,
+                       ngx_http_summarizer_loc_conf_t *slcf, ngx_uint_t i);
+static char      * ngx_http_summarizer_lead(ngx_conf_t *cf, ngx_command_t *cmd,
+                       void *conf);
+static char      * ngx_http_summarizer_ratio(ngx_conf_t *cf, ngx_command_t *cmd,
+                       void *conf);
+static char      * ngx_http_summarizer_split(ngx_conf_t *cf, ngx_command_t *cmd,
+                       void *conf);
+static char      * ngx_http_summarizer_limit_zone(ngx_conf_t *cf,
+                       ngx_command_t *cmd, void *conf);
+static char      * ngx_http_summarizer_limit(ngx_conf_t *cf, ngx_command_t *cmd,
+                       void *conf);
+static char      * ngx_http_summarizer_circuit_breaker(ngx_conf_t *cf,
+                       ngx_command_t *cmd, void *conf);
+static char      * ngx_http_summarizer_mirror_conf(ngx_conf_t *cf,
+                       ngx_command_t *cmd, void *conf);
+static char      * ngx_http_summarizer_trace(ngx_conf_t *cf, ngx_command_t *cmd,
+                       void *conf);
+static char      * ngx_http_summarizer_trace_show(ngx_conf_t *cf,
+                       ngx_command_t *cmd, void *conf);
+static char      * ngx_http_summarizer_jobs(ngx_conf_t *cf, ngx_command_t *cmd,
+                       void *conf);
+static char      * ngx_http_summarizer_jobs_show(ngx_conf_t *cf,
+                       ngx_command_t *cmd, void *conf);
+static char      * ngx_http_summarizer_set(ngx_conf_t *cf, ngx_command_t *cmd,
+                       void *conf);
+static char      * ngx_http_summarizer_incremental_conf(ngx_conf_t *cf,
+                       ngx_command_t *cmd, void *conf);
+static char      * ngx_http_summarizer_hash_filename(ngx_conf_t *cf,
+                       ngx_command_t *cmd, void *conf);
+static char      * ngx_http_summarizer_zone_arg(ngx_conf_t *cf,
+                       ngx_str_t *value, ngx_str_t *name, ssize_t *size);
+#if (NGX_HTTP_SUMMARIZER_CACHE)
+static char      * ngx_http_summarizer_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+                       void *conf);
+static char      * ngx_http_summarizer_cache_key(ngx_conf_t *cf,
+                       ngx_command_t *cmd, void *conf);
+static char      * ngx_http_summarizer_dedup(ngx_conf_t *cf, ngx_command_t *cmd,
+                       void *conf);
+static char      * ngx_http_summarizer_refresh_ahead_conf(ngx_conf_t *cf,
+                       ngx_command_t *cmd, void *conf);
+#endif
+
+static ngx_int_t   ngx_http_summarizer_init_process(ngx_cycle_t *cycle);
+static void        ngx_http_summarizer_exit_process(ngx_cycle_t *cycle);
 
 /* LOCALS */
 
@@ -55,6 +475,10 @@ static ngx_str_t ngx_http_summarizer_args[] = {
     ngx_string("smrzr_ratio")        /* SMRZR_ARG_RATIO */
 };
 
+static ngx_path_init_t ngx_http_summarizer_temp_path = {
+    ngx_string("summarizer_temp"), { 1, 2, 0 }
+};
+
 /* MODULE GLOBALS */
 
 static ngx_conf_bitmask_t ngx_http_summarizer_next_upstream_masks[] = {
@@ -62,10 +486,25 @@ static ngx_conf_bitmask_t ngx_http_summarizer_next_upstream_masks[] = {
     { ngx_string("timeout"),          NGX_HTTP_UPSTREAM_FT_TIMEOUT },
     { ngx_string("invalid_response"), NGX_HTTP_UPSTREAM_FT_INVALID_HEADER },
     { ngx_string("not_found"),        NGX_HTTP_UPSTREAM_FT_HTTP_404 },
+    { ngx_string("overloaded"),       NGX_HTTP_UPSTREAM_FT_HTTP_503 },
+    { ngx_string("off"),              NGX_HTTP_UPSTREAM_FT_OFF },
+    { ngx_null_string, 0 }
+};
+
+#if (NGX_HTTP_SUMMARIZER_CACHE)
+
+static ngx_conf_bitmask_t ngx_http_summarizer_use_stale_masks[] = {
+    { ngx_string("error"),            NGX_HTTP_UPSTREAM_FT_ERROR },
+    { ngx_string("timeout"),          NGX_HTTP_UPSTREAM_FT_TIMEOUT },
+    { ngx_string("invalid_response"), NGX_HTTP_UPSTREAM_FT_INVALID_HEADER },
+    { ngx_string("overloaded"),       NGX_HTTP_UPSTREAM_FT_HTTP_503 },
+    { ngx_string("updating"),         NGX_HTTP_UPSTREAM_FT_UPDATING },
     { ngx_string("off"),              NGX_HTTP_UPSTREAM_FT_OFF },
     { ngx_null_string, 0 }
 };
 
+#endif
+
 
 static ngx_command_t ngx_http_summarizer_commands[] = {
 
@@ -77,6 +516,146 @@ static ngx_command_t ngx_http_summarizer_commands[] = {
       0,
       NULL },
 
+    { ngx_string("summarizer_hash_filename"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+      ngx_http_summarizer_hash_filename,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("summarizer_file"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_complex_value_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_summarizer_loc_conf_t, file),
+      NULL },
+
+    { ngx_string("summarizer_ratio"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_summarizer_ratio,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("summarizer_index"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_summarizer_index,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("summarizer_deadline"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_complex_value_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_summarizer_loc_conf_t, deadline),
+      NULL },
+
+    { ngx_string("summarizer_priority"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_complex_value_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_summarizer_loc_conf_t, priority),
+      NULL },
+
+    { ngx_string("summarizer_set"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_TAKE2,
+      ngx_http_summarizer_set,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("summarizer_deflate"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_summarizer_loc_conf_t, deflate),
+      NULL },
+
+    { ngx_string("summarizer_lead"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_summarizer_lead,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("summarizer_lead_max_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_summarizer_loc_conf_t, lead_max_size),
+      NULL },
+
+    { ngx_string("summarizer_split"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_summarizer_split,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("summarizer_limit_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE3,
+      ngx_http_summarizer_limit_zone,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("summarizer_limit"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE123,
+      ngx_http_summarizer_limit,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("summarizer_circuit_breaker"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_summarizer_circuit_breaker,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("summarizer_mirror"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_summarizer_mirror_conf,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("summarizer_trace"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_summarizer_trace,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("summarizer_trace_show"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_summarizer_trace_show,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("summarizer_incremental"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_summarizer_incremental_conf,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("summarizer_jobs"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_summarizer_jobs,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("summarizer_jobs_show"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_summarizer_jobs_show,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
     /* standard ones for upstream module */
     { ngx_string("summarizer_bind"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
@@ -117,21 +696,95 @@ static ngx_command_t ngx_http_summarizer_commands[] = {
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
       ngx_conf_set_bitmask_slot,
       NGX_HTTP_LOC_CONF_OFFSET,
-      offsetof(ngx_http_summarizer_loc_conf_t, upstream.upstream),
+      offsetof(ngx_http_summarizer_loc_conf_t, upstream.next_upstream),
       &ngx_http_summarizer_next_upstream_masks },
 
+    { ngx_string("summarizer_temp_path"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1234,
+      ngx_conf_set_path_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_summarizer_loc_conf_t, upstream.temp_path),
+      NULL },
+
+#if (NGX_HTTP_SUMMARIZER_CACHE)
+
+    { ngx_string("summarizer_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_summarizer_cache,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("summarizer_cache_key"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_summarizer_cache_key,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("summarizer_dedup"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_summarizer_dedup,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("summarizer_cache_path"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_2MORE,
+      ngx_http_file_cache_set_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_summarizer_main_conf_t, caches),
+      &ngx_http_summarizer_module },
+
+    { ngx_string("summarizer_cache_valid"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_http_file_cache_valid_set_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_summarizer_loc_conf_t, upstream.cache_valid),
+      NULL },
+
+    { ngx_string("summarizer_cache_min_uses"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_summarizer_loc_conf_t, upstream.cache_min_uses),
+      NULL },
+
+    { ngx_string("summarizer_cache_lock"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_summarizer_loc_conf_t, upstream.cache_lock),
+      NULL },
+
+    { ngx_string("summarizer_cache_refresh_ahead"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_summarizer_refresh_ahead_conf,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("summarizer_use_stale"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_conf_set_bitmask_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_summarizer_loc_conf_t, upstream.cache_use_stale),
+      &ngx_http_summarizer_use_stale_masks },
+
+#endif
+
       ngx_null_command
 };
 
 
 static ngx_http_module_t  ngx_http_summarizer_module_ctx = {
     NULL,                                  /* preconfiguration */
-    NULL,                                  /* postconfiguration */
+    ngx_http_summarizer_init,                 /* postconfiguration */
 
-    NULL,                                  /* create main configuration */
+    ngx_http_summarizer_create_main_conf,     /* create main configuration */
     NULL,                                  /* init main configuration */
 
-    NULL,                                  /* create server configuration */
+    ngx_http_summarizer_create_srv_conf,      /* create server configuration */
     NULL,                                  /* merge server configuration */
 
     ngx_http_summarizer_create_loc_conf,      /* create location configration */
@@ -146,10 +799,10 @@ ngx_module_t ngx_http_summarizer_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_summarizer_init_process,         /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
-    NULL,                                  /* exit process */
+    ngx_http_summarizer_exit_process,         /* exit process */
     NULL,                                  /* exit master */
     NGX_MODULE_V1_PADDING
 };
@@ -157,6 +810,64 @@ ngx_module_t ngx_http_summarizer_module = {
 
 /* FUNCTION DEFINITIONS */
 
+/* main conf creation */
+static void*
+ngx_http_summarizer_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_summarizer_main_conf_t  *conf;
+
+    if(NULL == (conf = ngx_pcalloc(cf->pool,
+                           sizeof(ngx_http_summarizer_main_conf_t))))
+    {
+        return NULL;
+    }
+
+    if(NGX_OK != ngx_array_init(&conf->indexes, cf->pool, 1,
+                                sizeof(smrzr_index_t*)))
+    {
+        return NULL;
+    }
+
+    if(NGX_OK != ngx_array_init(&conf->pools, cf->pool, 4,
+                                sizeof(ngx_http_summarizer_pool_t)))
+    {
+        return NULL;
+    }
+
+#if (NGX_HTTP_SUMMARIZER_CACHE)
+    if(NGX_OK != ngx_array_init(&conf->caches, cf->pool, 4,
+                                sizeof(ngx_http_file_cache_t*)))
+    {
+        return NULL;
+    }
+#endif
+
+    return conf;
+}
+
+/* server conf creation; only used in upstream {} blocks */
+static void*
+ngx_http_summarizer_create_srv_conf(ngx_conf_t *cf)
+{
+    ngx_http_summarizer_srv_conf_t  *conf;
+
+    if(NULL == (conf = ngx_pcalloc(cf->pool,
+                           sizeof(ngx_http_summarizer_srv_conf_t))))
+    {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->bound = 0;
+     *     conf->npoints = 0;
+     *     conf->points = NULL;
+     */
+
+    return conf;
+}
+
 /* location conf creation */
 static void*
 ngx_http_summarizer_create_loc_conf(ngx_conf_t *cf)
@@ -200,6 +911,37 @@ ngx_http_summarizer_create_loc_conf(ngx_conf_t *cf)
     conf->upstream.pass_request_headers = 0;
     conf->upstream.pass_request_body = 0;
 
+    conf->file = NGX_CONF_UNSET_PTR;
+    conf->ratio = NGX_CONF_UNSET_PTR;
+    conf->ratio_fixed = NGX_CONF_UNSET;
+    conf->index = NGX_CONF_UNSET_PTR;
+    conf->deadline = NGX_CONF_UNSET_PTR;
+    conf->priority = NGX_CONF_UNSET_PTR;
+    conf->deflate = NGX_CONF_UNSET;
+    conf->incremental = NGX_CONF_UNSET_PTR;
+    conf->breaker_fails = NGX_CONF_UNSET_UINT;
+    conf->mirror = NGX_CONF_UNSET_PTR;
+    conf->trace = NGX_CONF_UNSET_PTR;
+    conf->jobs = NGX_CONF_UNSET_PTR;
+    conf->breaker_timeout = NGX_CONF_UNSET;
+    conf->lead_max_size = NGX_CONF_UNSET_SIZE;
+    conf->limit_zone = NGX_CONF_UNSET_PTR;
+    conf->split_size = NGX_CONF_UNSET;
+    conf->split_parts = NGX_CONF_UNSET_UINT;
+
+#if (NGX_HTTP_SUMMARIZER_CACHE)
+    conf->upstream.cache = NGX_CONF_UNSET;
+    conf->upstream.cache_min_uses = NGX_CONF_UNSET_UINT;
+    conf->upstream.cache_valid = NGX_CONF_UNSET_PTR;
+    conf->upstream.cache_lock = NGX_CONF_UNSET;
+    conf->upstream.cache_lock_timeout = NGX_CONF_UNSET_MSEC;
+    conf->upstream.cache_lock_age = NGX_CONF_UNSET_MSEC;
+    conf->upstream.no_cache = NGX_CONF_UNSET_PTR;
+    conf->upstream.cache_bypass = NGX_CONF_UNSET_PTR;
+    conf->dedup = NGX_CONF_UNSET_PTR;
+    conf->refresh_ahead = NGX_CONF_UNSET_UINT;
+#endif
+
     /* initialize module specific elements of the context */
     for(i = 0; i < SMRZR_ARG_COUNT; ++i) {
         conf->arg_idx[i] = NGX_CONF_UNSET;
@@ -215,6 +957,10 @@ ngx_http_summarizer_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_http_summarizer_loc_conf_t *prev = parent;
     ngx_http_summarizer_loc_conf_t *conf = child;
     size_t i;
+#if (NGX_HTTP_SUMMARIZER_CACHE)
+    ngx_array_t                    *bypass;
+    ngx_http_complex_value_t       *cv;
+#endif
 
     ngx_conf_merge_msec_value(conf->upstream.connect_timeout, 
                               prev->upstream.connect_timeout, 60000);
@@ -239,304 +985,5642 @@ ngx_http_summarizer_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 
     if (conf->upstream.upstream == NULL) {
         conf->upstream.upstream = prev->upstream.upstream;
+        conf->shm = prev->shm;
+    }
+
+    ngx_conf_merge_ptr_value(conf->file, prev->file, NULL);
+
+    if (conf->ratio == NGX_CONF_UNSET_PTR) {
+        conf->ratio_fixed = prev->ratio_fixed;
     }
 
+    ngx_conf_merge_ptr_value(conf->ratio, prev->ratio, NULL);
+
     for(i = 0; i < SMRZR_ARG_COUNT; ++i) {
         if(conf->arg_idx[i] == NGX_CONF_UNSET) {
             conf->arg_idx[i] = prev->arg_idx[i];
         }
     }
 
-    return NGX_CONF_OK;
-}
+    /* without summarizer_file, or without summarizer_ratio, the argument
+     * comes in the $smrzr_filename or $smrzr_ratio variable */
+    if (conf->upstream.upstream || conf->lead_root.data) {
 
-/* pass */
-static char*
-ngx_http_summarizer_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
-{
-    ngx_http_summarizer_loc_conf_t *slcf = conf;
-    ngx_str_t                      *value;
-    ngx_url_t                       url;
-    ngx_http_core_loc_conf_t       *clcf;
-    size_t                          i;
+        if (conf->file == NULL
+            && conf->arg_idx[SMRZR_ARG_FILENAME] == NGX_CONF_UNSET
+            && ngx_http_summarizer_args_index(cf, conf, SMRZR_ARG_FILENAME)
+               != NGX_CONF_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
 
-    if (slcf->upstream.upstream) {
+        if (conf->ratio == NULL && conf->ratio_fixed == NGX_CONF_UNSET
+            && conf->arg_idx[SMRZR_ARG_RATIO] == NGX_CONF_UNSET
+            && ngx_http_summarizer_args_index(cf, conf, SMRZR_ARG_RATIO)
+               != NGX_CONF_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    ngx_conf_merge_ptr_value(conf->index, prev->index, NULL);
+    ngx_conf_merge_ptr_value(conf->deadline, prev->deadline, NULL);
+    ngx_conf_merge_ptr_value(conf->priority, prev->priority, NULL);
+    ngx_conf_merge_value(conf->deflate, prev->deflate, 0);
+    ngx_conf_merge_ptr_value(conf->incremental, prev->incremental, NULL);
+
+    /* a ranking state comes in the response header */
+    if (conf->incremental
+        && conf->upstream.buffer_size < SMRZR_RESP_HEADER_MAX + SMRZR_STATE_MAX)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"summarizer_buffer_size\" must be at least %d "
+                           "with \"summarizer_incremental\"",
+                           SMRZR_RESP_HEADER_MAX + SMRZR_STATE_MAX);
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_conf_merge_uint_value(conf->breaker_fails, prev->breaker_fails, 0);
+    ngx_conf_merge_sec_value(conf->breaker_timeout, prev->breaker_timeout, 10);
+
+    ngx_conf_merge_size_value(conf->lead_max_size, prev->lead_max_size,
+                              128 * 1024);
+
+    ngx_conf_merge_off_value(conf->split_size, prev->split_size, 0);
+    ngx_conf_merge_uint_value(conf->split_parts, prev->split_parts, 4);
+
+    /* burst and nodelay come with the zone */
+    if (conf->limit_zone == NGX_CONF_UNSET_PTR) {
+        conf->limit_burst = prev->limit_burst;
+        conf->limit_nodelay = prev->limit_nodelay;
+    }
+
+    ngx_conf_merge_ptr_value(conf->limit_zone, prev->limit_zone, NULL);
+
+    if (conf->limit_zone && smrzr_limit_zone_get(conf->limit_zone) == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"summarizer_limit\" zone \"%V\" is unknown",
+                           &conf->limit_zone->shm.name);
+        return NGX_CONF_ERROR;
+    }
+
+#if (NGX_HTTP_SUMMARIZER_CACHE)
+
+    if (conf->upstream.cache == NGX_CONF_UNSET) {
+        ngx_conf_merge_value(conf->upstream.cache, prev->upstream.cache, 0);
+
+        conf->upstream.cache_zone = prev->upstream.cache_zone;
+    }
+
+    if (conf->upstream.cache_zone && conf->upstream.cache_zone->data == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"summarizer_cache\" zone \"%V\" is unknown",
+                           &conf->upstream.cache_zone->shm.name);
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_conf_merge_uint_value(conf->upstream.cache_min_uses,
+                              prev->upstream.cache_min_uses, 1);
+
+    ngx_conf_merge_off_value(conf->upstream.cache_max_range_offset,
+                             prev->upstream.cache_max_range_offset,
+                             NGX_MAX_OFF_T_VALUE);
+
+    ngx_conf_merge_bitmask_value(conf->upstream.cache_use_stale,
+                                 prev->upstream.cache_use_stale,
+                                 (NGX_CONF_BITMASK_SET |
+                                      NGX_HTTP_UPSTREAM_FT_OFF));
+
+    if (conf->upstream.cache_use_stale & NGX_HTTP_UPSTREAM_FT_OFF) {
+        conf->upstream.cache_use_stale = NGX_CONF_BITMASK_SET |
+                                         NGX_HTTP_UPSTREAM_FT_OFF;
+    }
+
+    /* an open circuit breaker looks like a pool with no live daemons */
+    if (conf->upstream.cache_use_stale & NGX_HTTP_UPSTREAM_FT_ERROR) {
+        conf->upstream.cache_use_stale |= NGX_HTTP_UPSTREAM_FT_NOLIVE;
+    }
+
+    conf->upstream.cache_methods = NGX_HTTP_GET|NGX_HTTP_HEAD;
+
+    ngx_conf_merge_ptr_value(conf->upstream.cache_bypass,
+                             prev->upstream.cache_bypass, NULL);
+
+    ngx_conf_merge_ptr_value(conf->upstream.no_cache,
+                             prev->upstream.no_cache, NULL);
+
+    ngx_conf_merge_ptr_value(conf->upstream.cache_valid,
+                             prev->upstream.cache_valid, NULL);
+
+    if (conf->cache_key.value.data == NULL) {
+        conf->cache_key = prev->cache_key;
+    }
+
+    ngx_conf_merge_ptr_value(conf->dedup, prev->dedup, NULL);
+
+    /* the hit count comes with the fraction */
+    if (conf->refresh_ahead == NGX_CONF_UNSET_UINT) {
+        conf->refresh_ahead = prev->refresh_ahead;
+        conf->refresh_min_uses = prev->refresh_min_uses;
+    }
+
+    if (conf->refresh_ahead == NGX_CONF_UNSET_UINT) {
+        conf->refresh_ahead = 0;
+    }
+
+    ngx_conf_merge_value(conf->upstream.cache_lock,
+                         prev->upstream.cache_lock, 0);
+
+    ngx_conf_merge_msec_value(conf->upstream.cache_lock_timeout,
+                              prev->upstream.cache_lock_timeout, 5000);
+
+    ngx_conf_merge_msec_value(conf->upstream.cache_lock_age,
+                              prev->upstream.cache_lock_age, 5000);
+
+    if (conf->upstream.cache) {
+        /* the cache is written by the buffered (event pipe) path */
+        conf->upstream.buffering = 1;
+        conf->upstream.bufs.num = 8;
+        conf->upstream.bufs.size = (size_t)ngx_pagesize;
+        conf->upstream.busy_buffers_size =
+            2 * ngx_max(conf->upstream.buffer_size, conf->upstream.bufs.size);
+        conf->upstream.temp_file_write_size =
+            conf->upstream.busy_buffers_size;
+        conf->upstream.max_temp_file_size = 1024 * 1024 * 1024;
+
+        if (ngx_conf_merge_path_value(cf, &conf->upstream.temp_path,
+                                      prev->upstream.temp_path,
+                                      &ngx_http_summarizer_temp_path)
+            != NGX_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
+
+        /* for inline documents and split ones, not keyed by file name */
+        conf->nocache_upstream = ngx_palloc(cf->pool,
+                                           sizeof(ngx_http_upstream_conf_t));
+        if (conf->nocache_upstream == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        *conf->nocache_upstream = conf->upstream;
+        conf->nocache_upstream->cache = 0;
+
+        if (conf->refresh_ahead) {
+            /* skips the lookup, the summary replaces the cached one */
+            conf->refresh_upstream = ngx_palloc(cf->pool,
+                                           sizeof(ngx_http_upstream_conf_t));
+            bypass = ngx_array_create(cf->pool, 1,
+                                      sizeof(ngx_http_complex_value_t));
+            if (conf->refresh_upstream == NULL || bypass == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            cv = ngx_array_push(bypass);
+            if (cv == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            ngx_memzero(cv, sizeof(ngx_http_complex_value_t));
+            ngx_str_set(&cv->value, "1");
+
+            *conf->refresh_upstream = conf->upstream;
+            conf->refresh_upstream->cache_bypass = bypass;
+            conf->refresh_upstream->ignore_client_abort = 1;
+        }
+    }
+
+#endif
+
+    /* the sampling rate comes with the zone */
+    if (conf->trace == NGX_CONF_UNSET_PTR) {
+        conf->trace = prev->trace;
+        conf->trace_every = prev->trace_every;
+    }
+
+    if (conf->trace_show && smrzr_trace_zone_get(conf->trace_show) == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"summarizer_trace_show\" zone \"%V\" is unknown",
+                           &conf->trace_show->shm.name);
+        return NGX_CONF_ERROR;
+    }
+
+    /* the lifetime comes with the zone */
+    if (conf->jobs == NGX_CONF_UNSET_PTR) {
+        conf->jobs = prev->jobs;
+        conf->jobs_valid = prev->jobs_valid;
+    }
+
+    if (conf->jobs_show && smrzr_job_zone_get(conf->jobs_show) == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"summarizer_jobs_show\" zone \"%V\" is unknown",
+                           &conf->jobs_show->shm.name);
+        return NGX_CONF_ERROR;
+    }
+
+    /* the percentage comes with the pool */
+    if (conf->mirror == NGX_CONF_UNSET_PTR) {
+        conf->mirror = prev->mirror;
+        conf->mirror_percent = prev->mirror_percent;
+    }
+
+    if (conf->mirror) {
+        /* the copy is read into memory and thrown away */
+        conf->mirror_upstream = ngx_palloc(cf->pool,
+                                           sizeof(ngx_http_upstream_conf_t));
+        if (conf->mirror_upstream == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        *conf->mirror_upstream = conf->upstream;
+        conf->mirror_upstream->upstream = conf->mirror;
+        conf->mirror_upstream->buffering = 0;
+        conf->mirror_upstream->intercept_errors = 0;
+#if (NGX_HTTP_SUMMARIZER_CACHE)
+        conf->mirror_upstream->cache = 0;
+#endif
+    }
+
+    return NGX_CONF_OK;
+}
+
+/* pass */
+static char*
+ngx_http_summarizer_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_summarizer_loc_conf_t *slcf = conf;
+    ngx_http_summarizer_main_conf_t *smcf;
+    ngx_http_summarizer_pool_t     *pool;
+    ngx_str_t                      *value;
+    ngx_url_t                       url;
+    ngx_http_core_loc_conf_t       *clcf;
+    ngx_uint_t                      i;
+
+    if (slcf->upstream.upstream) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    ngx_memzero(&url, sizeof(ngx_url_t));
+
+    if (ngx_strncmp(value[1].data, "shm:", 4) == 0) {
+        /* co-located daemon: shm segment + unix socket for notification */
+        value[1].data += 4;
+        value[1].len -= 4;
+
+        slcf->shm = smrzr_shm_create(cf, &value[1], &url.url);
+        if (slcf->shm == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+    } else {
+        url.url = value[1];
+    }
+
+    url.no_resolve = 1;
+
+    slcf->upstream.upstream = ngx_http_upstream_add(cf, &url, 0);
+    if (slcf->upstream.upstream == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    /* remember the pool for the circuit breaker */
+    smcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_summarizer_module);
+
+    pool = smcf->pools.elts;
+
+    for (i = 0; i < smcf->pools.nelts; i++) {
+        if (pool[i].upstream == slcf->upstream.upstream) {
+            break;
+        }
+    }
+
+    if (i == smcf->pools.nelts) {
+        if (NULL == (pool = ngx_array_push(&smcf->pools))) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_memzero(pool, sizeof(ngx_http_summarizer_pool_t));
+        pool->upstream = slcf->upstream.upstream;
+    }
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+    clcf->handler = ngx_http_summarizer_handler;
+
+    if (clcf->name.data[clcf->name.len - 1] == '/') {
+        clcf->auto_redirect = 1;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/* variable index of a query arg */
+static char*
+ngx_http_summarizer_args_index(ngx_conf_t *cf,
+    ngx_http_summarizer_loc_conf_t *slcf, ngx_uint_t i)
+{
+    if(NGX_ERROR == (slcf->arg_idx[i] = ngx_http_get_variable_index(
+                                  cf, &ngx_http_summarizer_args[i])))
+    {
+        ngx_log_error(NGX_LOG_ERR, cf->log, 0,
+             "Can't get variable index for '%s' key",
+                ngx_http_summarizer_args[i].data);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/* lead sentences fallback handler */
+static char*
+ngx_http_summarizer_lead(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_summarizer_loc_conf_t *slcf = conf;
+    ngx_str_t                      *value;
+    ngx_http_core_loc_conf_t       *clcf;
+
+    if (slcf->lead_root.data) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    slcf->lead_root = value[1];
+
+    if (slcf->lead_root.len > 1
+        && slcf->lead_root.data[slcf->lead_root.len - 1] == '/')
+    {
+        slcf->lead_root.len--;
+    }
+
+    if (ngx_conf_full_name(cf->cycle, &slcf->lead_root, 0) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+    clcf->handler = ngx_http_summarizer_lead_handler;
+
+    return NGX_CONF_OK;
+}
+
+/* summarizer_ratio <ratio>; folded at configuration when constant */
+static char*
+ngx_http_summarizer_ratio(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_summarizer_loc_conf_t   *slcf = conf;
+    ngx_str_t                        *value;
+    ngx_int_t                         n;
+    ngx_http_compile_complex_value_t  ccv;
+
+    if (slcf->ratio != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_http_script_variables_count(&value[1]) == 0) {
+        n = ngx_atofp(value[1].data, value[1].len, 2);
+
+        if (n == NGX_ERROR || n == 0 || n > 10000) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid ratio \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+        slcf->ratio = NULL;
+        slcf->ratio_fixed = n;
+
+        return NGX_CONF_OK;
+    }
+
+    slcf->ratio = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+    if (slcf->ratio == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+    ccv.cf = cf;
+    ccv.value = &value[1];
+    ccv.complex_value = slcf->ratio;
+
+    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/* summarizer_split <size> [parts] | off */
+static char*
+ngx_http_summarizer_split(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_summarizer_loc_conf_t *slcf = conf;
+    ngx_str_t                      *value;
+    ngx_int_t                       n;
+
+    if (slcf->split_size != NGX_CONF_UNSET) {
         return "is duplicate";
     }
 
-    value = cf->args->elts;
-
-    ngx_memzero(&url, sizeof(ngx_url_t));
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        if (cf->args->nelts != 2) {
+            return "has invalid parameters with \"off\"";
+        }
+
+        slcf->split_size = 0;
+        return NGX_CONF_OK;
+    }
+
+    slcf->split_size = ngx_parse_offset(&value[1]);
+
+    if (slcf->split_size == NGX_ERROR || slcf->split_size == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (cf->args->nelts == 3) {
+        n = ngx_atoi(value[2].data, value[2].len);
+
+        if (n == NGX_ERROR || n < 2 || n > 32) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid number of parts \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        slcf->split_parts = n;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/* summarizer_limit_zone <key> zone=<name>:<size> rate=<size>/s|/m */
+static char*
+ngx_http_summarizer_limit_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_str_t                        *value, name, s;
+    ngx_uint_t                        i;
+    ssize_t                           size;
+    off_t                             rate;
+    ngx_uint_t                        scale;
+    smrzr_limit_zone_t               *zone;
+    ngx_http_complex_value_t          key;
+    ngx_http_compile_complex_value_t  ccv;
+
+    value = cf->args->elts;
+
+    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+    ccv.cf = cf;
+    ccv.value = &value[1];
+    ccv.complex_value = &key;
+
+    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    size = 0;
+    rate = 0;
+    name.len = 0;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+
+            if (ngx_http_summarizer_zone_arg(cf, &value[i], &name, &size)
+                != NGX_CONF_OK)
+            {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "rate=", 5) == 0) {
+
+            s.data = value[i].data + 5;
+            s.len = value[i].len - 5;
+            scale = 1;
+
+            if (s.len > 2 && ngx_strncmp(s.data + s.len - 2, "/s", 2) == 0) {
+                s.len -= 2;
+
+            } else if (s.len > 2
+                       && ngx_strncmp(s.data + s.len - 2, "/m", 2) == 0)
+            {
+                s.len -= 2;
+                scale = 60;
+            }
+
+            rate = ngx_parse_offset(&s);
+
+            if (rate == NGX_ERROR || rate / scale == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid rate \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            rate /= scale;
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (rate == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"rate\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    zone = smrzr_limit_zone_create(cf, &name, size,
+                                   &ngx_http_summarizer_module);
+    if (zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    zone->rate = (uint64_t) rate;
+    zone->key = key;
+
+    return NGX_CONF_OK;
+}
+
+/* summarizer_limit zone=<name> [burst=<size>] [nodelay] | off */
+static char*
+ngx_http_summarizer_limit(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_summarizer_loc_conf_t *slcf = conf;
+    ngx_str_t                      *value, s;
+    ngx_uint_t                      i;
+    off_t                           burst;
+    ngx_shm_zone_t                 *shm_zone;
+
+    if (slcf->limit_zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        if (cf->args->nelts != 2) {
+            return "has invalid parameters with \"off\"";
+        }
+
+        slcf->limit_zone = NULL;
+        return NGX_CONF_OK;
+    }
+
+    shm_zone = NULL;
+    burst = 0;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+
+            s.len = value[i].len - 5;
+            s.data = value[i].data + 5;
+
+            shm_zone = ngx_shared_memory_add(cf, &s, 0,
+                                             &ngx_http_summarizer_module);
+            if (shm_zone == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "burst=", 6) == 0) {
+
+            s.len = value[i].len - 6;
+            s.data = value[i].data + 6;
+
+            burst = ngx_parse_offset(&s);
+
+            if (burst == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid burst size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "nodelay") == 0) {
+            slcf->limit_nodelay = 1;
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    slcf->limit_zone = shm_zone;
+    slcf->limit_burst = (uint64_t) burst;
+
+    return NGX_CONF_OK;
+}
+
+/* summarizer_circuit_breaker <fails> [time] | off */
+static char*
+ngx_http_summarizer_circuit_breaker(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_summarizer_loc_conf_t *slcf = conf;
+    ngx_str_t                      *value;
+    ngx_int_t                       n;
+
+    if (slcf->breaker_fails != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        if (cf->args->nelts != 2) {
+            return "has invalid parameters with \"off\"";
+        }
+
+        slcf->breaker_fails = 0;
+        return NGX_CONF_OK;
+    }
+
+    n = ngx_atoi(value[1].data, value[1].len);
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number of failures \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    slcf->breaker_fails = n;
+
+    if (cf->args->nelts == 3) {
+        slcf->breaker_timeout = ngx_parse_time(&value[2], 1);
+        if (slcf->breaker_timeout == (time_t) NGX_ERROR
+            || slcf->breaker_timeout == 0)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid open time \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+/* summarizer_mirror <upstream> [<percent>] | off */
+static char*
+ngx_http_summarizer_mirror_conf(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_summarizer_loc_conf_t *slcf = conf;
+    ngx_str_t                      *value, s;
+    ngx_url_t                       url;
+    ngx_int_t                       n;
+
+    if (slcf->mirror != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        if (cf->args->nelts != 2) {
+            return "has invalid parameters with \"off\"";
+        }
+
+        slcf->mirror = NULL;
+        return NGX_CONF_OK;
+    }
+
+#if (nginx_version < 1013001)
+    return "requires nginx-1.13.1 or later";
+#endif
+
+    slcf->mirror_percent = 10000;
+
+    if (cf->args->nelts == 3) {
+        s = value[2];
+
+        if (s.len && s.data[s.len - 1] == '%') {
+            s.len--;
+        }
+
+        n = ngx_atofp(s.data, s.len, 2);
+        if (n == NGX_ERROR || n == 0 || n > 10000) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid percentage \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        slcf->mirror_percent = n;
+    }
+
+    ngx_memzero(&url, sizeof(ngx_url_t));
+
+    url.url = value[1];
+    url.no_resolve = 1;
+
+    slcf->mirror = ngx_http_upstream_add(cf, &url, 0);
+    if (slcf->mirror == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/* summarizer_trace zone=<name>:<size> [every=<number>] | off */
+static char*
+ngx_http_summarizer_trace(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_summarizer_loc_conf_t *slcf = conf;
+    ngx_str_t                      *value, name;
+    ssize_t                         size;
+    ngx_int_t                       n;
+
+    if (slcf->trace != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        if (cf->args->nelts != 2) {
+            return "has invalid parameters with \"off\"";
+        }
+
+        slcf->trace = NULL;
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_http_summarizer_zone_arg(cf, &value[1], &name, &size)
+        != NGX_CONF_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    slcf->trace_every = 100;
+
+    if (cf->args->nelts == 3) {
+        if (ngx_strncmp(value[2].data, "every=", 6) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        n = ngx_atoi(value[2].data + 6, value[2].len - 6);
+        if (n == NGX_ERROR || n == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid sampling rate \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        slcf->trace_every = n;
+    }
+
+    slcf->trace = smrzr_trace_zone_create(cf, &name, size,
+                                          &ngx_http_summarizer_module);
+    if (slcf->trace == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/* summarizer_trace_show <zone> */
+static char*
+ngx_http_summarizer_trace_show(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_summarizer_loc_conf_t *slcf = conf;
+    ngx_str_t                      *value;
+    ngx_http_core_loc_conf_t       *clcf;
+
+    if (slcf->trace_show) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    slcf->trace_show = ngx_shared_memory_add(cf, &value[1], 0,
+                                             &ngx_http_summarizer_module);
+    if (slcf->trace_show == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+    clcf->handler = ngx_http_summarizer_trace_handler;
+
+    return NGX_CONF_OK;
+}
+
+/* summarizer_incremental zone=<name>:<size> | off */
+static char*
+ngx_http_summarizer_incremental_conf(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_summarizer_loc_conf_t *slcf = conf;
+    ngx_str_t                      *value, name;
+    ssize_t                         size;
+
+    if (slcf->incremental != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        slcf->incremental = NULL;
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_http_summarizer_zone_arg(cf, &value[1], &name, &size)
+        != NGX_CONF_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    slcf->incremental = smrzr_incr_zone_create(cf, &name, size,
+                                               &ngx_http_summarizer_module);
+    if (slcf->incremental == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/* summarizer_jobs zone=<name>:<size> [valid=<time>] | off */
+static char*
+ngx_http_summarizer_jobs(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_summarizer_loc_conf_t *slcf = conf;
+    ngx_str_t                      *value, name, s;
+    ssize_t                         size;
+
+    if (slcf->jobs != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        if (cf->args->nelts != 2) {
+            return "has invalid parameters with \"off\"";
+        }
+
+        slcf->jobs = NULL;
+        return NGX_CONF_OK;
+    }
+
+#if (nginx_version < 1009000)
+    return "requires nginx-1.9.0 or later";
+#endif
+
+    if (ngx_http_summarizer_zone_arg(cf, &value[1], &name, &size)
+        != NGX_CONF_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    slcf->jobs_valid = 600;
+
+    if (cf->args->nelts == 3) {
+        if (ngx_strncmp(value[2].data, "valid=", 6) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        s.data = value[2].data + 6;
+        s.len = value[2].len - 6;
+
+        slcf->jobs_valid = ngx_parse_time(&s, 1);
+        if (slcf->jobs_valid == (time_t) NGX_ERROR || slcf->jobs_valid == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid valid time \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    slcf->jobs = smrzr_job_zone_create(cf, &name, size,
+                                       &ngx_http_summarizer_module);
+    if (slcf->jobs == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/* summarizer_jobs_show <zone> */
+static char*
+ngx_http_summarizer_jobs_show(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_summarizer_loc_conf_t *slcf = conf;
+    ngx_str_t                      *value;
+    ngx_http_core_loc_conf_t       *clcf;
+
+    if (slcf->jobs_show) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    slcf->jobs_show = ngx_shared_memory_add(cf, &value[1], 0,
+                                            &ngx_http_summarizer_module);
+    if (slcf->jobs_show == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+    clcf->handler = ngx_http_summarizer_jobs_handler;
+
+    return NGX_CONF_OK;
+}
+
+/* summarizer_set $var <uri> */
+static char*
+ngx_http_summarizer_set(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_summarizer_loc_conf_t     *slcf = conf;
+    ngx_str_t                          *value;
+    ngx_http_variable_t                *v;
+    ngx_http_summarizer_set_t          *set;
+    ngx_http_compile_complex_value_t    ccv;
+
+    value = cf->args->elts;
+
+    if (value[1].data[0] != '$') {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid variable name \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    value[1].len--;
+    value[1].data++;
+
+    if (slcf->sets == NULL) {
+        slcf->sets = ngx_array_create(cf->pool, 1,
+                                      sizeof(ngx_http_summarizer_set_t));
+        if (slcf->sets == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    set = ngx_array_push(slcf->sets);
+    if (set == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    v = ngx_http_add_variable(cf, &value[1], NGX_HTTP_VAR_CHANGEABLE);
+    if (v == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    set->index = ngx_http_get_variable_index(cf, &value[1]);
+    if (set->index == NGX_ERROR) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (v->get_handler == NULL) {
+        v->get_handler = ngx_http_summarizer_set_variable;
+    }
+
+    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+    ccv.cf = cf;
+    ccv.value = &value[2];
+    ccv.complex_value = &set->uri;
+
+    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/* summarizer_hash_filename [bound=<factor>] */
+#if (nginx_version >= 1009000)
+
+static char*
+ngx_http_summarizer_hash_filename(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_summarizer_srv_conf_t     *sscf = conf;
+    ngx_http_upstream_srv_conf_t       *uscf;
+    ngx_str_t                          *value;
+    ngx_int_t                           n;
+
+    if (sscf->bound) {
+        return "is duplicate";
+    }
+
+    sscf->bound = 125;
+
+    if (cf->args->nelts == 2) {
+        value = cf->args->elts;
+
+        if (ngx_strncmp(value[1].data, "bound=", 6) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+        n = ngx_atofp(value[1].data + 6, value[1].len - 6, 2);
+        if (n == NGX_ERROR || n < 100) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid bound \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+        sscf->bound = n;
+    }
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    if (uscf->peer.init_upstream) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "load balancing method redefined");
+    }
+
+    uscf->peer.init_upstream = ngx_http_summarizer_chash_init;
+
+    uscf->flags = NGX_HTTP_UPSTREAM_CREATE
+                  |NGX_HTTP_UPSTREAM_WEIGHT
+                  |NGX_HTTP_UPSTREAM_MAX_FAILS
+                  |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
+                  |NGX_HTTP_UPSTREAM_DOWN;
+#if (nginx_version >= 1011005)
+    uscf->flags |= NGX_HTTP_UPSTREAM_MAX_CONNS;
+#endif
+
+    return NGX_CONF_OK;
+}
+
+#else
+
+static char*
+ngx_http_summarizer_hash_filename(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    /* the peers of older nginx are an array with no shared state */
+    return "requires nginx-1.9.0 or later";
+}
+
+#endif
+
+/* zone=<name>:<size> */
+static char*
+ngx_http_summarizer_zone_arg(ngx_conf_t *cf, ngx_str_t *value,
+    ngx_str_t *name, ssize_t *size)
+{
+    ngx_str_t                       s;
+    u_char                         *p;
+
+    if (ngx_strncmp(value->data, "zone=", 5) != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", value);
+        return NGX_CONF_ERROR;
+    }
+
+    name->data = value->data + 5;
+
+    p = (u_char *) ngx_strchr(name->data, ':');
+
+    if (p == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone size \"%V\"", value);
+        return NGX_CONF_ERROR;
+    }
+
+    name->len = p - name->data;
+
+    s.data = p + 1;
+    s.len = value->data + value->len - s.data;
+
+    *size = ngx_parse_size(&s);
+
+    if (*size == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone size \"%V\"", value);
+        return NGX_CONF_ERROR;
+    }
+
+    if (*size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is too small", value);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+#if (NGX_HTTP_SUMMARIZER_CACHE)
+
+/* summarizer_cache <zone> | off */
+static char*
+ngx_http_summarizer_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_summarizer_loc_conf_t *slcf = conf;
+    ngx_str_t                      *value;
+
+    value = cf->args->elts;
+
+    if (slcf->upstream.cache != NGX_CONF_UNSET) {
+        return "is duplicate";
+    }
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        slcf->upstream.cache = 0;
+        return NGX_CONF_OK;
+    }
+
+    slcf->upstream.cache = 1;
+
+    slcf->upstream.cache_zone = ngx_shared_memory_add(cf, &value[1], 0,
+                                               &ngx_http_summarizer_module);
+    if (slcf->upstream.cache_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+static char*
+ngx_http_summarizer_cache_key(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_summarizer_loc_conf_t   *slcf = conf;
+    ngx_str_t                        *value;
+    ngx_http_compile_complex_value_t  ccv;
+
+    value = cf->args->elts;
+
+    if (slcf->cache_key.value.data) {
+        return "is duplicate";
+    }
+
+    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+    ccv.cf = cf;
+    ccv.value = &value[1];
+    ccv.complex_value = &slcf->cache_key;
+
+    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/* summarizer_dedup zone=<name>:<size> | off */
+static char*
+ngx_http_summarizer_dedup(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_summarizer_loc_conf_t *slcf = conf;
+    ngx_str_t                      *value, name;
+    ssize_t                         size;
+
+    if (slcf->dedup != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        slcf->dedup = NULL;
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_http_summarizer_zone_arg(cf, &value[1], &name, &size)
+        != NGX_CONF_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    slcf->dedup = smrzr_fp_zone_create(cf, &name, size,
+                                       &ngx_http_summarizer_module);
+    if (slcf->dedup == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/* summarizer_cache_refresh_ahead <fraction> [min_uses=<number>] | off */
+static char*
+ngx_http_summarizer_refresh_ahead_conf(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_summarizer_loc_conf_t *slcf = conf;
+    ngx_str_t                      *value;
+    ngx_int_t                       n;
+
+    if (slcf->refresh_ahead != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        if (cf->args->nelts != 2) {
+            return "has invalid parameters with \"off\"";
+        }
+
+        slcf->refresh_ahead = 0;
+        return NGX_CONF_OK;
+    }
+
+#if (nginx_version < 1013001)
+    return "requires nginx-1.13.1 or later";
+#endif
+
+    n = ngx_atofp(value[1].data, value[1].len, 2);
+    if (n == NGX_ERROR || n == 0 || n > 100) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid fraction \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    slcf->refresh_ahead = n;
+    slcf->refresh_min_uses = 2;
+
+    if (cf->args->nelts == 3) {
+        if (ngx_strncmp(value[2].data, "min_uses=", 9) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        /* as counted by the cache node */
+        n = ngx_atoi(value[2].data + 9, value[2].len - 9);
+        if (n == NGX_ERROR || n > 1023) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid number of uses \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        slcf->refresh_min_uses = n;
+    }
+
+    return NGX_CONF_OK;
+}
+
+#endif
+
+/* index */
+static char*
+ngx_http_summarizer_index(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_summarizer_loc_conf_t  *slcf = conf;
+    ngx_http_summarizer_main_conf_t *smcf;
+    ngx_str_t                       *value, path;
+    smrzr_index_t                  **idx;
+    ngx_uint_t                       i;
+
+    if (slcf->index != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        slcf->index = NULL;
+        return NGX_CONF_OK;
+    }
+
+    smcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_summarizer_module);
+
+    path = value[1];
+
+    if (ngx_conf_full_name(cf->cycle, &path, 0) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    /* one mapping per file for all locations */
+    idx = smcf->indexes.elts;
+
+    for (i = 0; i < smcf->indexes.nelts; i++) {
+        if (idx[i]->path.len == path.len
+            && ngx_strncmp(idx[i]->path.data, path.data, path.len) == 0)
+        {
+            slcf->index = idx[i];
+            return NGX_CONF_OK;
+        }
+    }
+
+    if (NULL == (slcf->index = smrzr_index_create(cf, &path))) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (NULL == (idx = ngx_array_push(&smcf->indexes))) {
+        return NGX_CONF_ERROR;
+    }
+
+    *idx = slcf->index;
+
+    return NGX_CONF_OK;
+}
+
+/* put the circuit breaker in front of the daemon pools */
+static ngx_int_t
+ngx_http_summarizer_init(ngx_conf_t *cf)
+{
+    ngx_http_summarizer_main_conf_t *smcf;
+    ngx_http_summarizer_pool_t      *pool;
+    ngx_http_core_main_conf_t       *cmcf;
+    ngx_http_handler_pt             *h;
+    ngx_uint_t                       i;
+
+    smcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_summarizer_module);
+
+    pool = smcf->pools.elts;
+
+    for (i = 0; i < smcf->pools.nelts; i++) {
+        pool[i].init_peer = pool[i].upstream->peer.init;
+        pool[i].upstream->peer.init = ngx_http_summarizer_breaker_init_peer;
+    }
+
+    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+    /* summarizer_set; the access phase is skipped in subrequests */
+#if (nginx_version >= 1013004)
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_PRECONTENT_PHASE].handlers);
+#else
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_ACCESS_PHASE].handlers);
+#endif
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_summarizer_set_handler;
+
+    return NGX_OK;
+}
+
+/* map indexes in worker */
+static ngx_int_t
+ngx_http_summarizer_init_process(ngx_cycle_t *cycle)
+{
+    ngx_http_summarizer_main_conf_t *smcf;
+    smrzr_index_t                  **idx;
+    ngx_uint_t                       i;
+
+    smcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                               ngx_http_summarizer_module);
+    if (smcf == NULL) {
+        return NGX_OK;
+    }
+
+    idx = smcf->indexes.elts;
+
+    for (i = 0; i < smcf->indexes.nelts; i++) {
+        /* a missing index only means all requests go to the daemon */
+        (void) smrzr_index_open(idx[i], cycle->log);
+    }
+
+    /* without it, only summarizer_jobs fails */
+    (void) smrzr_job_init_process(cycle->log);
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_summarizer_exit_process(ngx_cycle_t *cycle)
+{
+    ngx_http_summarizer_main_conf_t *smcf;
+    smrzr_index_t                  **idx;
+    ngx_uint_t                       i;
+
+    smcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                               ngx_http_summarizer_module);
+    if (smcf == NULL) {
+        return;
+    }
+
+    idx = smcf->indexes.elts;
+
+    for (i = 0; i < smcf->indexes.nelts; i++) {
+        smrzr_index_close(idx[i]);
+    }
+
+    smrzr_job_exit_process();
+}
+
+/* answer from the index; NGX_DECLINED on a miss */
+static ngx_int_t
+ngx_http_summarizer_index_handler(
+    ngx_http_request_t                  * r,
+    ngx_http_summarizer_loc_conf_t      * slcf,
+    ngx_http_summarizer_ctx_t           * ctx)
+{
+    ngx_int_t                           rc;
+    smrzr_input_t                      *input;
+    off_t                               offset;
+    size_t                              len;
+    ngx_buf_t                          *b;
+    ngx_chain_t                         out;
+
+    /* an inline document is not in the index; its arguments are parsed
+     * once the body is read */
+    if (r->headers_in.content_length_n > 0 || r->headers_in.chunked) {
+        return NGX_DECLINED;
+    }
+
+    input = ngx_http_summarizer_args(r, ctx);
+
+    if (input == NULL
+        || smrzr_index_lookup(slcf->index, &input->file_name, input->ratio,
+                              &offset, &len) != NGX_OK)
+    {
+        return NGX_DECLINED;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "summarizer index hit: \"%V\" %O:%uz",
+                   &input->file_name, offset, len);
+
+    if (ngx_http_discard_request_body(r) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = len;
+
+    if (len == 0) {
+        r->header_only = 1;
+    }
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+    if (b->file == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* sendfile from the index file, or write straight from the mapping */
+    b->in_file = 1;
+    b->file_pos = offset;
+    b->file_last = offset + len;
+    b->memory = 1;
+    b->pos = slcf->index->addr + offset;
+    b->last = b->pos + len;
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    b->file->fd = slcf->index->fd;
+    b->file->name = slcf->index->path;
+    b->file->log = r->connection->log;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+/* sampled traces of summarizer_trace, newest first */
+static ngx_int_t
+ngx_http_summarizer_trace_handler(ngx_http_request_t *r)
+{
+    ngx_http_summarizer_loc_conf_t     *slcf;
+    smrzr_trace_zone_t                 *zone;
+    smrzr_trace_rec_t                  *rec;
+    ngx_tm_t                            tm;
+    ngx_buf_t                          *b;
+    ngx_chain_t                         out;
+    ngx_uint_t                          age;
+    ngx_int_t                           rc;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    if (ngx_http_discard_request_body(r) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_summarizer_module);
+
+    zone = smrzr_trace_zone_get(slcf->trace_show);
+
+    rec = ngx_palloc(r->pool, sizeof(smrzr_trace_rec_t));
+    b = ngx_create_temp_buf(r->pool, zone->sh->nrecs * SMRZR_TRACE_TEXT_LEN);
+
+    if (rec == NULL || b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    for (age = 0; /* void */; age++) {
+
+        rc = smrzr_trace_read(zone, age, rec);
+
+        if (rc == NGX_DONE) {
+            break;
+        }
+
+        if (rc == NGX_AGAIN) {
+            continue;
+        }
+
+        ngx_gmtime(rec->sec, &tm);
+
+        b->last = ngx_sprintf(b->last,
+                      "%4d-%02d-%02dT%02d:%02d:%02d.%03MZ pid:%P rc:%i "
+                      "sent:+%uDms header:+%uDms done:+%uDms" CRLF,
+                      tm.ngx_tm_year, tm.ngx_tm_mon, tm.ngx_tm_mday,
+                      tm.ngx_tm_hour, tm.ngx_tm_min, tm.ngx_tm_sec,
+                      rec->msec, rec->pid, rec->rc,
+                      rec->sent_ms, rec->header_ms, rec->done_ms);
+
+        b->last = ngx_sprintf(b->last, "  request [%uD]: ", rec->req_len);
+        b->last = ngx_hex_dump(b->last, rec->req,
+                               ngx_min(rec->req_len, SMRZR_TRACE_REQ_MAX));
+
+        b->last = ngx_sprintf(b->last, CRLF "  response [%uD]: ",
+                              rec->resp_len);
+        b->last = ngx_hex_dump(b->last, rec->resp,
+                               ngx_min(rec->resp_len, SMRZR_TRACE_RESP_MAX));
+
+        *b->last++ = CR; *b->last++ = LF;
+    }
+
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    if (b->last == b->pos) {
+        r->header_only = 1;
+    }
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+/* a summarizer_jobs job by the id ending the URI */
+static ngx_int_t
+ngx_http_summarizer_jobs_handler(ngx_http_request_t *r)
+{
+    ngx_http_summarizer_loc_conf_t     *slcf;
+    ngx_table_elt_t                    *h;
+    ngx_buf_t                          *b;
+    ngx_chain_t                         out;
+    ngx_str_t                           id;
+    smrzr_job_t                         job;
+    ngx_int_t                           rc;
+    u_char                             *p;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    if (ngx_http_discard_request_body(r) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_summarizer_module);
+
+    p = r->uri.data + r->uri.len;
+
+    while (p > r->uri.data && *(p - 1) != '/') {
+        p--;
+    }
+
+    id.data = p;
+    id.len = r->uri.data + r->uri.len - p;
+
+    rc = smrzr_job_get(smrzr_job_zone_get(slcf->jobs_show), &id, r->pool,
+                       &job);
+
+    if (rc == NGX_DECLINED) {
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    if (rc != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    switch (job.state) {
+
+    case SMRZR_JOB_PENDING:
+        h = ngx_list_push(&r->headers_out.headers);
+        if (h == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        h->hash = 1;
+#if (nginx_version >= 1023000)
+        h->next = NULL;
+#endif
+        ngx_str_set(&h->key, "Retry-After");
+        ngx_str_set(&h->value, "1");
+
+        r->headers_out.status = NGX_HTTP_ACCEPTED;
+        r->headers_out.content_length_n = 0;
+        r->header_only = 1;
+
+        return ngx_http_send_header(r);
+
+    case SMRZR_JOB_FAILED:
+        return job.status;
+
+    default: /* SMRZR_JOB_DONE */
+        break;
+    }
+
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = job.summary.len;
+
+    if (job.summary.len == 0) {
+        r->header_only = 1;
+    }
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->pos = job.summary.data;
+    b->last = job.summary.data + job.summary.len;
+    b->memory = 1;
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+/* lead sentences of the document when the daemons can't be used */
+static ngx_int_t
+ngx_http_summarizer_lead_handler(ngx_http_request_t *r)
+{
+    ngx_http_summarizer_loc_conf_t     *slcf;
+    ngx_http_summarizer_ctx_t          *ctx;
+    smrzr_input_t                      *args;
+    smrzr_lead_t                       *lead;
+    ngx_str_t                           file_name, *name;
+    ngx_chain_t                        *cl;
+    u_char                             *p;
+    size_t                              n;
+#if (NGX_THREADS)
+    ngx_thread_pool_t                  *tp;
+    ngx_thread_task_t                  *task;
+    ngx_int_t                           rc;
+#endif
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD|NGX_HTTP_POST))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    if (ngx_http_discard_request_body(r) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (ngx_http_set_content_type(r) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_summarizer_module);
+
+    lead = ngx_pcalloc(r->pool, sizeof(smrzr_lead_t));
+    if (lead == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    lead->buf = ngx_palloc(r->pool, slcf->lead_max_size);
+    if (lead->buf == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    lead->max = slcf->lead_max_size;
+
+    /* error_page dropped the context of the summarizer location */
+    ctx = ngx_http_get_module_ctx(r, ngx_http_summarizer_module);
+
+    if (ctx == NULL) {
+        ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_summarizer_ctx_t));
+        if (ctx == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        ngx_http_set_ctx(r, ctx, ngx_http_summarizer_module);
+    }
+
+    args = ngx_http_summarizer_args(r, ctx);
+    if (args == NULL) {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    lead->ratio = args->ratio;
+
+    /* an inline document is still in the request body after error_page */
+    if (r->request_body && r->request_body->bufs) {
+        for (cl = r->request_body->bufs; cl && lead->len < lead->max;
+             cl = cl->next)
+        {
+            if (!ngx_buf_in_memory(cl->buf)) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "summarizer_lead: inline document is buffered to a file");
+                return NGX_HTTP_SERVICE_UNAVAILABLE;
+            }
+
+            n = ngx_min((size_t)(cl->buf->last - cl->buf->pos),
+                        lead->max - lead->len);
+            ngx_memcpy(lead->buf + lead->len, cl->buf->pos, n);
+            lead->len += n;
+        }
+
+        lead->len = smrzr_lead_cut(lead->buf, lead->len, lead->ratio);
+
+        return ngx_http_summarizer_lead_send(r, lead);
+    }
+
+    /* the file name is taken relative to the summarizer_lead directory */
+    file_name = args->file_name;
+    name = &file_name;
+
+    while (name->len && name->data[0] == '/') {
+        name->data++;
+        name->len--;
+    }
+
+    if (name->len == 0
+        || ngx_strlchr(name->data, name->data + name->len, '\0')
+        || (name->len >= 2 && ngx_strncmp(name->data, "..", 2) == 0
+            && (name->len == 2 || name->data[2] == '/'))
+        || ngx_strlcasestrn(name->data, name->data + name->len,
+                            (u_char *) "/../", 4 - 1)
+        || (name->len >= 3
+            && ngx_strncmp(name->data + name->len - 3, "/..", 3) == 0))
+    {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            "summarizer_lead: unsafe file name \"%V\"", name);
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    lead->path = ngx_pnalloc(r->pool, slcf->lead_root.len + 1 + name->len + 1);
+    if (lead->path == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    p = ngx_cpymem(lead->path, slcf->lead_root.data, slcf->lead_root.len);
+    *p++ = '/';
+    p = ngx_cpymem(p, name->data, name->len);
+    *p = '\0';
+
+#if (NGX_THREADS)
+    rc = ngx_http_summarizer_thread_pool(r, &tp);
+
+    if (rc == NGX_ERROR) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (rc == NGX_OK) {
+        task = ngx_thread_task_alloc(r->pool, 0);
+        if (task == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        task->ctx = lead;
+        task->handler = ngx_http_summarizer_lead_thread;
+        task->event.handler = ngx_http_summarizer_lead_event;
+        task->event.data = r;
+
+        if (ngx_thread_task_post(tp, task) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        r->main->blocked++;
+        r->aio = 1;
+        r->main->count++;
+
+        return NGX_DONE;
+    }
+#endif
+
+    smrzr_lead_read(lead, r->connection->log);
+
+    return ngx_http_summarizer_lead_send(r, lead);
+}
+
+#if (NGX_THREADS)
+
+static void
+ngx_http_summarizer_lead_thread(void *data, ngx_log_t *log)
+{
+    smrzr_lead_read(data, log);
+}
+
+static void
+ngx_http_summarizer_lead_event(ngx_event_t *ev)
+{
+    ngx_http_request_t    *r = ev->data;
+    ngx_thread_task_t     *task;
+    ngx_connection_t      *c;
+
+    c = r->connection;
+    task = (ngx_thread_task_t *) ((u_char *) ev
+                                  - offsetof(ngx_thread_task_t, event));
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    ngx_http_finalize_request(r, ngx_http_summarizer_lead_send(r, task->ctx));
+    ngx_http_run_posted_requests(c);
+}
+
+/* the pool of "aio threads", NGX_DECLINED if files are read otherwise */
+static ngx_int_t
+ngx_http_summarizer_thread_pool(ngx_http_request_t *r, ngx_thread_pool_t **tp)
+{
+    ngx_http_core_loc_conf_t           *clcf;
+    ngx_str_t                           name;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (clcf->aio != NGX_HTTP_AIO_THREADS) {
+        return NGX_DECLINED;
+    }
+
+    *tp = clcf->thread_pool;
+
+    if (*tp == NULL) {
+        if (ngx_http_complex_value(r, clcf->thread_pool_value, &name)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        *tp = ngx_thread_pool_get((ngx_cycle_t *) ngx_cycle, &name);
+
+        if (*tp == NULL) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "thread pool \"%V\" not found", &name);
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+static ngx_int_t
+ngx_http_summarizer_lead_send(ngx_http_request_t *r, smrzr_lead_t *lead)
+{
+    ngx_int_t                           rc;
+    ngx_buf_t                          *b;
+    ngx_chain_t                         out;
+    ngx_table_elt_t                    *h;
+
+    if (lead->err) {
+        if (lead->err == NGX_ENOENT || lead->err == NGX_ENOTDIR) {
+            return NGX_HTTP_NOT_FOUND;
+        }
+
+        if (lead->err == NGX_EACCES) {
+            return NGX_HTTP_FORBIDDEN;
+        }
+
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "summarizer lead: %uz bytes", lead->len);
+
+    h = ngx_list_push(&r->headers_out.headers);
+    if (h == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    h->hash = 1;
+#if (nginx_version >= 1023000)
+    h->next = NULL;
+#endif
+    ngx_str_set(&h->key, "X-Summarizer-Fallback");
+    ngx_str_set(&h->value, "lead");
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = lead->len;
+
+    if (lead->len == 0) {
+        r->header_only = 1;
+    }
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->memory = 1;
+    b->pos = lead->buf;
+    b->last = lead->buf + lead->len;
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+/* size of the document to summarize, 0 if unknown */
+static uint64_t
+ngx_http_summarizer_limit_cost(ngx_http_request_t *r,
+    ngx_http_summarizer_ctx_t *ctx)
+{
+    uint64_t                            cost = 0;
+    ngx_chain_t                        *cl;
+    ngx_open_file_info_t               *of;
+
+    if (r->request_body && r->request_body->bufs) {
+        for (cl = r->request_body->bufs; cl; cl = cl->next) {
+            cost += ngx_buf_size(cl->buf);
+        }
+
+        return cost;
+    }
+
+    of = ngx_http_summarizer_doc_info(r, ctx);
+    if (of == NULL) {
+        return 0;
+    }
+
+    return (uint64_t) of->size;
+}
+
+/* send a copy of the request to the summarizer_mirror pool */
+static void
+ngx_http_summarizer_mirror(ngx_http_request_t *r,
+    ngx_http_summarizer_loc_conf_t *slcf, ngx_http_summarizer_ctx_t *ctx,
+    ngx_chain_t *doc)
+{
+    ngx_http_summarizer_ctx_t          *mctx;
+    ngx_http_post_subrequest_t         *ps;
+    ngx_http_request_t                 *sr;
+    ngx_chain_t                        *cl, **ll;
+    ngx_buf_t                          *b;
+
+    if ((ngx_uint_t) (ngx_random() % 10000) >= slcf->mirror_percent) {
+        return;
+    }
+
+    mctx = ngx_pcalloc(r->pool, sizeof(ngx_http_summarizer_ctx_t));
+    ps = ngx_palloc(r->pool, sizeof(ngx_http_post_subrequest_t));
+
+    if (mctx == NULL || ps == NULL) {
+        return;
+    }
+
+    /* the document goes out twice, each time through its own buffers */
+    ll = &mctx->doc;
+
+    for (cl = doc; cl; cl = cl->next) {
+        b = ngx_calloc_buf(r->pool);
+        *ll = ngx_alloc_chain_link(r->pool);
+
+        if (b == NULL || *ll == NULL) {
+            return;
+        }
+
+        ngx_memcpy(b, cl->buf, sizeof(ngx_buf_t));
+
+        if (ngx_buf_in_memory(b)) {
+            b->start = b->pos;
+            b->end = b->last;
+        }
+
+        (*ll)->buf = b;
+        ll = &(*ll)->next;
+    }
+
+    *ll = NULL;
+
+    mctx->args_parsed = ctx->args_parsed;
+    mctx->args_rc = ctx->args_rc;
+    mctx->args = ctx->args;
+
+    mctx->mirror = 1;
+
+    ps->handler = ngx_http_summarizer_mirror_done;
+    ps->data = ctx;
+
+    if (ngx_http_subrequest(r, &r->uri, &r->args, &sr, ps,
+                            NGX_HTTP_SUBREQUEST_IN_MEMORY
+                            |SMRZR_SUBREQUEST_BACKGROUND)
+        != NGX_OK)
+    {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                      "summarizer mirror request failed");
+        return;
+    }
+
+    /* no fallbacks for the copy */
+    sr->error_page = 1;
+
+    mctx->request = sr;
+
+    ngx_http_set_ctx(sr, mctx, ngx_http_summarizer_module);
+
+    ctx->mirror_ctx = mctx;
+}
+
+static ngx_int_t
+ngx_http_summarizer_mirror_done(ngx_http_request_t *sr, void *data,
+    ngx_int_t rc)
+{
+    ngx_http_summarizer_ctx_t          *ctx = data;
+    ngx_http_summarizer_ctx_t          *mctx = ctx->mirror_ctx;
+
+    /* failed before reaching the daemon */
+    if (!mctx->measured) {
+        mctx->rc = rc;
+        mctx->measured = 1;
+    }
+
+    if (ctx->measured) {
+        ngx_http_summarizer_mirror_log(sr, ctx);
+    }
+
+    return rc;
+}
+
+/* latency and length of the summary against those of the mirror */
+static void
+ngx_http_summarizer_mirror_log(ngx_http_request_t *r,
+    ngx_http_summarizer_ctx_t *ctx)
+{
+    ngx_http_summarizer_ctx_t          *mctx = ctx->mirror_ctx;
+
+    ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                  "summarizer mirror: %Mms %uz bytes rc:%i, "
+                  "primary: %Mms %uz bytes rc:%i, delta: %ims %z bytes",
+                  mctx->elapsed, mctx->len, mctx->rc,
+                  ctx->elapsed, ctx->len, ctx->rc,
+                  (ngx_int_t) mctx->elapsed - (ngx_int_t) ctx->elapsed,
+                  (ssize_t) mctx->len - (ssize_t) ctx->len);
+}
+
+/* with the request body read and charged, hand the document to a job of
+ * its own and tell the client where to fetch its summary */
+static void
+ngx_http_summarizer_job_start(ngx_http_request_t *r)
+{
+    ngx_http_summarizer_loc_conf_t     *slcf;
+    ngx_table_elt_t                    *h;
+    ngx_buf_t                          *b;
+    ngx_chain_t                         out;
+    ngx_int_t                           rc;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_summarizer_module);
+
+    b = ngx_create_temp_buf(r->pool, SMRZR_JOB_ID_LEN + 1);
+    h = ngx_list_push(&r->headers_out.headers);
+
+    if (b == NULL || h == NULL) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    rc = smrzr_job_create(slcf->jobs, b->pos, slcf->jobs_valid,
+                          r->connection->log);
+
+    if (rc == NGX_DECLINED) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "summarizer_jobs zone \"%V\" is full of pending jobs",
+                      &slcf->jobs->shm_zone->shm.name);
+        ngx_http_finalize_request(r, NGX_HTTP_SERVICE_UNAVAILABLE);
+        return;
+    }
+
+    if (rc != NGX_OK) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    if (ngx_http_summarizer_job_run(r, slcf, b->pos) != NGX_OK) {
+        smrzr_job_finish(slcf->jobs, b->pos, NGX_HTTP_INTERNAL_SERVER_ERROR,
+                         NULL, slcf->jobs_valid, r->connection->log);
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    b->last = b->pos + SMRZR_JOB_ID_LEN;
+
+    h->hash = 1;
+#if (nginx_version >= 1023000)
+    h->next = NULL;
+#endif
+    ngx_str_set(&h->key, "X-Summarizer-Job");
+    h->value.data = b->pos;
+    h->value.len = SMRZR_JOB_ID_LEN;
+
+    *b->last++ = LF;
+
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+    r->headers_out.status = NGX_HTTP_ACCEPTED;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        ngx_http_finalize_request(r, rc);
+        return;
+    }
+
+    b->last_buf = 1;
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    ngx_http_finalize_request(r, ngx_http_output_filter(r, &out));
+}
+
+/* copy what the job needs out of the client request, which it outlives,
+ * and connect to a daemon; the job then finishes by itself */
+static ngx_int_t
+ngx_http_summarizer_job_run(ngx_http_request_t *r,
+    ngx_http_summarizer_loc_conf_t *slcf, u_char *id)
+{
+    ngx_http_summarizer_ctx_t          *ctx;
+    ngx_http_summarizer_job_t          *job;
+    ngx_pool_t                         *pool;
+    ngx_chain_t                        *cl, *in, **ll;
+    ngx_file_t                         *file, *from;
+    ngx_buf_t                          *b;
+    size_t                              size;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_summarizer_module);
+
+    if (ngx_http_summarizer_job_request(r, slcf, ctx, &in) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, r->connection->log);
+    if (pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    job = ngx_pcalloc(pool, sizeof(ngx_http_summarizer_job_t));
+    if (job == NULL) {
+        goto failed;
+    }
+
+    job->pool = pool;
+
+    /* the connection of the client is gone by the time the job logs */
+    job->log = *r->connection->log;
+    job->log.handler = NULL;
+    job->log.data = NULL;
+    job->log.action = NULL;
+
+    pool->log = &job->log;
+
+    ngx_memcpy(job->id, id, SMRZR_JOB_ID_LEN);
+
+    job->zone = slcf->jobs;
+    job->valid = slcf->jobs_valid;
+    job->connect_timeout = slcf->upstream.connect_timeout;
+    job->send_timeout = slcf->upstream.send_timeout;
+    job->read_timeout = slcf->upstream.read_timeout;
+
+    ll = &job->request;
+    file = NULL;
+    from = NULL;
+
+    for (cl = in; cl; cl = cl->next) {
+
+        if (ngx_buf_size(cl->buf) == 0) {
+            continue;
+        }
+
+        b = ngx_calloc_buf(pool);
+        if (b == NULL) {
+            goto failed;
+        }
+
+        if (ngx_buf_in_memory(cl->buf)) {
+            size = cl->buf->last - cl->buf->pos;
+
+            b->start = ngx_pnalloc(pool, size);
+            if (b->start == NULL) {
+                goto failed;
+            }
+
+            b->pos = b->start;
+            b->last = ngx_cpymem(b->start, cl->buf->pos, size);
+            b->end = b->last;
+            b->temporary = 1;
+
+        } else {
+            /* the temporary file of a large body is taken over and sent
+             * with sendfile, never read in the worker */
+            if (!(ngx_io.flags & NGX_IO_SENDFILE)) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                              "summarizer job: a request body in a file "
+                              "needs sendfile");
+                goto failed;
+            }
+
+            if (file == NULL || from != cl->buf->file) {
+                from = cl->buf->file;
+
+                file = ngx_http_summarizer_job_file(job, from);
+                if (file == NULL) {
+                    goto failed;
+                }
+            }
+
+            b->in_file = 1;
+            b->file = file;
+            b->file_pos = cl->buf->file_pos;
+            b->file_last = cl->buf->file_last;
+        }
+
+        *ll = ngx_alloc_chain_link(pool);
+        if (*ll == NULL) {
+            goto failed;
+        }
+
+        (*ll)->buf = b;
+        ll = &(*ll)->next;
+    }
+
+    *ll = NULL;
+
+    job->header = ngx_create_temp_buf(pool, slcf->upstream.buffer_size);
+    if (job->header == NULL) {
+        goto failed;
+    }
+
+    if (ngx_http_summarizer_job_peers(job, slcf->upstream.upstream)
+        != NGX_OK)
+    {
+        goto failed;
+    }
+
+    ngx_http_summarizer_job_connect(job);
+
+    return NGX_OK;
+
+failed:
+
+    ngx_destroy_pool(pool);
+
+    return NGX_ERROR;
+}
+
+/* a file of the request body on a descriptor of the job's own, as the
+ * client request closes its one when it ends; an unlinked temporary file
+ * lives on until then */
+static ngx_file_t *
+ngx_http_summarizer_job_file(ngx_http_summarizer_job_t *job,
+    ngx_file_t *from)
+{
+    ngx_file_t                         *file;
+    ngx_pool_cleanup_t                 *cln;
+    ngx_pool_cleanup_file_t            *clnf;
+
+    file = ngx_pcalloc(job->pool, sizeof(ngx_file_t));
+    cln = ngx_pool_cleanup_add(job->pool, sizeof(ngx_pool_cleanup_file_t));
+
+    if (file == NULL || cln == NULL) {
+        return NULL;
+    }
+
+    file->name.len = from->name.len;
+    file->name.data = ngx_pnalloc(job->pool, from->name.len + 1);
+    if (file->name.data == NULL) {
+        return NULL;
+    }
+
+    ngx_cpystrn(file->name.data, from->name.data, from->name.len + 1);
+
+    file->fd = dup(from->fd);
+    if (file->fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, &job->log, ngx_errno,
+                      "dup() \"%V\" failed", &from->name);
+        return NULL;
+    }
+
+    file->log = &job->log;
+
+    clnf = cln->data;
+    clnf->fd = file->fd;
+    clnf->name = file->name.data;
+    clnf->log = &job->log;
+
+    cln->handler = ngx_pool_cleanup_file;
+
+    return file;
+}
+
+/* the daemon request of a job: the header, then the document; it has no
+ * deadline, as the client does not wait for it */
+static ngx_int_t
+ngx_http_summarizer_job_request(ngx_http_request_t *r,
+    ngx_http_summarizer_loc_conf_t *slcf, ngx_http_summarizer_ctx_t *ctx,
+    ngx_chain_t **out)
+{
+    smrzr_input_t                       input;
+    smrzr_input_t                      *args;
+    ngx_chain_t                        *cl;
+    ngx_chain_t                        *doc = NULL;
+    ngx_chain_t                        *zdoc = NULL;
+    ngx_buf_t                          *b;
+    off_t                               doc_len = 0;
+
+    ngx_memzero(&input, sizeof(smrzr_input_t));
+
+    if (r->request_body && r->request_body->bufs) {
+        doc = r->request_body->bufs;
+
+        for (cl = doc; cl; cl = cl->next) {
+            doc_len += ngx_buf_size(cl->buf);
+        }
+
+        if (doc_len > (off_t) NGX_MAX_UINT32_VALUE) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "Summarizer inline document is too large: %O",
+                          doc_len);
+            return NGX_ERROR;
+        }
+
+        input.flags |= SMRZR_REQ_INLINE_DOC;
+        input.doc_len = (uint32_t) doc_len;
+
+        /* a body in a file is declined, and goes as it is */
+        if (slcf->deflate) {
+            switch (ngx_http_summarizer_deflate(r, doc, (size_t) doc_len,
+                                                &zdoc))
+            {
+            case NGX_OK:
+                input.flags |= SMRZR_REQ_DOC_DEFLATE;
+                input.doc_raw_len = input.doc_len;
+                input.doc_len = (uint32_t) (zdoc->buf->last
+                                            - zdoc->buf->pos);
+                doc = zdoc;
+                break;
+
+            case NGX_DECLINED:
+                break;
+
+            default:
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    args = ngx_http_summarizer_args(r, ctx);
+    if (args == NULL) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "Summarizer query args parse error");
+        return NGX_ERROR;
+    }
+
+    input.file_name = args->file_name;
+    input.ratio = args->ratio;
+
+    if (ctx->prioritized) {
+        input.flags |= SMRZR_REQ_PRIORITY;
+        input.priority = (uint32_t) ctx->priority;
+    }
+
+    if (smrzr_create_summary_request(r->pool, &input, &b) == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "Summarizer upstream search req creation failed");
+        return NGX_ERROR;
+    }
+
+    cl = ngx_alloc_chain_link(r->pool);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    cl->buf = b;
+    cl->next = doc;
+
+    *out = cl;
+
+    return NGX_OK;
+}
+
+/* each daemon tried gets the request from its start */
+static ngx_int_t
+ngx_http_summarizer_job_rewind(ngx_http_summarizer_job_t *job)
+{
+    ngx_chain_t                        *cl, **ll;
+    ngx_buf_t                          *b;
+
+    ll = &job->out;
+
+    for (cl = job->request; cl; cl = cl->next) {
+        b = ngx_alloc_buf(job->pool);
+        if (b == NULL) {
+            return NGX_ERROR;
+        }
+
+        *b = *cl->buf;
+
+        *ll = ngx_alloc_chain_link(job->pool);
+        if (*ll == NULL) {
+            return NGX_ERROR;
+        }
+
+        (*ll)->buf = b;
+        ll = &(*ll)->next;
+    }
+
+    *ll = NULL;
+
+    return NGX_OK;
+}
+
+/* the daemons of the pool that are not down, tried in turn from the next
+ * one of this worker; its balancer and circuit breaker do not apply */
+static ngx_int_t
+ngx_http_summarizer_job_peers(ngx_http_summarizer_job_t *job,
+    ngx_http_upstream_srv_conf_t *us)
+{
+#if (nginx_version >= 1009000)
+    static ngx_uint_t                   next;
+    ngx_http_upstream_rr_peers_t       *peers;
+    ngx_http_upstream_rr_peer_t        *peer;
+    ngx_addr_t                         *addr;
+    ngx_uint_t                          n;
+
+    peers = us->peer.data;
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+
+    job->addrs = ngx_palloc(job->pool, peers->number * sizeof(ngx_addr_t));
+    if (job->addrs == NULL) {
+        ngx_http_upstream_rr_peers_unlock(peers);
+        return NGX_ERROR;
+    }
+
+    n = 0;
+
+    /* copied, the peers of a zone may change under the job */
+    for (peer = peers->peer; peer; peer = peer->next) {
+        if (peer->down) {
+            continue;
+        }
+
+        addr = &job->addrs[n];
+
+        addr->sockaddr = ngx_palloc(job->pool, peer->socklen);
+        addr->name.data = ngx_pnalloc(job->pool, peer->name.len);
+
+        if (addr->sockaddr == NULL || addr->name.data == NULL) {
+            ngx_http_upstream_rr_peers_unlock(peers);
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(addr->sockaddr, peer->sockaddr, peer->socklen);
+        addr->socklen = peer->socklen;
+
+        ngx_memcpy(addr->name.data, peer->name.data, peer->name.len);
+        addr->name.len = peer->name.len;
+
+        n++;
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    job->naddrs = n;
+    job->first = n ? next++ % n : 0;
+
+    return NGX_OK;
+
+#else
+
+    /* summarizer_jobs is rejected */
+    return NGX_ERROR;
+
+#endif
+}
+
+static void
+ngx_http_summarizer_job_connect(ngx_http_summarizer_job_t *job)
+{
+    ngx_connection_t                   *c;
+    ngx_addr_t                         *addr;
+    ngx_int_t                           rc;
+
+    for ( ;; ) {
+
+        if (job->tries == job->naddrs) {
+            ngx_log_error(NGX_LOG_ERR, &job->log, 0,
+                          "summarizer job %*s: no live daemons",
+                          (size_t) SMRZR_JOB_ID_LEN, job->id);
+            ngx_http_summarizer_job_finalize(job, NGX_HTTP_BAD_GATEWAY);
+            return;
+        }
+
+        addr = &job->addrs[(job->first + job->tries++) % job->naddrs];
+
+        ngx_memzero(&job->peer, sizeof(ngx_peer_connection_t));
+
+        job->peer.sockaddr = addr->sockaddr;
+        job->peer.socklen = addr->socklen;
+        job->peer.name = &addr->name;
+        job->peer.get = ngx_event_get_peer;
+        job->peer.log = &job->log;
+        job->peer.log_error = NGX_ERROR_ERR;
+
+        rc = ngx_event_connect_peer(&job->peer);
+
+        if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+            continue;
+        }
+
+        c = job->peer.connection;
+
+        c->data = job;
+        c->pool = job->pool;
+
+        c->read->handler = ngx_http_summarizer_job_read_handler;
+        c->write->handler = ngx_http_summarizer_job_write_handler;
+
+        if (ngx_http_summarizer_job_rewind(job) != NGX_OK) {
+            ngx_http_summarizer_job_finalize(job,
+                                             NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+        }
+
+        job->header->pos = job->header->start;
+        job->header->last = job->header->start;
+        job->summary.data = NULL;
+        job->summary.len = 0;
+
+        if (rc == NGX_AGAIN) {
+            ngx_add_timer(c->write, job->connect_timeout);
+            return;
+        }
+
+        ngx_http_summarizer_job_send(job);
+        return;
+    }
+}
+
+/* this daemon failed the job, the next one gets it */
+static void
+ngx_http_summarizer_job_next(ngx_http_summarizer_job_t *job)
+{
+    ngx_close_connection(job->peer.connection);
+    job->peer.connection = NULL;
+
+    ngx_http_summarizer_job_connect(job);
+}
+
+static void
+ngx_http_summarizer_job_write_handler(ngx_event_t *wev)
+{
+    ngx_connection_t                   *c = wev->data;
+    ngx_http_summarizer_job_t          *job = c->data;
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, wev->log, NGX_ETIMEDOUT,
+                      "summarizer job %*s: daemon %V timed out",
+                      (size_t) SMRZR_JOB_ID_LEN, job->id, job->peer.name);
+        ngx_http_summarizer_job_next(job);
+        return;
+    }
+
+    ngx_http_summarizer_job_send(job);
+}
+
+static void
+ngx_http_summarizer_job_send(ngx_http_summarizer_job_t *job)
+{
+    ngx_connection_t                   *c = job->peer.connection;
+    ngx_chain_t                        *cl;
+
+    cl = c->send_chain(c, job->out, 0);
+
+    if (cl == NGX_CHAIN_ERROR) {
+        ngx_http_summarizer_job_next(job);
+        return;
+    }
+
+    job->out = cl;
+
+    if (cl) {
+        ngx_add_timer(c->write, job->send_timeout);
+
+        if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+            ngx_http_summarizer_job_finalize(job,
+                                             NGX_HTTP_INTERNAL_SERVER_ERROR);
+        }
+
+        return;
+    }
+
+    /* all sent, the reply is next */
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    c->write->handler = ngx_http_empty_handler;
+
+    ngx_http_summarizer_job_recv(job);
+}
+
+static void
+ngx_http_summarizer_job_read_handler(ngx_event_t *rev)
+{
+    ngx_connection_t                   *c = rev->data;
+    ngx_http_summarizer_job_t          *job = c->data;
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, rev->log, NGX_ETIMEDOUT,
+                      "summarizer job %*s: daemon %V timed out",
+                      (size_t) SMRZR_JOB_ID_LEN, job->id, job->peer.name);
+        ngx_http_summarizer_job_next(job);
+        return;
+    }
+
+    ngx_http_summarizer_job_recv(job);
+}
+
+/* the reply header into the buffer, then the summary after it */
+static void
+ngx_http_summarizer_job_recv(ngx_http_summarizer_job_t *job)
+{
+    ngx_connection_t                   *c = job->peer.connection;
+    ngx_buf_t                          *b = job->header;
+    ssize_t                             n;
+
+    for ( ;; ) {
+
+        if (job->summary.data) {
+            if (job->summary.len == job->summary_len) {
+                ngx_http_summarizer_job_finalize(job, NGX_HTTP_OK);
+                return;
+            }
+
+            n = c->recv(c, job->summary.data + job->summary.len,
+                        job->summary_len - job->summary.len);
+
+        } else {
+            if (b->last == b->end) {
+                ngx_log_error(NGX_LOG_ERR, &job->log, 0,
+                              "summarizer job %*s: daemon %V sent "
+                              "too big header", (size_t) SMRZR_JOB_ID_LEN,
+                              job->id, job->peer.name);
+                ngx_http_summarizer_job_finalize(job, NGX_HTTP_BAD_GATEWAY);
+                return;
+            }
+
+            n = c->recv(c, b->last, b->end - b->last);
+        }
+
+        if (n == NGX_AGAIN) {
+            ngx_add_timer(c->read, job->read_timeout);
+
+            if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+                ngx_http_summarizer_job_finalize(job,
+                                             NGX_HTTP_INTERNAL_SERVER_ERROR);
+            }
+
+            return;
+        }
+
+        if (n == 0) {
+            ngx_log_error(NGX_LOG_ERR, &job->log, 0,
+                          "summarizer job %*s: daemon %V closed "
+                          "the connection prematurely",
+                          (size_t) SMRZR_JOB_ID_LEN, job->id,
+                          job->peer.name);
+        }
+
+        if (n == 0 || n == NGX_ERROR) {
+            ngx_http_summarizer_job_next(job);
+            return;
+        }
+
+        if (job->summary.data) {
+            job->summary.len += n;
+            continue;
+        }
+
+        b->last += n;
+
+        if (ngx_http_summarizer_job_header(job) == NGX_DONE) {
+            return;
+        }
+    }
+}
+
+/* NGX_AGAIN for more of the header, NGX_OK when the summary follows, and
+ * NGX_DONE once the job is finalized */
+static ngx_int_t
+ngx_http_summarizer_job_header(ngx_http_summarizer_job_t *job)
+{
+    ngx_buf_t                          *b = job->header;
+    smrzr_summary_header_t              hdr;
+    ngx_int_t                           rc;
+    size_t                              n;
+
+    rc = smrzr_parse_summary_response_header(job->pool, b, &hdr);
+
+    if (rc == NGX_AGAIN) {
+        return NGX_AGAIN;
+    }
+
+    /* nothing a job does not ask for */
+    if (rc != NGX_OK
+        || (hdr.flags & (SMRZR_RESP_DEFLATE|SMRZR_RESP_STATE))
+        || hdr.status == SMRZR_STATUS_SUMMARY_SHM)
+    {
+        ngx_log_error(NGX_LOG_ERR, &job->log, 0,
+                      "summarizer job %*s: daemon %V sent invalid header",
+                      (size_t) SMRZR_JOB_ID_LEN, job->id, job->peer.name);
+        ngx_http_summarizer_job_finalize(job, NGX_HTTP_BAD_GATEWAY);
+        return NGX_DONE;
+    }
+
+    switch (hdr.status) {
+
+    case SMRZR_STATUS_SUMMARY:
+    case SMRZR_STATUS_PARTIAL:
+        break;
+
+    case SMRZR_STATUS_INVALID_REQ:
+        ngx_http_summarizer_job_finalize(job, NGX_HTTP_BAD_REQUEST);
+        return NGX_DONE;
+
+    case SMRZR_STATUS_OVERLOADED:
+        ngx_http_summarizer_job_finalize(job, NGX_HTTP_SERVICE_UNAVAILABLE);
+        return NGX_DONE;
+
+    default:
+        ngx_http_summarizer_job_finalize(job, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return NGX_DONE;
+    }
+
+    job->summary_len = hdr.summary_len;
+
+    job->summary.data = ngx_pnalloc(job->pool, job->summary_len);
+    if (job->summary.data == NULL) {
+        ngx_http_summarizer_job_finalize(job, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return NGX_DONE;
+    }
+
+    /* the start of the summary came with the header */
+    n = ngx_min((size_t) (b->last - b->pos), job->summary_len);
+
+    ngx_memcpy(job->summary.data, b->pos, n);
+    job->summary.len = n;
+
+    return NGX_OK;
+}
+
+/* the summary, or the failure, of a job goes to the zone */
+static void
+ngx_http_summarizer_job_finalize(ngx_http_summarizer_job_t *job,
+    ngx_uint_t status)
+{
+    if (status == NGX_HTTP_OK) {
+        smrzr_job_finish(job->zone, job->id, status, &job->summary,
+                         job->valid, &job->log);
+
+    } else {
+        ngx_log_error(NGX_LOG_WARN, &job->log, 0,
+                      "summarizer job %*s failed: %ui",
+                      (size_t) SMRZR_JOB_ID_LEN, job->id, status);
+
+        smrzr_job_finish(job->zone, job->id, status, NULL,
+                         job->valid, &job->log);
+    }
+
+    if (job->peer.connection) {
+        ngx_close_connection(job->peer.connection);
+    }
+
+    ngx_destroy_pool(job->pool);
+}
+
+/* the summary an in-memory subrequest came back with; NGX_DECLINED if
+ * it failed; summarizer_filter uses it too */
+ngx_int_t
+ngx_http_summarizer_subrequest_summary(ngx_http_request_t *sr,
+    ngx_str_t *value)
+{
+    ngx_http_summarizer_ctx_t          *sctx;
+
+    sctx = ngx_http_get_module_ctx(sr, ngx_http_summarizer_module);
+
+    if (sctx && sctx->done) {
+        *value = sctx->out;
+        return NGX_OK;
+    }
+
+#if (nginx_version >= 1013010)
+    /* summarizer_index, the cache, summarizer_lead, or another module */
+    if (sr->headers_out.status == NGX_HTTP_OK && sr->out && sr->out->buf) {
+        value->data = sr->out->buf->pos;
+        value->len = sr->out->buf->last - sr->out->buf->pos;
+        return NGX_OK;
+    }
+#endif
+
+    return NGX_DECLINED;
+}
+
+/* issue the summarizer_set subrequests of the location all at once, and
+ * go on once all of them are done */
+static ngx_int_t
+ngx_http_summarizer_set_handler(ngx_http_request_t *r)
+{
+    ngx_http_summarizer_loc_conf_t     *slcf;
+    ngx_http_summarizer_ctx_t          *ctx, *pctx;
+    ngx_http_summarizer_set_t          *set;
+    ngx_http_summarizer_set_req_t      *sreq;
+    ngx_http_post_subrequest_t         *ps;
+    ngx_http_request_t                 *sr;
+    ngx_str_t                           uri, args;
+    ngx_uint_t                          i, flags;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_summarizer_module);
+
+    if (slcf->sets == NULL) {
+        return NGX_DECLINED;
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_summarizer_module);
+
+    if (ctx) {
+        return (ctx->sets && ctx->pending) ? NGX_AGAIN : NGX_DECLINED;
+    }
+
+    /* not again in our own subrequests */
+    if (r != r->main) {
+        pctx = ngx_http_get_module_ctx(r->parent, ngx_http_summarizer_module);
+
+        if (pctx && pctx->sets) {
+            return NGX_DECLINED;
+        }
+    }
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_summarizer_ctx_t));
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->request = r;
+    ctx->sets = 1;
+
+    ngx_http_set_ctx(r, ctx, ngx_http_summarizer_module);
+
+    set = slcf->sets->elts;
+
+    for (i = 0; i < slcf->sets->nelts; i++) {
+
+        if (ngx_http_complex_value(r, &set[i].uri, &uri) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ngx_str_null(&args);
+        flags = NGX_HTTP_LOG_UNSAFE;
+
+        if (ngx_http_parse_unsafe_uri(r, &uri, &args, &flags) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        sreq = ngx_pcalloc(r->pool, sizeof(ngx_http_summarizer_set_req_t));
+        ps = ngx_palloc(r->pool, sizeof(ngx_http_post_subrequest_t));
+
+        if (sreq == NULL || ps == NULL) {
+            return NGX_ERROR;
+        }
+
+        sreq->ctx = ctx;
+        sreq->index = set[i].index;
+
+        ps->handler = ngx_http_summarizer_set_done;
+        ps->data = sreq;
+
+        if (ngx_http_subrequest(r, &uri, &args, &sr, ps,
+                                NGX_HTTP_SUBREQUEST_IN_MEMORY
+                                |NGX_HTTP_SUBREQUEST_WAITED)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        ctx->pending++;
+    }
+
+    return NGX_AGAIN;
+}
+
+/* the summary of a summarizer_set subrequest goes to its variable */
+static ngx_int_t
+ngx_http_summarizer_set_done(ngx_http_request_t *sr, void *data,
+    ngx_int_t rc)
+{
+    ngx_http_summarizer_set_req_t      *sreq = data;
+    ngx_http_variable_value_t          *vv;
+    ngx_str_t                           value;
+
+    if (sreq->finished) {
+        return rc;
+    }
+
+    sreq->finished = 1;
+    sreq->ctx->pending--;
+
+    if (ngx_http_summarizer_subrequest_summary(sr, &value) != NGX_OK) {
+        ngx_log_error(NGX_LOG_WARN, sr->connection->log, 0,
+                      "summarizer_set subrequest \"%V?%V\" failed: %i",
+                      &sr->uri, &sr->args, rc);
+        return rc;
+    }
+
+    /* subrequests share the variables of the main request */
+    vv = &sr->variables[sreq->index];
+
+    vv->len = value.len;
+    vv->data = value.data;
+    vv->valid = 1;
+    vv->no_cacheable = 0;
+    vv->not_found = 0;
+
+    return rc;
+}
+
+/* a summarizer_set variable before (or without) its summary */
+static ngx_int_t
+ngx_http_summarizer_set_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    v->not_found = 1;
+
+    return NGX_OK;
+}
+
+/* stat the document through open_file_cache; the daemon reads the same
+ * file. path gets the null terminated name. */
+static ngx_int_t
+ngx_http_summarizer_file_info(ngx_http_request_t *r, ngx_str_t *name,
+    ngx_str_t *path, ngx_open_file_info_t *of)
+{
+    ngx_http_core_loc_conf_t           *clcf;
+
+    if (name->len == 0) {
+        return NGX_DECLINED;
+    }
+
+    path->len = name->len;
+    path->data = ngx_pnalloc(r->pool, path->len + 1);
+    if (path->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(path->data, name->data, path->len);
+    path->data[path->len] = '\0';
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    ngx_memzero(of, sizeof(ngx_open_file_info_t));
+
+    of->directio = NGX_MAX_OFF_T_VALUE;
+    of->valid = clcf->open_file_cache_valid;
+    of->min_uses = clcf->open_file_cache_min_uses;
+    of->errors = clcf->open_file_cache_errors;
+    of->events = clcf->open_file_cache_events;
+    of->test_only = 1;
+
+    if (ngx_open_cached_file(clcf->open_file_cache, path, of, r->pool)
+        != NGX_OK || !of->is_file)
+    {
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+/* charge the document to the client's budget before the daemon sees it */
+static void
+ngx_http_summarizer_limit_request(ngx_http_request_t *r)
+{
+    ngx_http_summarizer_loc_conf_t     *slcf;
+    ngx_http_summarizer_ctx_t          *ctx;
+    smrzr_limit_zone_t                 *zone;
+    ngx_pool_cleanup_t                 *cln;
+    ngx_str_t                           key;
+    uint64_t                            cost;
+    ngx_msec_t                          delay;
+    ngx_int_t                           rc;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_summarizer_module);
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_summarizer_module);
+
+    if (slcf->limit_zone == NULL || r != r->main) {
+        ngx_http_summarizer_start(r);
+        return;
+    }
+
+    zone = smrzr_limit_zone_get(slcf->limit_zone);
+
+    if (ngx_http_complex_value(r, &zone->key, &key) != NGX_OK) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    if (key.len == 0) {
+        ngx_http_summarizer_start(r);
+        return;
+    }
+
+    if (key.len > 65535) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "the value of the \"%V\" key "
+                      "is more than 65535 bytes: \"%V\"",
+                      &zone->key.value, &key);
+        ngx_http_summarizer_start(r);
+        return;
+    }
+
+    if (0 == (cost = ngx_http_summarizer_limit_cost(r, ctx))) {
+        /* charged with the size reported by the daemon */
+        ctx->limit_key = key;
+    }
+
+    rc = smrzr_limit_account(zone, &key, ctx->priority, cost,
+                             slcf->limit_burst, &delay, r->connection->log);
+
+    if (rc == NGX_BUSY) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "limiting summaries, document bytes of \"%V\" "
+                      "over burst by zone \"%V\"",
+                      &key, &slcf->limit_zone->shm.name);
+    }
+
+    if (rc != NGX_OK) {
+        ngx_http_finalize_request(r, NGX_HTTP_SERVICE_UNAVAILABLE);
+        return;
+    }
+
+    /* a job is charged for its client, but never waits */
+    if (slcf->limit_nodelay || ctx->job) {
+        ngx_http_summarizer_start(r);
+        return;
+    }
+
+    if (delay == 0) {
+        /* more urgent documents of other keys go first */
+        if (smrzr_limit_ahead(zone, ctx->priority) == 0) {
+            ngx_http_summarizer_start(r);
+            return;
+        }
+
+        delay = SMRZR_LIMIT_RECHECK;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    cln->handler = ngx_http_summarizer_limit_cleanup;
+    cln->data = ctx;
+
+    /* a document of unknown size still counts */
+    ctx->limit_delayed = ngx_max(cost, 1);
+
+    smrzr_limit_wait(zone, ctx->priority, ctx->limit_delayed, 1);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "summarizer limit delay: %M ms for %uL bytes",
+                   delay, cost);
+
+    r->read_event_handler = ngx_http_test_reading;
+    r->write_event_handler = ngx_http_summarizer_limit_delay;
+
+    r->connection->write->delayed = 1;
+    ngx_add_timer(r->connection->write, delay);
+}
+
+static void
+ngx_http_summarizer_limit_delay(ngx_http_request_t *r)
+{
+    ngx_http_summarizer_loc_conf_t     *slcf;
+    ngx_http_summarizer_ctx_t          *ctx;
+    ngx_event_t                        *wev;
+    smrzr_limit_zone_t                 *zone;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "summarizer limit delay");
+
+    wev = r->connection->write;
+
+    if (wev->delayed) {
+
+        if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+            ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        }
+
+        return;
+    }
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_summarizer_module);
+    ctx = ngx_http_get_module_ctx(r, ngx_http_summarizer_module);
+
+    /* the delay was computed on arrival: hold back again while more
+     * urgent documents have come in and wait */
+    zone = smrzr_limit_zone_get(slcf->limit_zone);
+
+    if (smrzr_limit_ahead(zone, ctx->priority)) {
+        wev->delayed = 1;
+        ngx_add_timer(wev, SMRZR_LIMIT_RECHECK);
+        return;
+    }
+
+    ngx_http_summarizer_limit_cleanup(ctx);
+
+    if (ngx_handle_read_event(r->connection->read, 0) != NGX_OK) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    r->read_event_handler = ngx_http_block_reading;
+
+    ngx_http_summarizer_start(r);
+}
+
+/* a delayed request no longer holds back less urgent ones */
+static void
+ngx_http_summarizer_limit_cleanup(void *data)
+{
+    ngx_http_summarizer_ctx_t          *ctx = data;
+    ngx_http_summarizer_loc_conf_t     *slcf;
+
+    if (ctx->limit_delayed == 0) {
+        return;
+    }
+
+    slcf = ngx_http_get_module_loc_conf(ctx->request,
+                                        ngx_http_summarizer_module);
+
+    smrzr_limit_wait(smrzr_limit_zone_get(slcf->limit_zone), ctx->priority,
+                     ctx->limit_delayed, 0);
+
+    ctx->limit_delayed = 0;
+}
+
+/* summarize in one go, or split the document across the daemons */
+static void
+ngx_http_summarizer_start(ngx_http_request_t *r)
+{
+    ngx_http_summarizer_loc_conf_t     *slcf;
+    ngx_http_summarizer_ctx_t          *ctx;
+    uint32_t                            deadline;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_summarizer_module);
+
+    if (ctx->job) {
+        ngx_http_summarizer_job_start(r);
+        return;
+    }
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_summarizer_module);
+
+    /* spent before a daemon is asked, e.g. waiting in summarizer_limit */
+    if (slcf->deadline) {
+        switch (ngx_http_summarizer_deadline(r, slcf, &deadline)) {
+
+        case NGX_BUSY:
+            ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                          "summarizer deadline passed before the request "
+                          "was sent");
+            ngx_http_finalize_request(r, NGX_HTTP_GATEWAY_TIME_OUT);
+            return;
+
+        case NGX_ERROR:
+            ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+        }
+    }
+
+    switch (ngx_http_summarizer_map(r)) {
+
+    case NGX_DECLINED:
+        break;
+
+    case NGX_OK:
+        /* ranges are out, ngx_http_summarizer_reduce() follows */
+        return;
+
+    default:
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+#if (NGX_HTTP_SUMMARIZER_CACHE)
+    switch (ngx_http_summarizer_fingerprint(r)) {
+
+    case NGX_AGAIN:
+        /* hashing in a thread, ngx_http_summarizer_fingerprint_event()
+         * follows */
+        return;
+
+    case NGX_ERROR:
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+#endif
+
+    ngx_http_upstream_init(r);
+}
+
+#if (NGX_HTTP_SUMMARIZER_CACHE)
+
+/* key the cache by the contents of the document rather than its name, so
+ * copies share one summary. A file version is hashed only once. */
+static ngx_int_t
+ngx_http_summarizer_fingerprint(ngx_http_request_t *r)
+{
+    ngx_http_summarizer_loc_conf_t     *slcf;
+    ngx_http_summarizer_ctx_t          *ctx;
+    smrzr_fp_file_t                    *file;
+    ngx_open_file_info_t               *of;
+    ngx_chain_t                        *cl;
+    u_char                              fp[SMRZR_FP_LEN];
+#if (NGX_THREADS)
+    ngx_thread_pool_t                  *tp;
+    ngx_thread_task_t                  *task;
+    ngx_int_t                           rc;
+#endif
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_summarizer_module);
+    ctx = ngx_http_get_module_ctx(r, ngx_http_summarizer_module);
+
+    if (slcf->dedup == NULL || !r->upstream->conf->cache || ctx->range) {
+        return NGX_DECLINED;
+    }
+
+    if (r->request_body && r->request_body->bufs) {
+
+        for (cl = r->request_body->bufs; cl; cl = cl->next) {
+            if (!ngx_buf_in_memory(cl->buf)) {
+                /* not worth reading back; without a key it can't be cached */
+                r->upstream->conf = slcf->nocache_upstream;
+                return NGX_DECLINED;
+            }
+        }
+
+        smrzr_fp_chain(r->request_body->bufs, fp);
+
+        return ngx_http_summarizer_fingerprint_set(r, fp);
+    }
+
+    of = ngx_http_summarizer_doc_info(r, ctx);
+    if (of == NULL) {
+        /* the daemon reports it */
+        return NGX_DECLINED;
+    }
+
+    file = ngx_pcalloc(r->pool, sizeof(smrzr_fp_file_t));
+    if (file == NULL) {
+        return NGX_ERROR;
+    }
+
+    file->path = ctx->doc_path.data;
+    file->uniq = of->uniq;
+    file->name_hash = ngx_crc32_short(ctx->doc_path.data, ctx->doc_path.len);
+    file->mtime = of->mtime;
+    file->size = of->size;
+
+    if (smrzr_fp_lookup(slcf->dedup, file) == NGX_OK) {
+        return ngx_http_summarizer_fingerprint_set(r, file->fp);
+    }
+
+#if (NGX_THREADS)
+    rc = ngx_http_summarizer_thread_pool(r, &tp);
+
+    if (rc == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (rc == NGX_OK) {
+        file->buf_size = (size_t) ngx_min((off_t) SMRZR_FP_BUF_SIZE,
+                                          ngx_max(of->size, 1));
+        file->buf = ngx_pnalloc(r->pool, file->buf_size);
+        if (file->buf == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "summarizer fingerprint \"%s\": %O bytes",
+                       file->path, file->size);
+
+        task = ngx_thread_task_alloc(r->pool, 0);
+        if (task == NULL) {
+            return NGX_ERROR;
+        }
+
+        task->ctx = file;
+        task->handler = ngx_http_summarizer_fingerprint_thread;
+        task->event.handler = ngx_http_summarizer_fingerprint_event;
+        task->event.data = r;
+
+        if (ngx_thread_task_post(tp, task) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        r->main->blocked++;
+        r->aio = 1;
+
+        return NGX_AGAIN;
+    }
+#endif
+
+    /* hashing a whole file here would block the worker: keyed by file
+     * name as without summarizer_dedup */
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "summarizer fingerprint \"%s\": no thread pool",
+                   file->path);
+
+    return NGX_DECLINED;
+}
+
+static ngx_int_t
+ngx_http_summarizer_fingerprint_set(ngx_http_request_t *r, u_char *fp)
+{
+    ngx_http_summarizer_ctx_t          *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_summarizer_module);
+
+    ctx->fingerprint.data = ngx_pnalloc(r->pool, 2 * SMRZR_FP_LEN);
+    if (ctx->fingerprint.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->fingerprint.len = ngx_hex_dump(ctx->fingerprint.data, fp,
+                                        SMRZR_FP_LEN)
+                           - ctx->fingerprint.data;
+
+    return NGX_OK;
+}
+
+/* a hot cached summary close to expiry, or one of a file changed since it
+ * was cached, is summarized again in a background subrequest; the cached
+ * copy is served meanwhile */
+static void
+ngx_http_summarizer_refresh_ahead(ngx_http_request_t *r)
+{
+    ngx_http_summarizer_loc_conf_t     *slcf;
+    ngx_http_summarizer_ctx_t          *ctx, *rctx;
+    ngx_http_summarizer_refresh_t      *ref;
+    ngx_pool_cleanup_t                 *cln;
+    ngx_http_post_subrequest_t         *ps;
+    ngx_http_request_t                 *sr;
+    ngx_http_cache_t                   *c;
+    ngx_open_file_info_t               *of;
+    time_t                              now;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_summarizer_module);
+
+    c = r->cache;
+
+    if (slcf->refresh_ahead == 0 || r != r->main || c->node == NULL
+        || r->upstream->cache_status != NGX_HTTP_CACHE_HIT)
+    {
+        return;
+    }
+
+    now = ngx_time();
+
+    if (c->node->uses < slcf->refresh_min_uses
+        || (c->valid_sec - now) * 100
+           > (c->valid_sec - c->date) * (time_t) slcf->refresh_ahead)
+    {
+        /* keyed by contents, a changed file is a miss anyway */
+        if (slcf->dedup || (r->request_body && r->request_body->bufs)) {
+            return;
+        }
+
+        ctx = ngx_http_get_module_ctx(r, ngx_http_summarizer_module);
+        of = ngx_http_summarizer_doc_info(r, ctx);
+
+        if (of == NULL || of->mtime < c->date) {
+            return;
+        }
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_summarizer_refresh_t));
+    rctx = ngx_pcalloc(r->pool, sizeof(ngx_http_summarizer_ctx_t));
+    ps = ngx_palloc(r->pool, sizeof(ngx_http_post_subrequest_t));
+
+    if (cln == NULL || rctx == NULL || ps == NULL) {
+        return;
+    }
+
+    /* released when the refresh is done, or with the main request if it
+     * never is */
+    ref = cln->data;
+    ref->node = NULL;
+
+    /* one refresh at a time, as for an expired entry being updated; the
+     * main request lets go of the node when its upstream is finalized,
+     * so the refresh holds it too */
+    ngx_shmtx_lock(&c->file_cache->shpool->mutex);
+
+    if (c->node->updating) {
+        ngx_shmtx_unlock(&c->file_cache->shpool->mutex);
+        return;
+    }
+
+    c->node->updating = 1;
+    c->node->count++;
+
+    ngx_shmtx_unlock(&c->file_cache->shpool->mutex);
+
+    ref->cache = c->file_cache;
+    ref->node = c->node;
+
+    cln->handler = ngx_http_summarizer_refresh_release;
+
+    rctx->refresh = 1;
+
+    ps->handler = ngx_http_summarizer_refresh_done;
+    ps->data = ref;
+
+    if (ngx_http_subrequest(r, &r->uri, &r->args, &sr, ps,
+                            SMRZR_SUBREQUEST_BACKGROUND)
+        != NGX_OK)
+    {
+        goto failed;
+    }
+
+    /* the summary only goes to the cache */
+    sr->header_only = 1;
+
+    rctx->request = sr;
+
+    ngx_http_set_ctx(sr, rctx, ngx_http_summarizer_module);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "summarizer cache refresh ahead, expires in %T s",
+                   c->valid_sec - now);
+
+    return;
+
+failed:
+
+    ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                  "summarizer cache refresh ahead failed");
+
+    ngx_http_summarizer_refresh_release(ref);
+}
+
+static ngx_int_t
+ngx_http_summarizer_refresh_done(ngx_http_request_t *sr, void *data,
+    ngx_int_t rc)
+{
+    ngx_http_summarizer_refresh_t      *ref = data;
+
+    ngx_http_summarizer_refresh_release(ref);
+
+    if (sr->headers_out.status != NGX_HTTP_OK) {
+        ngx_log_error(NGX_LOG_INFO, sr->connection->log, 0,
+                      "summarizer cache refresh ahead of \"%V?%V\" "
+                      "failed: %ui, the cached copy is kept",
+                      &sr->uri, &sr->args, sr->headers_out.status);
+    }
+
+    return rc;
+}
+
+static void
+ngx_http_summarizer_refresh_release(void *data)
+{
+    ngx_http_summarizer_refresh_t      *ref = data;
+
+    if (ref->node == NULL) {
+        return;
+    }
+
+    ngx_shmtx_lock(&ref->cache->shpool->mutex);
+
+    ref->node->updating = 0;
+    ref->node->count--;
+
+    ngx_shmtx_unlock(&ref->cache->shpool->mutex);
+
+    ref->node = NULL;
+}
+
+#if (NGX_THREADS)
+
+static void
+ngx_http_summarizer_fingerprint_thread(void *data, ngx_log_t *log)
+{
+    smrzr_fp_read(data, log);
+}
+
+static void
+ngx_http_summarizer_fingerprint_event(ngx_event_t *ev)
+{
+    ngx_http_request_t                 *r = ev->data;
+    ngx_http_summarizer_loc_conf_t     *slcf;
+    ngx_thread_task_t                  *task;
+    ngx_connection_t                   *c;
+    smrzr_fp_file_t                    *file;
+
+    c = r->connection;
+    task = (ngx_thread_task_t *) ((u_char *) ev
+                                  - offsetof(ngx_thread_task_t, event));
+    file = task->ctx;
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    if (file->err == 0) {
+        slcf = ngx_http_get_module_loc_conf(r, ngx_http_summarizer_module);
+
+        smrzr_fp_store(slcf->dedup, file);
+
+        if (ngx_http_summarizer_fingerprint_set(r, file->fp) != NGX_OK) {
+            ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+            ngx_http_run_posted_requests(c);
+            return;
+        }
+    }
+
+    ngx_http_upstream_init(r);
+    ngx_http_run_posted_requests(c);
+}
+
+#endif
+
+#endif
+
+/* one in-memory subrequest per sentence aligned range of the file */
+static ngx_int_t
+ngx_http_summarizer_map(ngx_http_request_t *r)
+{
+    ngx_http_summarizer_loc_conf_t     *slcf;
+    ngx_http_summarizer_ctx_t          *ctx, *rctx, **ranges;
+    ngx_http_post_subrequest_t         *ps;
+    ngx_http_request_t                 *sr;
+    ngx_file_t                          file;
+    ngx_open_file_info_t               *of;
+    off_t                               size, offset, next;
+    ngx_uint_t                          i, n, parts;
+    u_char                             *buf;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_summarizer_module);
+
+    if (slcf->split_size == 0
+        || r != r->main
+        || !(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))
+        || (r->request_body && r->request_body->bufs))
+    {
+        return NGX_DECLINED;
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_summarizer_module);
+    of = ngx_http_summarizer_doc_info(r, ctx);
+
+    if (of == NULL || of->size <= slcf->split_size) {
+        return NGX_DECLINED;
+    }
+
+    size = of->size;
+
+    /* ranges are sent with 32 bit lengths */
+    parts = ngx_max(slcf->split_parts,
+                    (ngx_uint_t) (size / NGX_MAX_UINT32_VALUE) + 1);
+
+    ranges = ngx_palloc(r->pool, parts * sizeof(ngx_http_summarizer_ctx_t *));
+    buf = ngx_pnalloc(r->pool, SMRZR_SPLIT_WINDOW);
+
+    if (ranges == NULL || buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.fd = ngx_open_file(ctx->doc_path.data, NGX_FILE_RDONLY,
+                            NGX_FILE_OPEN, 0);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        return NGX_DECLINED;
+    }
+
+    file.name = ctx->doc_path;
+    file.log = r->connection->log;
+
+    offset = 0;
+
+    for (i = 0, n = 0; i < parts; i++) {
+
+        if (i + 1 == parts) {
+            next = size;
+
+        } else {
+            next = smrzr_lead_align(&file, size / parts * (i + 1), buf,
+                                    SMRZR_SPLIT_WINDOW);
+            next = ngx_min(next, size);
+        }
+
+        if (next <= offset) {
+            continue;
+        }
+
+        rctx = ngx_pcalloc(r->pool, sizeof(ngx_http_summarizer_ctx_t));
+        if (rctx == NULL) {
+            ngx_close_file(file.fd);
+            return NGX_ERROR;
+        }
+
+        /* the same arguments as the whole document */
+        rctx->args_parsed = 1;
+        rctx->args_rc = NGX_OK;
+        rctx->args = ctx->args;
+
+        rctx->range = 1;
+        rctx->range_offset = offset;
+        rctx->range_len = (uint32_t) (next - offset);
+
+        ranges[n++] = rctx;
+        offset = next;
+    }
+
+    ngx_close_file(file.fd);
+
+    if (n < 2) {
+        return NGX_DECLINED;
+    }
+
+    ps = ngx_palloc(r->pool, sizeof(ngx_http_post_subrequest_t));
+    if (ps == NULL) {
+        return NGX_ERROR;
+    }
+
+    ps->handler = ngx_http_summarizer_range_done;
+    ps->data = ctx;
+
+    ctx->ranges = ranges;
+    ctx->parts = n;
+    ctx->pending = n;
+
+#if (NGX_HTTP_SUMMARIZER_CACHE)
+    if (slcf->nocache_upstream) {
+        r->upstream->conf = slcf->nocache_upstream;
+    }
+#endif
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "summarizer split \"%V\": %O bytes in %ui ranges",
+                   &ctx->args.file_name, size, n);
+
+    for (i = 0; i < n; i++) {
+        if (ngx_http_subrequest(r, &r->uri, &r->args, &sr, ps,
+                                NGX_HTTP_SUBREQUEST_IN_MEMORY)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        ranges[i]->request = sr;
+
+        ngx_http_set_ctx(sr, ranges[i], ngx_http_summarizer_module);
+    }
+
+    r->write_event_handler = ngx_http_summarizer_reduce;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_summarizer_range_done(ngx_http_request_t *sr, void *data,
+    ngx_int_t rc)
+{
+    ngx_http_summarizer_ctx_t          *ctx = data;
+    ngx_uint_t                          i;
+
+    for (i = 0; i < ctx->parts; i++) {
+        if (ctx->ranges[i]->request != sr || ctx->ranges[i]->finished) {
+            continue;
+        }
+
+        ctx->ranges[i]->finished = 1;
+
+        if (!ctx->ranges[i]->done) {
+            ctx->failed = 1;
+        }
+
+        ctx->pending--;
+        break;
+    }
+
+    return rc;
+}
+
+/* rank the summaries of the ranges once all of them are in */
+static void
+ngx_http_summarizer_reduce(ngx_http_request_t *r)
+{
+    ngx_http_summarizer_ctx_t          *ctx;
+    ngx_chain_t                        *cl, **ll;
+    ngx_buf_t                          *b;
+    ngx_uint_t                          i;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_summarizer_module);
+
+    if (ctx->pending) {
+        return;
+    }
+
+    r->write_event_handler = ngx_http_request_empty_handler;
+
+    if (ctx->failed) {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                      "summarizer range failed, summarizing the whole "
+                      "document in one request");
+        ngx_http_upstream_init(r);
+        return;
+    }
+
+    ll = &ctx->doc;
+
+    for (i = 0; i < ctx->parts; i++) {
+        if (ctx->ranges[i]->out.len == 0) {
+            continue;
+        }
+
+        b = ngx_calloc_buf(r->pool);
+        cl = ngx_alloc_chain_link(r->pool);
+
+        if (b == NULL || cl == NULL) {
+            ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+        }
+
+        /* start and end let ngx_http_upstream_reinit() rewind it */
+        b->memory = 1;
+        b->start = ctx->ranges[i]->out.data;
+        b->end = b->start + ctx->ranges[i]->out.len;
+        b->pos = b->start;
+        b->last = b->end;
+
+        cl->buf = b;
+        *ll = cl;
+        ll = &cl->next;
+    }
+
+    *ll = NULL;
+
+    /* nothing to rank, e.g. a document without sentences */
+    ctx->merge = (ctx->doc != NULL);
+
+    ngx_http_upstream_init(r);
+}
+
+/* upstream handler to provide the callbacks */
+ngx_int_t
+ngx_http_summarizer_handler(ngx_http_request_t *r)
+{
+    ngx_int_t                           rc;
+    ngx_uint_t                          preset;
+    ngx_http_upstream_t                *u;
+    ngx_http_summarizer_ctx_t          *ctx;
+    ngx_http_summarizer_loc_conf_t     *slcf;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD|NGX_HTTP_POST))) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            "summarizer_handler: http method is not GET, HEAD or POST");
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    if (ngx_http_set_content_type(r) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            "summarizer_handler: failed in set_content_type");
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_summarizer_module);
+
+    /* a range of a split document comes with its context; the one of
+     * summarizer_set in this location does not count */
+    ctx = ngx_http_get_module_ctx(r, ngx_http_summarizer_module);
+
+    if (ctx && ctx->sets) {
+        ctx = NULL;
+    }
+
+    preset = (ctx != NULL);
+
+    if (ctx == NULL) {
+        ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_summarizer_ctx_t));
+        if (ctx == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        ngx_http_set_ctx(r, ctx, ngx_http_summarizer_module);
+    }
+
+    if (slcf->index && !preset
+        && (r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD)))
+    {
+        rc = ngx_http_summarizer_index_handler(r, slcf, ctx);
+
+        if (rc != NGX_DECLINED) {
+            return rc;
+        }
+    }
+
+    ctx->request = r;
+    ctx->priority = SMRZR_PRIORITY_DEFAULT;
+
+    if (slcf->priority) {
+        switch (ngx_http_summarizer_priority(r, slcf, &ctx->priority)) {
+
+        case NGX_OK:
+            ctx->prioritized = 1;
+            break;
+
+        case NGX_DECLINED:
+            break;
+
+        default:
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    /* summarized on a connection of its own, the client gets a job id */
+    if (slcf->jobs && !preset && r == r->main && r->method == NGX_HTTP_POST)
+    {
+        ctx->job = 1;
+
+        rc = ngx_http_read_client_request_body(r,
+                                            ngx_http_summarizer_limit_request);
+
+        if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+            return rc;
+        }
+
+        return NGX_DONE;
+    }
+
+    if (ngx_http_upstream_create(r) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            "summarizer_handler: failed to create upstream");
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    u = r->upstream;
+
+    ngx_str_set(&u->schema, "summarizer://"); 
+    /*ngx_str_set(&u->schema, "");*/
+    u->output.tag = (ngx_buf_tag_t) &ngx_http_summarizer_module;
+
+    u->conf = &slcf->upstream;
+
+#if (NGX_HTTP_SUMMARIZER_CACHE)
+    /* inline documents are only keyed by their contents */
+    if (slcf->nocache_upstream
+        && ((r->request_body && r->request_body->bufs && slcf->dedup == NULL)
+            || preset))
+    {
+        u->conf = slcf->nocache_upstream;
+    }
+
+    u->create_key = ngx_http_summarizer_create_key;
+#endif
+
+    if (ctx->mirror) {
+        u->conf = slcf->mirror_upstream;
+
+#if (NGX_HTTP_SUMMARIZER_CACHE)
+    } else if (ctx->refresh) {
+        u->conf = slcf->refresh_upstream;
+#endif
+    }
+
+    u->create_request = ngx_http_summarizer_create_request;
+    u->reinit_request = ngx_http_summarizer_reinit_request;
+    u->process_header = ngx_http_summarizer_process_header;
+    u->abort_request = ngx_http_summarizer_abort_request;
+    u->finalize_request = ngx_http_summarizer_finalize_request;
+
+    /* buffered through the event pipe so the reply can be cached */
+    u->buffering = u->conf->buffering && !r->subrequest_in_memory;
+
+    if (u->buffering) {
+        u->pipe = ngx_pcalloc(r->pool, sizeof(ngx_event_pipe_t));
+        if (u->pipe == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        u->pipe->input_filter = ngx_event_pipe_copy_input_filter;
+        u->pipe->input_ctx = r;
+
+        u->input_filter_init = ngx_http_summarizer_input_filter_init;
+    }
+
+    /*u->input_filter_init = ngx_http_summarizer_filter_init;
+    u->input_filter = ngx_http_summarizer_filter;
+    u->input_filter_ctx = ctx;*/
+
+    rc = ngx_http_read_client_request_body(r,
+                                           ngx_http_summarizer_limit_request);
+
+    if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+        return rc;
+    }
+
+    return NGX_DONE;
+}
+
+/* parse search arguments */
+static ngx_int_t
+ngx_http_summarizer_parse_args(
+    ngx_http_request_t                  * r,
+    ngx_http_summarizer_loc_conf_t      * slcf,
+    smrzr_input_t                       * input)
+{
+    ngx_http_variable_value_t           * vv;
+    ngx_str_t                           * name = &input->file_name;
+    ngx_str_t                             val;
+    u_char                              * dst, * src;
+    ngx_int_t                             n;
+
+    /* file name; only a label for inline documents */
+    if(NULL != slcf->file) {
+        if(NGX_OK != ngx_http_complex_value(r, slcf->file, name)) {
+            return(NGX_ERROR);
+        }
+
+        /* a value with variables is a fresh copy: decode it in place */
+        if(NULL != slcf->file->lengths) {
+            dst = src = name->data;
+            ngx_unescape_uri(&dst, &src, name->len, 0);
+            name->len = dst - name->data;
+        }
+
+    } else if(NGX_CONF_UNSET != slcf->arg_idx[SMRZR_ARG_FILENAME]) {
+        vv = ngx_http_get_indexed_variable(r,
+                                        slcf->arg_idx[SMRZR_ARG_FILENAME]);
+
+        if(vv == NULL || vv->not_found) {
+            if(!(input->flags & SMRZR_REQ_INLINE_DOC)) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "'%V' variable is not set",
+                    &ngx_http_summarizer_args[SMRZR_ARG_FILENAME]);
+                return(NGX_ERROR);
+            }
+
+        } else {
+            name->data = vv->data;
+            name->len = vv->len;
+        }
+    }
+
+    /* ratio */
+    input->ratio = smrzr_default_ratio;
+
+    if(NGX_CONF_UNSET != slcf->ratio_fixed) {
+        input->ratio = (float)slcf->ratio_fixed / 100;
+        return(NGX_OK);
+    }
+
+    val.len = 0;
+
+    if(NULL != slcf->ratio) {
+        if(NGX_OK != ngx_http_complex_value(r, slcf->ratio, &val)) {
+            return(NGX_ERROR);
+        }
+
+    } else if(NGX_CONF_UNSET != slcf->arg_idx[SMRZR_ARG_RATIO]) {
+        vv = ngx_http_get_indexed_variable(r, slcf->arg_idx[SMRZR_ARG_RATIO]);
+
+        if(vv == NULL || vv->not_found) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "'%V' variable is not set",
+                &ngx_http_summarizer_args[SMRZR_ARG_RATIO]);
+            return(NGX_ERROR);
+        }
+
+        val.data = vv->data;
+        val.len = vv->len;
+    }
+
+    if(0 != val.len) {
+        if(NGX_ERROR == (n = ngx_atofp(val.data, val.len, 2)) || n > 10000) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "Summarizer invalid ratio \"%V\"", &val);
+            return(NGX_ERROR);
+        }
+
+        input->ratio = (float)n / 100;
+    }
+
+    return(NGX_OK);
+}
+
+/* the arguments, parsed on first use; the file name and ratio only */
+static smrzr_input_t *
+ngx_http_summarizer_args(ngx_http_request_t *r, ngx_http_summarizer_ctx_t *ctx)
+{
+    ngx_http_summarizer_loc_conf_t     *slcf;
+
+    if (!ctx->args_parsed) {
+        ctx->args_parsed = 1;
+
+        slcf = ngx_http_get_module_loc_conf(r, ngx_http_summarizer_module);
+
+        if (ctx->doc || (r->request_body && r->request_body->bufs)) {
+            ctx->args.flags = SMRZR_REQ_INLINE_DOC;
+        }
+
+        ctx->args_rc = ngx_http_summarizer_parse_args(r, slcf, &ctx->args);
+        ctx->args.flags = 0;
+    }
+
+    return ctx->args_rc == NGX_OK ? &ctx->args : NULL;
+}
+
+/* the file named by the arguments, looked up on first use */
+static ngx_open_file_info_t *
+ngx_http_summarizer_doc_info(ngx_http_request_t *r,
+    ngx_http_summarizer_ctx_t *ctx)
+{
+    smrzr_input_t                      *args;
+
+    if (!ctx->doc_looked_up) {
+        ctx->doc_looked_up = 1;
+
+        args = ngx_http_summarizer_args(r, ctx);
+
+        ctx->doc_rc = args ? ngx_http_summarizer_file_info(r, &args->file_name,
+                                                           &ctx->doc_path,
+                                                           &ctx->doc_info)
+                           : NGX_DECLINED;
+    }
+
+    return ctx->doc_rc == NGX_OK ? &ctx->doc_info : NULL;
+}
+
+/* time since the request arrived */
+static ngx_msec_int_t
+ngx_http_summarizer_elapsed(ngx_http_request_t *r)
+{
+    ngx_time_t                          * tp;
+
+    tp = ngx_timeofday();
+
+    return((ngx_msec_int_t)((tp->sec - r->start_sec) * 1000
+                            + (tp->msec - r->start_msec)));
+}
+
+/* remaining time budget of the request; NGX_DECLINED if there is none,
+ * NGX_BUSY if it is spent */
+static ngx_int_t
+ngx_http_summarizer_deadline(
+    ngx_http_request_t                  * r,
+    ngx_http_summarizer_loc_conf_t      * slcf,
+    uint32_t                            * deadline)
+{
+    ngx_str_t                             val;
+    ngx_int_t                             budget;
+
+    if(NGX_OK != ngx_http_complex_value(r, slcf->deadline, &val)) {
+        return(NGX_ERROR);
+    }
+
+    if(0 == val.len) {
+        return(NGX_DECLINED);
+    }
+
+    if(NGX_ERROR == (budget = ngx_parse_time(&val, 0))) {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+            "Summarizer invalid deadline \"%V\"", &val);
+        return(NGX_DECLINED);
+    }
+
+    budget -= ngx_max(ngx_http_summarizer_elapsed(r), 0);
+
+    if(budget <= 0) {
+        return(NGX_BUSY);
+    }
+
+    /* the daemon has to answer before summarizer_read_timeout fires */
+    budget = ngx_min(budget, (ngx_int_t)slcf->upstream.read_timeout);
+
+    *deadline = (uint32_t)budget;
+
+    return(NGX_OK);
+}
+
+/* summarizer_priority of the request; NGX_DECLINED if there is none */
+static ngx_int_t
+ngx_http_summarizer_priority(
+    ngx_http_request_t                  * r,
+    ngx_http_summarizer_loc_conf_t      * slcf,
+    ngx_uint_t                          * priority)
+{
+    ngx_str_t                             val;
+    ngx_int_t                             n;
+
+    if(NGX_OK != ngx_http_complex_value(r, slcf->priority, &val)) {
+        return(NGX_ERROR);
+    }
+
+    if(0 == val.len) {
+        return(NGX_DECLINED);
+    }
+
+    n = ngx_atoi(val.data, val.len);
+
+    if(NGX_ERROR == n || n > SMRZR_PRIORITY_LOWEST) {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+            "Summarizer invalid priority \"%V\"", &val);
+        return(NGX_DECLINED);
+    }
+
+    *priority = (ngx_uint_t)n;
+
+    return(NGX_OK);
+}
+
+/* create request callback */
+static ngx_int_t
+ngx_http_summarizer_create_request(ngx_http_request_t *r)
+{
+    ngx_buf_t                      * b;
+    ngx_chain_t                    * cl;
+    ngx_http_summarizer_loc_conf_t * slcf;
+    ngx_http_summarizer_ctx_t      * ctx;
+    smrzr_input_t                    input;
+    smrzr_input_t                  * args;
+    ngx_str_t                        dbg;
+    ngx_chain_t                    * doc = NULL;
+    ngx_chain_t                    * zdoc = NULL;
+    off_t                            doc_len = 0;
+    float                            map_ratio;
+ 
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_summarizer_module);
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_summarizer_module);
+
+    memset(&input, 0, sizeof(input));
+
+    /* request body (POST, or summarizer_filter subrequest) is the document,
+     * or the summaries of the ranges of a split one, or a mirrored copy */
+    if(NULL != ctx->doc) {
+        doc = ctx->doc;
+
+        if(ctx->merge) {
+            input.flags |= SMRZR_REQ_MERGE;
+        }
+
+    } else if(NULL != r->request_body && NULL != r->request_body->bufs) {
+        doc = r->request_body->bufs;
+    }
+
+    if(NULL != doc) {
+        for(cl = doc; cl; cl = cl->next) {
+            doc_len += ngx_buf_size(cl->buf);
+        }
+
+        if(doc_len > (off_t)NGX_MAX_UINT32_VALUE) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "Summarizer inline document is too large: %O", doc_len);
+            return(NGX_ERROR);
+        }
+
+        input.flags |= SMRZR_REQ_INLINE_DOC;
+        input.doc_len = (uint32_t)doc_len;
+
+        if(slcf->deflate) {
+            switch(ngx_http_summarizer_deflate(r, doc, (size_t)doc_len,
+                                               &zdoc))
+            {
+            case NGX_OK:
+                input.flags |= SMRZR_REQ_DOC_DEFLATE;
+                input.doc_raw_len = input.doc_len;
+                input.doc_len = (uint32_t)(zdoc->buf->last
+                                           - zdoc->buf->pos);
+                break;
+            case NGX_DECLINED:
+                break;
+            default:
+                return(NGX_ERROR);
+            }
+        }
+    }
+
+    if(NULL == (args = ngx_http_summarizer_args(r, ctx))) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            "Summarizer query args parse error");
+        return(NGX_ERROR);
+    }
+
+    input.file_name = args->file_name;
+    input.ratio = args->ratio;
+
+    /* the daemon of a document, for summarizer_hash_filename: by its
+     * contents with summarizer_dedup, else by file name; each range of a
+     * split one has a daemon of its own */
+    if(0 != ctx->fingerprint.len || !(input.flags & SMRZR_REQ_INLINE_DOC)) {
+        ngx_crc32_init(ctx->hash);
+
+        if(0 != ctx->fingerprint.len) {
+            ngx_crc32_update(&ctx->hash, ctx->fingerprint.data,
+                             ctx->fingerprint.len);
+        } else {
+            ngx_crc32_update(&ctx->hash, input.file_name.data,
+                             input.file_name.len);
+        }
+
+        if(ctx->range) {
+            ngx_crc32_update(&ctx->hash, (u_char *) &ctx->range_offset,
+                             sizeof(off_t));
+        }
+
+        ngx_crc32_final(ctx->hash);
+        ctx->hashed = 1;
+    }
+
+    /* ranges get twice the ratio, and the merge picks half of that */
+    if(ctx->range || ctx->merge) {
+        map_ratio = ngx_min(input.ratio * 2, 100);
+
+        input.ratio = ctx->range ? map_ratio : input.ratio * 100 / map_ratio;
+    }
+
+    if(ctx->range) {
+        input.flags |= SMRZR_REQ_RANGE;
+        input.range_offset = ctx->range_offset;
+        input.range_len = ctx->range_len;
+    }
+
+    /* a reply left in shm can't go through the cache or into memory */
+    if(NULL != slcf->shm && !r->upstream->buffering
+       && !r->subrequest_in_memory)
+    {
+        input.flags |= SMRZR_REQ_SHM_REPLY;
+        ctx->shm_requested = 1;
+    }
+
+    /* inflated on the fly, so not through the event pipe either */
+    ctx->accept_deflate = slcf->deflate && !r->upstream->buffering
+                          && !ctx->shm_requested;
+
+    if(ctx->accept_deflate) {
+        input.flags |= SMRZR_REQ_ACCEPT_DEFLATE;
+    }
+
+    if(NULL != slcf->deadline) {
+        switch(ngx_http_summarizer_deadline(r, slcf, &input.deadline_ms)) {
+        case NGX_OK:
+            input.flags |= SMRZR_REQ_DEADLINE;
+            break;
+        case NGX_DECLINED:
+            break;
+        case NGX_BUSY:
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "Summarizer deadline passed before the daemon request");
+            return(NGX_ERROR);
+        default:
+            return(NGX_ERROR);
+        }
+    }
+
+    /* summarizer_limit could not stat the document */
+    if(0 != ctx->limit_key.len) {
+        input.flags |= SMRZR_REQ_DOC_SIZE;
+    }
+
+    if(ctx->prioritized) {
+        input.flags |= SMRZR_REQ_PRIORITY;
+        input.priority = (uint32_t)ctx->priority;
+    }
+
+    if(NULL != slcf->incremental && !(input.flags & SMRZR_REQ_INLINE_DOC)
+       && !ctx->range && !ctx->mirror
+       && NGX_ERROR == ngx_http_summarizer_incremental(r, slcf, ctx, &input))
+    {
+        return(NGX_ERROR);
+    }
+
+    if(NGX_ERROR == smrzr_create_summary_request(r->pool, &input, &b))
+    {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            "Summarizer upstream search req creation failed");
+        return(NGX_ERROR);
+    }
+
+    if(NULL != slcf->trace
+       && smrzr_trace_sample(slcf->trace, slcf->trace_every))
+    {
+        if(NULL == (ctx->trace = ngx_pcalloc(r->pool,
+                                             sizeof(smrzr_trace_rec_t))))
+        {
+            return(NGX_ERROR);
+        }
+
+        ctx->trace->sec = r->start_sec;
+        ctx->trace->msec = r->start_msec;
+        ctx->trace->pid = ngx_pid;
+        ctx->trace->sent_ms =
+            (uint32_t)ngx_max(ngx_http_summarizer_elapsed(r), 0);
+        ctx->trace->req_len = (uint32_t)(b->last - b->pos);
+
+        ngx_memcpy(ctx->trace->req, b->pos,
+                   ngx_min(ctx->trace->req_len, SMRZR_TRACE_REQ_MAX));
+    }
+
+    cl = ngx_alloc_chain_link(r->pool);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    cl->buf = b;
+    cl->next = (NULL != zdoc) ? zdoc : doc;
+
+    r->upstream->request_bufs = cl;
+
+    ctx->request = r;
+    ctx->start = ngx_current_msec;
+
+    if(NULL != slcf->mirror_upstream && r == r->main && !ctx->merge) {
+        ngx_http_summarizer_mirror(r, slcf, ctx, doc);
+    }
+
+    dbg.data = b->pos;
+    dbg.len = b->last - b->pos;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+        "summarizer request: \"%V\"", &dbg);
+
+    return NGX_OK;
+}
+
+
+/* the daemon ranks only what was appended to the file since the state it
+ * sent back last time, or starts a state; NGX_DECLINED if the file can't
+ * be seen */
+static ngx_int_t
+ngx_http_summarizer_incremental(
+    ngx_http_request_t                  * r,
+    ngx_http_summarizer_loc_conf_t      * slcf,
+    ngx_http_summarizer_ctx_t           * ctx,
+    smrzr_input_t                       * input)
+{
+    smrzr_incr_state_t                    st;
+    ngx_open_file_info_t                * of;
+    ngx_int_t                             rc;
+
+    if(NULL == (of = ngx_http_summarizer_doc_info(r, ctx))) {
+        return(NGX_DECLINED);
+    }
+
+    /* "<ratio>:<file name>", as the cache key */
+    if(NULL == (st.key.data = ngx_pnalloc(r->pool, NGX_INT32_LEN + 4
+                                          + input->file_name.len)))
+    {
+        return(NGX_ERROR);
+    }
+
+    st.key.len = ngx_sprintf(st.key.data, "%.2f:%V", (double)input->ratio,
+                             &input->file_name) - st.key.data;
+    st.uniq = of->uniq;
+
+    if(NGX_ERROR == (rc = smrzr_incr_lookup(slcf->incremental, &st,
+                                            r->pool)))
+    {
+        return(NGX_ERROR);
+    }
+
+    /* truncated, the state is of another file */
+    if(NGX_OK == rc && st.offset <= of->size) {
+        input->state_offset = st.offset;
+        input->state = st.state;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "summarizer incremental: from %O of %O bytes",
+                   input->state_offset, of->size);
+
+    input->flags |= SMRZR_REQ_INCREMENTAL;
+
+    ctx->incremental = 1;
+    ctx->state_key = st.key;
+    ctx->state_uniq = st.uniq;
+
+    return(NGX_OK);
+}
+
+static ngx_int_t
+ngx_http_summarizer_reinit_request(ngx_http_request_t *r)
+{
+    ngx_http_summarizer_loc_conf_t  *slcf;
+    uint32_t                         deadline;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_summarizer_module);
+
+    if (slcf->deadline == NULL) {
+        return NGX_OK;
+    }
+
+    /* the next daemon gets what is left of the budget */
+    switch (ngx_http_summarizer_deadline(r, slcf, &deadline)) {
+
+    case NGX_OK:
+        break;
+
+    case NGX_DECLINED:
+        return NGX_OK;
+
+    case NGX_BUSY:
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "summarizer deadline passed before the retry");
+        return NGX_ERROR;
+
+    default:
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "summarizer retry deadline: %uDms", deadline);
+
+    (void) smrzr_update_summary_request_deadline(r->upstream->request_bufs->buf,
+                                                 deadline);
+
+    return NGX_OK;
+}
+
+
+/* keep the shm mapping alive until the summary has been sent */
+static void
+ngx_http_summarizer_shm_cleanup(void *data)
+{
+    ngx_http_summarizer_ctx_t  * ctx = data;
+
+    smrzr_shm_release(ctx->shm, ctx->shm_map);
+}
+
+static ngx_int_t
+ngx_http_summarizer_shm_reply(
+    ngx_http_request_t          * r,
+    ngx_http_summarizer_ctx_t   * ctx,
+    smrzr_summary_header_t      * hdr)
+{
+    ngx_http_upstream_t            * u = r->upstream;
+    ngx_http_summarizer_loc_conf_t * slcf;
+    ngx_pool_cleanup_t             * cln;
+    smrzr_shm_map_t                * map;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_summarizer_module);
+
+    if(NULL == slcf->shm || !ctx->shm_requested) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            "Summarizer upstream sent unrequested shm reply");
+        return(NGX_ERROR);
+    }
+
+    if(NULL == (cln = ngx_pool_cleanup_add(r->pool, 0))) {
+        return(NGX_ERROR);
+    }
+
+    if(NULL == (map = smrzr_shm_acquire(slcf->shm, hdr->shm_generation,
+                                        r->connection->log)))
+    {
+        return(NGX_ERROR);
+    }
+
+    ctx->shm = slcf->shm;
+    ctx->shm_map = map;
+
+    cln->handler = ngx_http_summarizer_shm_cleanup;
+    cln->data = ctx;
+
+    if(hdr->shm_offset < sizeof(smrzr_shm_header_t)
+       || (size_t)hdr->shm_offset + hdr->summary_len > map->size)
+    {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            "Summarizer upstream shm reply %uD:%uD out of segment bounds",
+            hdr->shm_offset, hdr->summary_len);
+        return(NGX_ERROR);
+    }
+
+    ctx->shm_data = map->addr + hdr->shm_offset;
+
+    /* body comes from the mapping, not from u->buffer */
+    u->input_filter_init = ngx_http_summarizer_shm_filter_init;
+    u->input_filter = ngx_http_summarizer_shm_filter;
+    u->input_filter_ctx = ctx;
+
+    return(NGX_OK);
+}
+
+static ngx_int_t
+ngx_http_summarizer_process_header(ngx_http_request_t *r)
+{
+    ngx_http_upstream_t        * u;
+    ngx_http_summarizer_ctx_t  * ctx;
+    ngx_buf_t                  * b;
+    ngx_int_t                    status;
+    smrzr_summary_header_t       hdr;
+    smrzr_incr_state_t           st;
+    ngx_table_elt_t            * h;
+    ngx_http_summarizer_loc_conf_t * slcf;
+    u_char                     * start;
+
+    u = r->upstream;
+    b = &u->buffer;
+
+    /* not enough bytes read to parse status */
+    if((b->last - b->pos) < (ssize_t)smrzr_min_header_len) {
+        return(NGX_AGAIN);
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_summarizer_module);
+
+    start = b->pos;
+
+    if(NGX_OK != (status = smrzr_parse_summary_response_header(r->pool, b,
+                           &hdr)))
+    {
+        if(NGX_AGAIN == status) {
+            return(NGX_AGAIN);
+        }
+
+        if(SMRZR_STATE_MAX < hdr.state_len) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "Summarizer upstream sent a ranking state of %uD bytes, "
+                "more than %d", hdr.state_len, SMRZR_STATE_MAX);
+            return status;
+        }
+
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            "Summarizer upstream error processing response header");
+        return status;
+    }
+
+    ctx->status = hdr.status;
+    ctx->len = hdr.summary_len;
+    ctx->deflated = 0;
+
+    if(hdr.flags & SMRZR_RESP_DEFLATE) {
+        if(!ctx->accept_deflate
+           || (SMRZR_STATUS_SUMMARY != hdr.status
+               && SMRZR_STATUS_PARTIAL != hdr.status))
+        {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "Summarizer upstream sent unrequested deflated reply");
+            return(NGX_HTTP_UPSTREAM_INVALID_HEADER);
+        }
+
+        ctx->deflated = 1;
+        ctx->zlen = hdr.summary_len;
+        ctx->len = hdr.raw_len;
+    }
+
+    /* a cached reply comes with the state of its time, already kept */
+    if((hdr.flags & SMRZR_RESP_STATE) && !r->cached) {
+        if(!ctx->incremental) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "Summarizer upstream sent unrequested ranking state");
+            return(NGX_HTTP_UPSTREAM_INVALID_HEADER);
+        }
+
+        if(SMRZR_STATUS_SUMMARY == hdr.status
+           || SMRZR_STATUS_SUMMARY_SHM == hdr.status)
+        {
+            slcf = ngx_http_get_module_loc_conf(r, ngx_http_summarizer_module);
+
+            st.key = ctx->state_key;
+            st.uniq = ctx->state_uniq;
+            st.offset = hdr.state_offset;
+            st.state = *hdr.state;
+
+            smrzr_incr_store(slcf->incremental, &st);
+        }
+    }
+
+    if(NULL != ctx->trace) {
+        ctx->trace->header_ms =
+            (uint32_t)ngx_max(ngx_http_summarizer_elapsed(r), 0);
+        ctx->trace->resp_len = (uint32_t)(b->pos - start);
+
+        ngx_memcpy(ctx->trace->resp, start,
+                   ngx_min(ctx->trace->resp_len, SMRZR_TRACE_RESP_MAX));
+    }
+
+    if((hdr.flags & SMRZR_RESP_DOC_SIZE) && 0 != ctx->limit_key.len) {
+        slcf = ngx_http_get_module_loc_conf(r, ngx_http_summarizer_module);
+
+        (void)smrzr_limit_account(smrzr_limit_zone_get(slcf->limit_zone),
+                                  &ctx->limit_key, ctx->priority, hdr.doc_size,
+                                  SMRZR_LIMIT_NO_BURST, NULL,
+                                  r->connection->log);
+        ctx->limit_key.len = 0;
+    }
+
+    switch(ctx->status) {
+    case SMRZR_STATUS_SUMMARY_SHM:
+        if(NGX_OK != ngx_http_summarizer_shm_reply(r, ctx, &hdr)) {
+            return(NGX_HTTP_UPSTREAM_INVALID_HEADER);
+        }
+        /* fall through */
+    case SMRZR_STATUS_SUMMARY:
+    case SMRZR_STATUS_PARTIAL:
+        u->headers_in.content_length_n = ctx->len;
+        u->headers_in.status_n = NGX_HTTP_OK;
+
+        if(ctx->mirror) {
+            u->input_filter_init = ngx_http_summarizer_mirror_filter_init;
+            u->input_filter = ngx_http_summarizer_mirror_filter;
+            u->input_filter_ctx = ctx;
+
+        /* summary of a range is kept for the merge, the one of a
+         * summarizer_set subrequest for its variable */
+        } else if(r->subrequest_in_memory) {
+            if(ctx->range && ctx->len > ctx->range_len) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "Summarizer upstream sent %uz bytes for a %uD bytes "
+                    "range", ctx->len, ctx->range_len);
+                return(NGX_HTTP_UPSTREAM_INVALID_HEADER);
+            }
+
+            u->input_filter_init = ngx_http_summarizer_range_filter_init;
+            u->input_filter = ngx_http_summarizer_range_filter;
+            u->input_filter_ctx = ctx;
+
+        } else if(ctx->deflated) {
+            u->input_filter_init = ngx_http_summarizer_inflate_filter_init;
+            u->input_filter = ngx_http_summarizer_inflate_filter;
+            u->input_filter_ctx = ctx;
+        }
+
+        if(SMRZR_STATUS_PARTIAL != ctx->status) {
+            break;
+        }
+
+        /* degraded answer within the deadline; not worth keeping */
+        u->cacheable = 0;
+
+        if(NULL == (h = ngx_list_push(&r->headers_out.headers))) {
+            return(NGX_ERROR);
+        }
+
+        h->hash = 1;
+#if (nginx_version >= 1023000)
+        h->next = NULL;
+#endif
+        ngx_str_set(&h->key, "X-Summarizer-Partial");
+        ngx_str_set(&h->value, "1");
+        break;
+    case SMRZR_STATUS_INVALID_REQ:
+        u->headers_in.status_n = NGX_HTTP_BAD_REQUEST;
+        break;
+    case SMRZR_STATUS_OVERLOADED:
+        /* next daemon, or a stale summary, per summarizer_next_upstream
+         * and summarizer_use_stale */
+        u->headers_in.status_n = NGX_HTTP_SERVICE_UNAVAILABLE;
+        break;
+    case SMRZR_STATUS_INTERNAL_ERR:
+    default:
+        u->headers_in.status_n = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        break;
+    }
+
+    /* no upstream state when the reply comes from the cache */
+    if(u->state) {
+        u->state->status = u->headers_in.status_n;
+    }
+
+#if (NGX_HTTP_SUMMARIZER_CACHE)
+    if(r->cached && NGX_HTTP_OK == u->headers_in.status_n) {
+        ngx_http_summarizer_refresh_ahead(r);
+    }
+#endif
+
+    return NGX_OK;
+}
+
+/* buffered reply ends after the summary */
+static ngx_int_t
+ngx_http_summarizer_input_filter_init(void *data)
+{
+    ngx_http_request_t         * r = data;
+    ngx_http_upstream_t        * u = r->upstream;
+
+    u->pipe->length = u->headers_in.content_length_n;
+
+    return(NGX_OK);
+}
+
+/* summary of a range or summarizer_set subrequest goes to the context,
+ * not to the client */
+static ngx_int_t
+ngx_http_summarizer_range_filter_init(void *data)
+{
+    ngx_http_summarizer_ctx_t  * ctx = data;
+    ngx_http_upstream_t        * u = ctx->request->upstream;
+
+    if(NULL == (ctx->out.data = ngx_pnalloc(ctx->request->pool,
+                                            ngx_max(ctx->len, 1))))
+    {
+        return(NGX_ERROR);
+    }
+
+    ctx->out.len = 0;
+    ctx->done = (0 == ctx->len);
+
+    if(ctx->deflated) {
+        ctx->done = 0;
+        u->length = ctx->zlen;
+        return(ngx_http_summarizer_inflate_init(ctx));
+    }
+
+    u->length = ctx->len;
+
+    return(NGX_OK);
+}
+
+static ngx_int_t
+ngx_http_summarizer_range_filter(void *data, ssize_t bytes)
+{
+    ngx_http_summarizer_ctx_t  * ctx = data;
+    ngx_http_upstream_t        * u = ctx->request->upstream;
+    size_t                       n;
+    ngx_buf_t                    b;
+
+    if(ctx->deflated) {
+        n = ngx_min((size_t)bytes, (size_t)u->length);
+        u->length -= n;
+
+        ngx_memzero(&b, sizeof(ngx_buf_t));
+        b.pos = ctx->out.data;
+        b.last = ctx->out.data + ctx->out.len;
+        b.end = ctx->out.data + ctx->len;
+
+        ctx->zstream->next_in = u->buffer.last;
+        ctx->zstream->avail_in = n;
+
+        switch(ngx_http_summarizer_inflate(ctx, &b)) {
+        case NGX_OK:
+            break;
+        case NGX_DONE:
+            ctx->done = 1;
+            break;
+        case NGX_AGAIN:
+            ngx_log_error(NGX_LOG_ERR, ctx->request->connection->log, 0,
+                "Summarizer upstream sent deflated summary longer than "
+                "%uz bytes", ctx->len);
+            /* fall through */
+        default:
+            return(NGX_ERROR);
+        }
+
+        ctx->out.len = b.last - b.pos;
+
+        return(NGX_OK);
+    }
+
+    n = ngx_min((size_t)bytes, ctx->len - ctx->out.len);
+
+    ngx_memcpy(ctx->out.data + ctx->out.len, u->buffer.last, n);
+
+    ctx->out.len += n;
+    u->length -= n;
+
+    /* u->buffer.last is left alone: the buffer is read into again */
+
+    if(ctx->out.len == ctx->len) {
+        ctx->done = 1;
+    }
+
+    return(NGX_OK);
+}
+
+/* deflated summary is inflated into buffers of its own */
+static ngx_int_t
+ngx_http_summarizer_inflate_filter_init(void *data)
+{
+    ngx_http_summarizer_ctx_t  * ctx = data;
+
+    ctx->request->upstream->length = ctx->zlen;
+
+    return(ngx_http_summarizer_inflate_init(ctx));
+}
+
+static ngx_int_t
+ngx_http_summarizer_inflate_filter(void *data, ssize_t bytes)
+{
+    ngx_http_summarizer_ctx_t  * ctx = data;
+    ngx_http_request_t         * r = ctx->request;
+    ngx_http_upstream_t        * u = r->upstream;
+    ngx_chain_t                * cl, ** ll;
+    ngx_buf_t                  * b;
+    ngx_int_t                    rc;
+    size_t                       n;
+
+    n = ngx_min((size_t)bytes, (size_t)u->length);
+    u->length -= n;
+
+    ctx->zstream->next_in = u->buffer.last;
+    ctx->zstream->avail_in = n;
+
+    /* u->buffer.last is left alone: the input is consumed here */
+
+    for(ll = &u->out_bufs; *ll; ll = &(*ll)->next) { /* void */ }
+
+    do {
+        if(NULL == (cl = ngx_chain_get_free_buf(r->pool, &u->free_bufs))) {
+            return(NGX_ERROR);
+        }
+
+        b = cl->buf;
+
+        if(NULL == b->start) {
+            if(NULL == (b->start = ngx_palloc(r->pool,
+                                              u->conf->buffer_size)))
+            {
+                return(NGX_ERROR);
+            }
+
+            b->end = b->start + u->conf->buffer_size;
+        }
+
+        b->pos = b->start;
+        b->last = b->start;
+        b->temporary = 1;
+        b->flush = 1;
+        b->tag = u->output.tag;
+
+        if(NGX_ERROR == (rc = ngx_http_summarizer_inflate(ctx, b))) {
+            return(NGX_ERROR);
+        }
+
+        if(b->last == b->pos) {
+            cl->next = u->free_bufs;
+            u->free_bufs = cl;
+
+        } else {
+            *ll = cl;
+            ll = &cl->next;
+        }
+
+    /* inflate may hold output back for a full buffer */
+    } while(NGX_DONE != rc && b->last == b->end);
+
+    if(0 == u->length && NGX_DONE != rc) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            "Summarizer upstream sent truncated deflated summary");
+        return(NGX_ERROR);
+    }
+
+    return(NGX_OK);
+}
+
+static ngx_int_t
+ngx_http_summarizer_inflate_init(ngx_http_summarizer_ctx_t *ctx)
+{
+    ngx_pool_t                 * pool = ctx->request->pool;
+
+    /* a fresh stream for each reply, next upstream ones included */
+    if(NULL == (ctx->zstream = ngx_pcalloc(pool, sizeof(z_stream)))) {
+        return(NGX_ERROR);
+    }
+
+    ctx->zstream->zalloc = ngx_http_summarizer_zalloc;
+    ctx->zstream->zfree = ngx_http_summarizer_zfree;
+    ctx->zstream->opaque = pool;
+
+    if(Z_OK != inflateInit(ctx->zstream)) {
+        ngx_log_error(NGX_LOG_ALERT, ctx->request->connection->log, 0,
+            "Summarizer inflateInit() failed");
+        return(NGX_ERROR);
+    }
+
+    return(NGX_OK);
+}
+
+/* inflate the pending input of the reply into b, up to b->end; NGX_AGAIN
+ * when b is full with input left, NGX_DONE at the end of the summary */
+static ngx_int_t
+ngx_http_summarizer_inflate(ngx_http_summarizer_ctx_t *ctx, ngx_buf_t *b)
+{
+    z_stream                   * zs = ctx->zstream;
+    int                          rc;
+
+    zs->next_out = b->last;
+    zs->avail_out = b->end - b->last;
+
+    rc = inflate(zs, Z_NO_FLUSH);
+
+    b->last = zs->next_out;
+
+    if((Z_OK != rc && Z_STREAM_END != rc && Z_BUF_ERROR != rc)
+       || zs->total_out > ctx->len
+       || (Z_STREAM_END == rc
+           && (0 != zs->avail_in || zs->total_out != ctx->len)))
+    {
+        ngx_log_error(NGX_LOG_ERR, ctx->request->connection->log, 0,
+            "Summarizer upstream sent invalid deflated summary: %d, "
+            "%uz of %uz bytes", rc, (size_t)zs->total_out, ctx->len);
+        return(NGX_ERROR);
+    }
+
+    if(Z_STREAM_END == rc) {
+        inflateEnd(zs);
+        return(NGX_DONE);
+    }
+
+    return((0 != zs->avail_in) ? NGX_AGAIN : NGX_OK);
+}
+
+/* deflate an inline document held in memory; NGX_DECLINED when it is
+ * small, in a file, or would not shrink */
+static ngx_int_t
+ngx_http_summarizer_deflate(ngx_http_request_t *r, ngx_chain_t *doc,
+    size_t len, ngx_chain_t **out)
+{
+    z_stream                     zs;
+    ngx_buf_t                  * b;
+    ngx_chain_t                * cl;
+    int                          rc = Z_OK;
+
+    if(len < SMRZR_DEFLATE_MIN_LEN) {
+        return(NGX_DECLINED);
+    }
+
+    for(cl = doc; cl; cl = cl->next) {
+        if(!ngx_buf_in_memory(cl->buf)) {
+            return(NGX_DECLINED);
+        }
+    }
+
+    ngx_memzero(&zs, sizeof(z_stream));
+
+    zs.zalloc = ngx_http_summarizer_zalloc;
+    zs.zfree = ngx_http_summarizer_zfree;
+    zs.opaque = r->pool;
+
+    /* fastest level: it is the network that is short, not the CPU */
+    if(Z_OK != deflateInit(&zs, 1)) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+            "Summarizer deflateInit() failed");
+        return(NGX_ERROR);
+    }
+
+    if(NULL == (b = ngx_create_temp_buf(r->pool, deflateBound(&zs, len)))) {
+        deflateEnd(&zs);
+        return(NGX_ERROR);
+    }
+
+    zs.next_out = b->last;
+    zs.avail_out = b->end - b->last;
+
+    for(cl = doc; cl && Z_STREAM_ERROR != rc; cl = cl->next) {
+        zs.next_in = cl->buf->pos;
+        zs.avail_in = cl->buf->last - cl->buf->pos;
+
+        rc = deflate(&zs, (NULL != cl->next) ? Z_NO_FLUSH : Z_FINISH);
+    }
+
+    deflateEnd(&zs);
+
+    if(Z_STREAM_END != rc) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+            "Summarizer deflate() failed: %d", rc);
+        return(NGX_ERROR);
+    }
+
+    b->last = zs.next_out;
+
+    if((size_t)(b->last - b->pos) >= len) {
+        return(NGX_DECLINED);
+    }
+
+    if(NULL == (cl = ngx_alloc_chain_link(r->pool))) {
+        return(NGX_ERROR);
+    }
+
+    cl->buf = b;
+    cl->next = NULL;
+
+    *out = cl;
+
+    return(NGX_OK);
+}
+
+static void*
+ngx_http_summarizer_zalloc(void *opaque, u_int items, u_int size)
+{
+    return ngx_palloc(opaque, items * size);
+}
+
+/* freed with the request pool */
+static void
+ngx_http_summarizer_zfree(void *opaque, void *address)
+{
+}
+
+/* summary of a mirrored request is only counted */
+static ngx_int_t
+ngx_http_summarizer_mirror_filter_init(void *data)
+{
+    ngx_http_summarizer_ctx_t  * ctx = data;
+
+    ctx->request->upstream->length = ctx->deflated ? ctx->zlen : ctx->len;
+
+    return(NGX_OK);
+}
+
+static ngx_int_t
+ngx_http_summarizer_mirror_filter(void *data, ssize_t bytes)
+{
+    ngx_http_summarizer_ctx_t  * ctx = data;
+    ngx_http_upstream_t        * u = ctx->request->upstream;
+
+    u->length -= ngx_min(bytes, u->length);
+
+    return(NGX_OK);
+}
+
+#if (NGX_HTTP_SUMMARIZER_CACHE)
+
+/* summarizer_cache_key, or the file name (fingerprint with
+ * summarizer_dedup) and ratio of the request */
+static ngx_int_t
+ngx_http_summarizer_create_key(ngx_http_request_t *r)
+{
+    ngx_str_t                      * key;
+    ngx_http_summarizer_loc_conf_t * slcf;
+    ngx_http_summarizer_ctx_t      * ctx;
+    smrzr_input_t                  * args;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_summarizer_module);
+    ctx = ngx_http_get_module_ctx(r, ngx_http_summarizer_module);
+
+    if(NULL == (key = ngx_array_push(&r->cache->keys))) {
+        return(NGX_ERROR);
+    }
+
+    if(NULL != slcf->cache_key.value.data) {
+        if(NGX_OK != ngx_http_complex_value(r, &slcf->cache_key, key)) {
+            return(NGX_ERROR);
+        }
+
+        return(NGX_OK);
+    }
+
+    if(NULL == (args = ngx_http_summarizer_args(r, ctx))) {
+        return(NGX_ERROR);
+    }
+
+    /* "<ratio>:#<fingerprint>", which no file name can look like */
+    if(0 != ctx->fingerprint.len) {
+        if(NULL == (key->data = ngx_pnalloc(r->pool, NGX_INT32_LEN + 5
+                                            + ctx->fingerprint.len)))
+        {
+            return(NGX_ERROR);
+        }
+
+        key->len = ngx_sprintf(key->data, "%.2f:#%V", (double)args->ratio,
+                               &ctx->fingerprint) - key->data;
+
+        return(NGX_OK);
+    }
+
+    /* "<ratio>:<file name>" */
+    if(NULL == (key->data = ngx_pnalloc(r->pool, NGX_INT32_LEN + 4
+                                        + args->file_name.len)))
+    {
+        return(NGX_ERROR);
+    }
+
+    key->len = ngx_sprintf(key->data, "%.2f:%V", (double)args->ratio,
+                           &args->file_name) - key->data;
+
+    return(NGX_OK);
+}
+
+#endif
+
+#if 0
+static ngx_int_t
+ngx_http_summarizer_filter_init(void *data)
+{
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_summarizer_filter(void *data, ssize_t bytes)
+{
+    /*ngx_http_summarizer_ctx_t  *ctx = data;*/
+
+    /* TODO filter impl here */
+    return 0; /*ctx->filter(ctx, bytes);*/
+}
+#endif
+
+/* summary in shm is queued as a single buffer pointing into the mapping */
+static ngx_int_t
+ngx_http_summarizer_shm_filter_init(void *data)
+{
+    ngx_http_summarizer_ctx_t  * ctx = data;
+    ngx_http_upstream_t        * u = ctx->request->upstream;
+    ngx_chain_t                * cl, ** ll;
+
+    for(cl = u->out_bufs, ll = &u->out_bufs; cl; cl = cl->next) {
+        ll = &cl->next;
+    }
+
+    if(NULL == (cl = ngx_chain_get_free_buf(ctx->request->pool,
+                                            &u->free_bufs)))
+    {
+        return(NGX_ERROR);
+    }
+
+    *ll = cl;
 
-    url.url = value[1];
-    url.no_resolve = 1;
+    cl->buf->flush = 1;
+    cl->buf->memory = 1;
+    cl->buf->pos = ctx->shm_data;
+    cl->buf->last = ctx->shm_data + ctx->len;
+    cl->buf->tag = u->output.tag;
 
-    slcf->upstream.upstream = ngx_http_upstream_add(cf, &url, 0);
-    if (slcf->upstream.upstream == NULL) {
-        return NGX_CONF_ERROR;
-    }
+    /* nothing more is read from the socket */
+    u->length = 0;
 
-    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    return(NGX_OK);
+}
 
-    clcf->handler = ngx_http_summarizer_handler;
 
-    if (clcf->name.data[clcf->name.len - 1] == '/') {
-        clcf->auto_redirect = 1;
-    }
+static ngx_int_t
+ngx_http_summarizer_shm_filter(void *data, ssize_t bytes)
+{
+    ngx_http_summarizer_ctx_t  * ctx = data;
 
-    for(i = 0; i < SMRZR_ARG_COUNT; ++i) {
-        if(NGX_ERROR == (slcf->arg_idx[i] = ngx_http_get_variable_index(
-                                      cf, &ngx_http_summarizer_args[i])))
-        {
-            ngx_log_error(NGX_LOG_ERR, cf->log, 0,
-                 "Can't get variable index for '%s' key",
-                    ngx_http_summarizer_args[i].data);
-            return NGX_CONF_ERROR;
-        }
-    }
+    ngx_log_error(NGX_LOG_WARN, ctx->request->connection->log, 0,
+        "Summarizer upstream sent %z bytes after shm reply", bytes);
 
-    return NGX_CONF_OK;
+    return(NGX_OK);
 }
 
-/* upstream handler to provide the callbacks */
-ngx_int_t
-ngx_http_summarizer_handler(ngx_http_request_t *r)
+/* circuit breaker: per worker, per daemon pool */
+static ngx_int_t
+ngx_http_summarizer_breaker_init_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
 {
-    ngx_int_t                           rc;
-    ngx_http_upstream_t                *u;
-    ngx_http_summarizer_ctx_t          *ctx;
-    ngx_http_summarizer_loc_conf_t     *slcf;
+    ngx_http_summarizer_main_conf_t    * smcf;
+    ngx_http_summarizer_loc_conf_t     * slcf;
+    ngx_http_summarizer_pool_t         * pool;
+    ngx_http_summarizer_breaker_peer_t * bp;
+    ngx_http_upstream_t                * u = r->upstream;
+    ngx_uint_t                           i;
 
-    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-            "summarizer_handler: http method is not GET or HEAD");
-        return NGX_HTTP_NOT_ALLOWED;
-    }
+    smcf = ngx_http_get_module_main_conf(r, ngx_http_summarizer_module);
 
-    if (ngx_http_set_content_type(r) != NGX_OK) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-            "summarizer_handler: failed in set_content_type");
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
-    }
+    pool = smcf->pools.elts;
 
-    if (ngx_http_upstream_create(r) != NGX_OK) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-            "summarizer_handler: failed to create upstream");
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    for (i = 0; i < smcf->pools.nelts; i++) {
+        if (pool[i].upstream == us) {
+            break;
+        }
     }
 
-    u = r->upstream;
+    if (i == smcf->pools.nelts) {
+        return NGX_ERROR;
+    }
 
-    ngx_str_set(&u->schema, "summarizer://"); 
-    /*ngx_str_set(&u->schema, "");*/
-    u->output.tag = (ngx_buf_tag_t) &ngx_http_summarizer_module;
+    if (pool[i].init_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
 
     slcf = ngx_http_get_module_loc_conf(r, ngx_http_summarizer_module);
 
-    u->conf = &slcf->upstream;
-
-    u->create_request = ngx_http_summarizer_create_request;
-    u->reinit_request = ngx_http_summarizer_reinit_request;
-    u->process_header = ngx_http_summarizer_process_header;
-    u->abort_request = ngx_http_summarizer_abort_request;
-    u->finalize_request = ngx_http_summarizer_finalize_request;
+    /* the pool may also be used by other modules */
+    if (u->create_request != ngx_http_summarizer_create_request
+        || slcf->breaker_fails == 0)
+    {
+        return NGX_OK;
+    }
 
-    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_summarizer_ctx_t));
-    if (ctx == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    bp = ngx_palloc(r->pool, sizeof(ngx_http_summarizer_breaker_peer_t));
+    if (bp == NULL) {
+        return NGX_ERROR;
     }
 
-    /* TODO upstream context's sphinx specific members init here */
+    bp->pool = &pool[i];
+    bp->slcf = slcf;
+    bp->data = u->peer.data;
+    bp->get = u->peer.get;
+    bp->free = u->peer.free;
 
-    ngx_http_set_ctx(r, ctx, ngx_http_summarizer_module);
+    u->peer.data = bp;
+    u->peer.get = ngx_http_summarizer_breaker_get_peer;
+    u->peer.free = ngx_http_summarizer_breaker_free_peer;
 
-    /*u->input_filter_init = ngx_http_summarizer_filter_init;
-    u->input_filter = ngx_http_summarizer_filter;
-    u->input_filter_ctx = ctx;*/
+    return NGX_OK;
+}
 
-    rc = ngx_http_read_client_request_body(r, ngx_http_upstream_init);
+static ngx_int_t
+ngx_http_summarizer_breaker_get_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_summarizer_breaker_peer_t * bp = data;
+    ngx_http_summarizer_pool_t         * pool = bp->pool;
 
-    if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
-        return rc;
+    if (pool->open_until) {
+        if (ngx_time() < pool->open_until) {
+            /* looks like "no live upstreams" to the upstream module */
+            return NGX_BUSY;
+        }
+
+        /* half open: this request probes, the others keep failing fast */
+        pool->open_until = ngx_time() + bp->slcf->breaker_timeout;
     }
 
-    return NGX_DONE;
+    return bp->get(pc, bp->data);
 }
 
-/* parse search arguments */
+static void
+ngx_http_summarizer_breaker_free_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_http_summarizer_breaker_peer_t * bp = data;
+    ngx_http_summarizer_pool_t         * pool = bp->pool;
 
-#define GET_INDEXED_VARIABLE_VAL(r, slcf, arg_no) \
-    ngx_int_t i = slcf->arg_idx[arg_no]; \
-    ngx_http_variable_value_t * vv = ngx_http_get_indexed_variable(r, i); \
-    if (vv == NULL || vv->not_found) { \
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, \
-            "'%s' variable is not set", ngx_http_summarizer_args[arg_no].data); \
-        return NGX_ERROR; \
-    } \
-    ngx_str_t* vvs = ngx_palloc(r->pool, sizeof(ngx_str_t)); \
-    if(NULL == vvs) { return NGX_ERROR; } \
-    if(vv->len != 0) { \
-        if(NULL == (vvs->data = ngx_palloc(r->pool, vv->len))) { \
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, \
-                "Failed to allocate while getting indexed variable"); \
-            return NGX_ERROR; \
-        } \
-        memcpy(vvs->data, vv->data, vv->len); \
-    } else { vvs->data = NULL; } \
-    vvs->len = vv->len;
-
-#define GET_ARG(arg_no, var) \
-do { \
-    GET_INDEXED_VARIABLE_VAL(r, slcf, arg_no); \
-    input->var = vvs; \
-} while(0)
-
-#define PARSE_FLOAT_ARG(arg_no, var, dflt)   \
-do { \
-    GET_INDEXED_VARIABLE_VAL(r, slcf, arg_no); \
-    if(vvs->len != 0) { \
-        input->var = atoi((const char*)(vvs->data)); \
-    } else { input->var = dflt; } \
-} while(0)
+    if (state & NGX_PEER_FAILED) {
+        if (++pool->fails >= bp->slcf->breaker_fails) {
+            if (pool->open_until == 0) {
+                ngx_log_error(NGX_LOG_WARN, pc->log, 0,
+                    "summarizer circuit breaker open for \"%V\" "
+                    "after %ui failures", &pool->upstream->host,
+                    pool->fails);
+            }
 
-static ngx_int_t
-ngx_http_summarizer_parse_args(
-    ngx_http_request_t                  * r,
-    ngx_http_summarizer_loc_conf_t      * slcf,
-    smrzr_input_t                       * input)
-{
-    /* file name */
-    GET_ARG(SMRZR_ARG_FILENAME, file_name);
+            pool->open_until = ngx_time() + bp->slcf->breaker_timeout;
+        }
 
-    /* ratio */
-    PARSE_FLOAT_ARG(SMRZR_ARG_RATIO, ratio, smrzr_default_ratio);
+    } else if (pc->sockaddr) {
+        if (pool->open_until) {
+            ngx_log_error(NGX_LOG_NOTICE, pc->log, 0,
+                "summarizer circuit breaker closed for \"%V\"",
+                &pool->upstream->host);
+        }
 
-    return(NGX_OK);
+        pool->fails = 0;
+        pool->open_until = 0;
+    }
+
+    bp->free(pc, bp->data, state);
 }
 
-/* create request callback */
+#if (nginx_version >= 1009000)
+
+/* 160 points on the ring per unit of weight for each peer, hashed from its
+ * address, so that a peer keeps its points as others come and go */
 static ngx_int_t
-ngx_http_summarizer_create_request(ngx_http_request_t *r)
+ngx_http_summarizer_chash_init(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us)
 {
-    ngx_buf_t                      * b;
-    ngx_chain_t                    * cl;
-    ngx_http_summarizer_loc_conf_t * slcf;
-    ngx_http_summarizer_ctx_t      * ctx;
-    smrzr_input_t                    input;
-    ngx_str_t                        dbg;
- 
-    slcf = ngx_http_get_module_loc_conf(r, ngx_http_summarizer_module);
+    ngx_http_summarizer_srv_conf_t     *sscf;
+    ngx_http_upstream_rr_peers_t       *peers;
+    ngx_http_upstream_rr_peer_t        *peer;
+    ngx_http_summarizer_chash_point_t  *points;
+    ngx_uint_t                          i, j, k, n;
+    uint32_t                            base, hash;
+    union {
+        uint32_t                        value;
+        u_char                          byte[4];
+    } prev;
 
-    ctx = ngx_http_get_module_ctx(r, ngx_http_summarizer_module);
-
-    memset(&input, 0, sizeof(input));
-    if(NGX_OK != ngx_http_summarizer_parse_args( r, slcf, &input)) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-            "Summarizer query args parse error");
-        return(NGX_ERROR);
+    if (ngx_http_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
     }
 
-    if(NGX_ERROR == smrzr_create_summary_request(r->pool, &input, &b))
-    {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-            "Summarizer upstream search req creation failed");
-        return(NGX_ERROR);
+    us->peer.init = ngx_http_summarizer_chash_init_peer;
+
+    sscf = ngx_http_conf_upstream_srv_conf(us, ngx_http_summarizer_module);
+
+    peers = us->peer.data;
+
+    n = 0;
+
+    for (peer = peers->peer; peer; peer = peer->next) {
+        n += 160 * peer->weight;
     }
 
-    cl = ngx_alloc_chain_link(r->pool);
-    if (cl == NULL) {
+    points = ngx_palloc(cf->pool,
+                        n * sizeof(ngx_http_summarizer_chash_point_t));
+    if (points == NULL) {
         return NGX_ERROR;
     }
 
-    cl->buf = b;
-    cl->next = NULL;
+    k = 0;
 
-    r->upstream->request_bufs = cl;
+    for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+        ngx_crc32_init(base);
+        ngx_crc32_update(&base, peer->name.data, peer->name.len);
 
-    ctx->request = r;
+        prev.value = 0;
 
-    dbg.data = b->pos;
-    dbg.len = b->last - b->pos;
+        for (j = 0; j < 160 * peer->weight; j++) {
+            hash = base;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-        "summarizer request: \"%V\"", &dbg);
+            ngx_crc32_update(&hash, prev.byte, 4);
+            ngx_crc32_final(hash);
 
-    return NGX_OK;
-}
+            points[k].hash = hash;
+            points[k].peer = i;
+            k++;
 
+            prev.value = hash;
+        }
+    }
+
+    ngx_qsort(points, n, sizeof(ngx_http_summarizer_chash_point_t),
+              ngx_http_summarizer_chash_cmp);
+
+    sscf->points = points;
+    sscf->npoints = n;
 
-static ngx_int_t
-ngx_http_summarizer_reinit_request(ngx_http_request_t *r)
-{
     return NGX_OK;
 }
 
+static int ngx_libc_cdecl
+ngx_http_summarizer_chash_cmp(const void *one, const void *two)
+{
+    const ngx_http_summarizer_chash_point_t *first = one;
+    const ngx_http_summarizer_chash_point_t *second = two;
+
+    if (first->hash < second->hash) {
+        return -1;
+    }
+
+    return (first->hash > second->hash);
+}
 
 static ngx_int_t
-ngx_http_summarizer_process_header(ngx_http_request_t *r)
+ngx_http_summarizer_chash_init_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
 {
-    ngx_http_upstream_t        * u;
-    ngx_http_summarizer_ctx_t  * ctx;
-    ngx_buf_t                  * b;
-    ngx_int_t                    status;
-    uint32_t                     len = 0;
+    ngx_http_summarizer_chash_peer_t   *hp;
+    ngx_http_summarizer_ctx_t          *ctx;
+    ngx_http_upstream_rr_peers_t       *peers;
 
-    u = r->upstream;
-    b = &u->buffer;
+    hp = ngx_pcalloc(r->pool, sizeof(ngx_http_summarizer_chash_peer_t));
+    if (hp == NULL) {
+        return NGX_ERROR;
+    }
 
-    /* not enough bytes read to parse status */
-    if((b->last - b->pos) < (ssize_t)smrzr_min_header_len) {
-        return(NGX_AGAIN);
+    r->upstream->peer.data = &hp->rrp;
+
+    if (ngx_http_upstream_init_round_robin_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
     }
 
     ctx = ngx_http_get_module_ctx(r, ngx_http_summarizer_module);
 
-    if(NGX_OK != (status = smrzr_parse_summary_response_header(r->pool, b,
-                           &ctx->status, &len)))
+    /* inline documents, and other modules using the pool, go round robin */
+    if (r->upstream->create_request != ngx_http_summarizer_create_request
+        || ctx == NULL || !ctx->hashed)
     {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-            "Summarizer upstream error processing response header");
-        return status;
+        return NGX_OK;
     }
 
-    switch(ctx->status) {
-    case SMRZR_STATUS_SUMMARY:
-        u->headers_in.content_length_n = len;
-        u->headers_in.status_n = NGX_HTTP_OK;
-        u->state->status = NGX_HTTP_OK;
-        break;
-    case SMRZR_STATUS_INVALID_REQ:
-        u->headers_in.status_n = NGX_HTTP_BAD_REQUEST;
-        u->state->status = NGX_HTTP_BAD_REQUEST;
-        break;
-    case SMRZR_STATUS_INTERNAL_ERR:
-    default:
-        u->headers_in.status_n = NGX_HTTP_INTERNAL_SERVER_ERROR;
-        u->state->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
-        break;
+    peers = us->peer.data;
+
+    hp->conf = ngx_http_conf_upstream_srv_conf(us, ngx_http_summarizer_module);
+    hp->hash = ctx->hash;
+    hp->nseen = (peers->number + (8 * sizeof(uintptr_t) - 1))
+                / (8 * sizeof(uintptr_t));
+
+    hp->seen = ngx_palloc(r->pool, hp->nseen * sizeof(uintptr_t));
+    if (hp->seen == NULL) {
+        return NGX_ERROR;
     }
 
+    r->upstream->peer.get = ngx_http_summarizer_chash_get_peer;
+
     return NGX_OK;
 }
 
-#if 0
+/* the first peer clockwise from the hash that is up and, with bounded
+ * loads, has no more than bound times its share of the connections */
 static ngx_int_t
-ngx_http_summarizer_filter_init(void *data)
+ngx_http_summarizer_chash_get_peer(ngx_peer_connection_t *pc, void *data)
 {
-    return NGX_OK;
-}
+    ngx_http_summarizer_chash_peer_t   *hp = data;
+    ngx_http_summarizer_srv_conf_t     *sscf = hp->conf;
+    ngx_http_upstream_rr_peers_t       *peers = hp->rrp.peers;
+    ngx_http_upstream_rr_peer_t        *peer, *best;
+    ngx_http_summarizer_chash_point_t  *point;
+    ngx_uint_t                          i, k, n, lo, hi, left, weight;
+    ngx_uint_t                          best_i;
+    uint64_t                            conns;
+    uintptr_t                           m;
+    time_t                              now;
 
+    ngx_http_upstream_rr_peers_wlock(peers);
 
-static ngx_int_t
-ngx_http_summarizer_filter(void *data, ssize_t bytes)
-{
-    /*ngx_http_summarizer_ctx_t  *ctx = data;*/
+    if (peers->number < 2 || sscf->npoints == 0) {
+        ngx_http_upstream_rr_peers_unlock(peers);
+        return ngx_http_upstream_get_round_robin_peer(pc, &hp->rrp);
+    }
 
-    /* TODO filter impl here */
-    return 0; /*ctx->filter(ctx, bytes);*/
+    pc->connection = NULL;
+
+    now = ngx_time();
+
+    conns = 0;
+    weight = 0;
+
+    for (peer = peers->peer; peer; peer = peer->next) {
+        if (!peer->down) {
+            conns += peer->conns;
+            weight += peer->weight;
+        }
+    }
+
+    /* first point at or after the hash */
+    lo = 0;
+    hi = sscf->npoints;
+
+    while (lo < hi) {
+        k = (lo + hi) / 2;
+
+        if (sscf->points[k].hash < hp->hash) {
+            lo = k + 1;
+        } else {
+            hi = k;
+        }
+    }
+
+    ngx_memzero(hp->seen, hp->nseen * sizeof(uintptr_t));
+
+    best = NULL;
+    best_i = 0;
+    left = peers->number;
+
+    for (k = 0; k < sscf->npoints && left; k++) {
+        point = &sscf->points[(lo + k) % sscf->npoints];
+
+        i = point->peer;
+        n = i / (8 * sizeof(uintptr_t));
+        m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+        if (hp->seen[n] & m) {
+            continue;
+        }
+
+        hp->seen[n] |= m;
+        left--;
+
+        if (hp->rrp.tried[n] & m) {
+            continue;
+        }
+
+        for (peer = peers->peer; i; i--) {
+            peer = peer->next;
+        }
+
+        if (peer->down) {
+            continue;
+        }
+
+        if (peer->max_fails
+            && peer->fails >= peer->max_fails
+            && now - peer->checked <= peer->fail_timeout)
+        {
+            continue;
+        }
+
+#if (nginx_version >= 1011005)
+        if (peer->max_conns && peer->conns >= peer->max_conns) {
+            continue;
+        }
+#endif
+
+        /* this connection included */
+        if (weight
+            && (uint64_t) peer->conns * 100 * weight
+               >= (uint64_t) sscf->bound * (conns + 1) * peer->weight)
+        {
+            continue;
+        }
+
+        best = peer;
+        best_i = point->peer;
+        break;
+    }
+
+    if (best == NULL) {
+        ngx_http_upstream_rr_peers_unlock(peers);
+        return ngx_http_upstream_get_round_robin_peer(pc, &hp->rrp);
+    }
+
+    hp->rrp.current = best;
+
+    ngx_http_upstream_rr_peer_lock(peers, best);
+
+    pc->sockaddr = best->sockaddr;
+    pc->socklen = best->socklen;
+    pc->name = &best->name;
+
+    best->conns++;
+
+    if (now - best->checked > best->fail_timeout) {
+        best->checked = now;
+    }
+
+    ngx_http_upstream_rr_peer_unlock(peers, best);
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    n = best_i / (8 * sizeof(uintptr_t));
+    m = (uintptr_t) 1 << best_i % (8 * sizeof(uintptr_t));
+
+    hp->rrp.tried[n] |= m;
+
+    return NGX_OK;
 }
+
 #endif
 
+
 static void
 ngx_http_summarizer_abort_request(ngx_http_request_t *r)
 {
@@ -549,7 +6633,34 @@ ngx_http_summarizer_abort_request(ngx_http_request_t *r)
 static void
 ngx_http_summarizer_finalize_request(ngx_http_request_t *r, ngx_int_t rc)
 {
+    ngx_http_summarizer_ctx_t       *ctx;
+    ngx_http_summarizer_loc_conf_t  *slcf;
+
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "finalize http summarizer request");
-    return;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_summarizer_module);
+
+    if (ctx == NULL || ctx->start == 0) {
+        return;
+    }
+
+    if (ctx->trace) {
+        slcf = ngx_http_get_module_loc_conf(r, ngx_http_summarizer_module);
+
+        ctx->trace->done_ms = (uint32_t) ngx_max(ngx_http_summarizer_elapsed(r),
+                                                 0);
+        ctx->trace->rc = rc;
+
+        smrzr_trace_write(slcf->trace, ctx->trace);
+        ctx->trace = NULL;
+    }
+
+    ctx->elapsed = ngx_current_msec - ctx->start;
+    ctx->rc = rc;
+    ctx->measured = 1;
+
+    if (ctx->mirror_ctx && ctx->mirror_ctx->measured) {
+        ngx_http_summarizer_mirror_log(r, ctx);
+    }
 }
@@ -23,28 +23,45 @@ static const size_t sz16 = sizeof(uint16_t),
 
 /* FUNCTION DEFINITIONS */
 
-#include <ctype.h>
-
-static void s_dump_buffer(u_char* ptr, size_t len) {
-    size_t i; char c;
-    fprintf(stderr, "buf [%lu]: ", len);
-    for(i = 0; i < len; ++i) {
-        c = ptr[i];
-        if(isprint(c)) fprintf(stderr, "%c", c);
-        else if(c < 0x10) fprintf(stderr, "0%x", c);
-        else fprintf(stderr, "%x", c);
-    }
-    fprintf(stderr, "\n");
-}
-
 /* Functions to handle summary request */
 
 static size_t
 s_smrzr_summary_request_len(smrzr_input_t * input)
 {
-    static const size_t header_len = sizeof(smrzr_request_header_t);
+    /* proto, ver, ratio, [flags], filename_len, filename, [doc_len],
+     * [deadline_ms], [range_off_hi, range_off_lo, range_len], [priority],
+     * [doc_raw_len], [state_off_hi, state_off_lo, state_len, state] */
+    size_t len = 2 * sz16 + 2 * sz32 + input->file_name.len;
+
+    if(input->flags) {
+        len += sz32;
+    }
+
+    if(input->flags & SMRZR_REQ_INLINE_DOC) {
+        len += sz32;
+    }
+
+    if(input->flags & SMRZR_REQ_DEADLINE) {
+        len += sz32;
+    }
+
+    if(input->flags & SMRZR_REQ_RANGE) {
+        len += 3 * sz32;
+    }
+
+    if(input->flags & SMRZR_REQ_PRIORITY) {
+        len += sz32;
+    }
+
+    if(input->flags & SMRZR_REQ_DOC_DEFLATE) {
+        len += sz32;
+    }
+
+    if(input->flags & SMRZR_REQ_INCREMENTAL) {
+        len += 3 * sz32 + input->state.len;
+    }
 
-    return(header_len + input->file_name->len + 1);
+    return(len);
 }
 
 ngx_int_t
@@ -55,8 +72,20 @@ smrzr_create_summary_request(
 {
     /* data to send =
      *   header = proto [2] . version [2] . ratio [4]
+     *            . flags [4] (SMRZR_VERSION_EXT only)
      *            . filename_len  [4]
      * . filename [filename_len]
+     * . doc_len [4] (SMRZR_REQ_INLINE_DOC only)
+     * . deadline_ms [4] (SMRZR_REQ_DEADLINE only)
+     * . range_off_hi [4] . range_off_lo [4] . range_len [4]
+     *   (SMRZR_REQ_RANGE only)
+     * . priority [4] (SMRZR_REQ_PRIORITY only)
+     * . doc_raw_len [4] (SMRZR_REQ_DOC_DEFLATE only)
+     * . state_off_hi [4] . state_off_lo [4] . state_len [4]
+     *   . state [state_len] (SMRZR_REQ_INCREMENTAL only)
+     *
+     * an inline document's doc_len bytes are sent by the caller right
+     * after this buffer
      */
 
     size_t buf_len = s_smrzr_summary_request_len(input);
@@ -65,6 +94,8 @@ smrzr_create_summary_request(
 
     ngx_int_t status;
 
+    uint16_t ver = input->flags ? SMRZR_VERSION_EXT : SMRZR_VERSION;
+
     if(NGX_ERROR == smrzr_stream_alloc(st, buf_len)) {
         return(NGX_ERROR);
     }
@@ -73,32 +104,98 @@ smrzr_create_summary_request(
            /* header - proto */
            smrzr_stream_write_int16(st, (uint16_t)SMRZR_DAEMON_PROTO)
            /* header - ver */
-        || smrzr_stream_write_int16(st, (uint16_t)SMRZR_VERSION)
+        || smrzr_stream_write_int16(st, ver)
            /* ratio */
         || smrzr_stream_write_float(st, (float)input->ratio)
+           /* flags */
+        || (input->flags && smrzr_stream_write_int32(st, input->flags))
            /* file name */
-        || smrzr_stream_write_string(st, input->file_name)
+        || smrzr_stream_write_string(st, &input->file_name)
+           /* inline document length */
+        || ((input->flags & SMRZR_REQ_INLINE_DOC)
+            && smrzr_stream_write_int32(st, input->doc_len))
+           /* remaining time budget */
+        || ((input->flags & SMRZR_REQ_DEADLINE)
+            && smrzr_stream_write_int32(st, input->deadline_ms))
+           /* byte range of the file */
+        || ((input->flags & SMRZR_REQ_RANGE)
+            && (   smrzr_stream_write_int32(st,
+                       (uint32_t)((uint64_t)input->range_offset >> 32))
+                || smrzr_stream_write_int32(st,
+                       (uint32_t)(input->range_offset & 0xffffffff))
+                || smrzr_stream_write_int32(st, input->range_len)))
+           /* scheduling class */
+        || ((input->flags & SMRZR_REQ_PRIORITY)
+            && smrzr_stream_write_int32(st, input->priority))
+           /* length of the document once inflated */
+        || ((input->flags & SMRZR_REQ_DOC_DEFLATE)
+            && smrzr_stream_write_int32(st, input->doc_raw_len))
+           /* state of the file up to an offset, from the previous reply */
+        || ((input->flags & SMRZR_REQ_INCREMENTAL)
+            && (   smrzr_stream_write_int32(st,
+                       (uint32_t)((uint64_t)input->state_offset >> 32))
+                || smrzr_stream_write_int32(st,
+                       (uint32_t)(input->state_offset & 0xffffffff))
+                || smrzr_stream_write_string(st, &input->state)))
         ;
 
     *b = smrzr_stream_get_buf(st);
 
-    s_dump_buffer((*b)->pos, buf_len);
+    return(status ? NGX_ERROR : NGX_OK);
+}
+
+/* rewrite deadline_ms of a request built by smrzr_create_summary_request,
+ * when it is sent again; NGX_DECLINED if it carries no deadline */
+ngx_int_t
+smrzr_update_summary_request_deadline(
+    ngx_buf_t       * b,
+    uint32_t          deadline_ms)
+{
+    u_char          * p = b->start;
+    uint16_t          ver;
+    uint32_t          flags, len;
+
+    ngx_memcpy(&ver, p + sz16, sz16);
 
-    return status;
+    if(SMRZR_VERSION_EXT != ntohs(ver)) {
+        return(NGX_DECLINED);
+    }
+
+    /* proto, ver, ratio */
+    p += 2 * sz16 + szf;
+
+    ngx_memcpy(&flags, p, sz32);
+    flags = ntohl(flags);
+    p += sz32;
+
+    if(!(flags & SMRZR_REQ_DEADLINE)) {
+        return(NGX_DECLINED);
+    }
+
+    ngx_memcpy(&len, p, sz32);
+    p += sz32 + ntohl(len);
+
+    if(flags & SMRZR_REQ_INLINE_DOC) {
+        p += sz32;
+    }
+
+    deadline_ms = htonl(deadline_ms);
+    ngx_memcpy(p, &deadline_ms, sz32);
+
+    return(NGX_OK);
 }
 
 /* Functions to work with summarizerd response */
 
 static ngx_int_t
 s_smrzr_parse_response_header(
-    ngx_pool_t      * pool,
-    ngx_buf_t       * b,
-    smrzr_status_t  * out_status,
-    uint32_t        * len)
+    ngx_pool_t              * pool,
+    ngx_buf_t               * b,
+    smrzr_summary_header_t  * hdr)
 {
-    ngx_int_t                status;
     smrzr_stream_t         * st;
-    smrzr_response_header_t  rep_hdr;
+    u_char                 * start = b->pos;
+    uint32_t                 off_hi, off_lo;
 
     if(NULL == (st = smrzr_stream_create(pool))) {
         return(NGX_ERROR);
@@ -108,41 +205,103 @@ s_smrzr_parse_response_header(
         return(NGX_ERROR);
     }
 
-    if(NGX_ERROR ==
-        (status =
-               smrzr_stream_read_int16(st, &rep_hdr.proto)
-            || smrzr_stream_read_int16(st, &rep_hdr.ver)
-            || smrzr_stream_read_int32(st, &rep_hdr.status)))
+    ngx_memzero(hdr, sizeof(smrzr_summary_header_t));
+
+    /* reads fail only when the header is not complete yet */
+
+    if(   smrzr_stream_read_int16(st, &hdr->proto)
+       || smrzr_stream_read_int16(st, &hdr->ver)
+       || smrzr_stream_read_int32(st, &hdr->status))
     {
-        return(NGX_HTTP_UPSTREAM_INVALID_HEADER);
+        goto again;
     }
 
-    if(SMRZR_DAEMON_PROTO != rep_hdr.proto || SMRZR_VERSION != rep_hdr.ver) {
+    if(SMRZR_DAEMON_PROTO != hdr->proto
+       || (SMRZR_VERSION != hdr->ver && SMRZR_VERSION_EXT != hdr->ver))
+    {
         return(NGX_HTTP_UPSTREAM_INVALID_HEADER);
     }
 
-    switch(rep_hdr.status) {
-        case SMRZR_STATUS_SUMMARY:
-            if(NGX_ERROR == (status = smrzr_stream_read_int32(st, len)))
+    if(SMRZR_VERSION_EXT == hdr->ver
+       && smrzr_stream_read_int32(st, &hdr->flags))
+    {
+        goto again;
+    }
+
+    switch(hdr->status) {
+        case SMRZR_STATUS_SUMMARY_SHM:
+            if(SMRZR_VERSION_EXT != hdr->ver) {
                 return(NGX_HTTP_UPSTREAM_INVALID_HEADER);
+            }
+            if(   smrzr_stream_read_int32(st, &hdr->shm_generation)
+               || smrzr_stream_read_int32(st, &hdr->shm_offset))
+            {
+                goto again;
+            }
+            /* fall through */
+        case SMRZR_STATUS_SUMMARY:
+        case SMRZR_STATUS_PARTIAL:
+            if(smrzr_stream_read_int32(st, &hdr->summary_len))
+                goto again;
         case SMRZR_STATUS_INVALID_REQ:
         case SMRZR_STATUS_INTERNAL_ERR:
+        case SMRZR_STATUS_OVERLOADED:
             /* we are good here */
-            *out_status = rep_hdr.status;
             break;
         default:
             return(NGX_HTTP_UPSTREAM_INVALID_HEADER);
     }
 
+    if((hdr->flags & SMRZR_RESP_DOC_SIZE)
+       && smrzr_stream_read_int32(st, &hdr->doc_size))
+    {
+        goto again;
+    }
+
+    if((hdr->flags & SMRZR_RESP_DEFLATE)
+       && smrzr_stream_read_int32(st, &hdr->raw_len))
+    {
+        goto again;
+    }
+
+    /* state_off_hi [4] . state_off_lo [4] . state_len [4] . state */
+    if(hdr->flags & SMRZR_RESP_STATE) {
+        if(   smrzr_stream_read_int32(st, &off_hi)
+           || smrzr_stream_read_int32(st, &off_lo)
+           || smrzr_stream_read_int32(st, &hdr->state_len))
+        {
+            goto again;
+        }
+
+        /* a longer one would never fit in the buffer */
+        if(SMRZR_STATE_MAX < hdr->state_len) {
+            return(NGX_HTTP_UPSTREAM_INVALID_HEADER);
+        }
+
+        /* the length again, with the state */
+        b->pos -= sz32;
+
+        if(smrzr_stream_read_string(st, &hdr->state)) {
+            goto again;
+        }
+
+        hdr->state_offset = (off_t)(((uint64_t)off_hi << 32) | off_lo);
+    }
+
     return(NGX_OK);
+
+again:
+
+    b->pos = start;
+
+    return(NGX_AGAIN);
 }
 
 ngx_int_t
 smrzr_parse_summary_response_header(
-    ngx_pool_t       * pool,
-    ngx_buf_t        * b,
-    smrzr_status_t   * status,
-    uint32_t         * len)
+    ngx_pool_t              * pool,
+    ngx_buf_t               * b,
+    smrzr_summary_header_t  * hdr)
 {
-    return(s_smrzr_parse_response_header(pool, b, status, len));
+    return(s_smrzr_parse_response_header(pool, b, hdr));
 }
@@ -9,13 +9,52 @@
 /* TYPES */
 
 #define SMRZR_VERSION          1
+#define SMRZR_VERSION_EXT      2    /* headers carry flags */
 #define SMRZR_DAEMON_PROTO     0x1421
 
+/* Request flags; a request with no flags set goes out as SMRZR_VERSION */
+#define SMRZR_REQ_SHM_REPLY    0x00000001  /* summary may be left in shm */
+#define SMRZR_REQ_INLINE_DOC   0x00000002  /* document follows the header */
+#define SMRZR_REQ_DEADLINE     0x00000004  /* time budget for the summary */
+#define SMRZR_REQ_DOC_SIZE     0x00000008  /* report the document size */
+#define SMRZR_REQ_RANGE        0x00000010  /* summarize a byte range only */
+#define SMRZR_REQ_MERGE        0x00000020  /* inline document is partial
+                                              summaries, rank them again */
+#define SMRZR_REQ_PRIORITY     0x00000040  /* scheduling class */
+#define SMRZR_REQ_ACCEPT_DEFLATE 0x00000080 /* summary may come deflated */
+#define SMRZR_REQ_DOC_DEFLATE  0x00000100  /* inline document is deflated,
+                                              doc_len bytes of zlib data */
+#define SMRZR_REQ_INCREMENTAL  0x00000200  /* ranking state of the file up
+                                              to an offset follows (none
+                                              at 0), send back a new one */
+
+/* Priorities; lower ones are served first */
+#define SMRZR_PRIORITY_HIGHEST 0
+#define SMRZR_PRIORITY_DEFAULT 1
+#define SMRZR_PRIORITY_LOWEST  3
+
+/* Response flags */
+#define SMRZR_RESP_DOC_SIZE    0x00000001  /* document size follows */
+#define SMRZR_RESP_DEFLATE     0x00000002  /* summary_len bytes of zlib data
+                                              follow, raw_len once inflated */
+#define SMRZR_RESP_STATE       0x00000004  /* ranking state of the file up
+                                              to an offset follows */
+
+/* Longest ranking state (SMRZR_RESP_STATE) taken from a daemon; it comes
+ * in the response header, which has to fit in summarizer_buffer_size */
+#define SMRZR_STATE_MAX        2048
+
+/* Fixed part of the longest response header, without the state */
+#define SMRZR_RESP_HEADER_MAX  44
+
 /* Return codes from summarizer daemon */
 typedef enum {
     SMRZR_STATUS_SUMMARY =      0,
     SMRZR_STATUS_INVALID_REQ =  1,
     SMRZR_STATUS_INTERNAL_ERR = 2,
+    SMRZR_STATUS_SUMMARY_SHM =  3,  /* summary is in the shm segment */
+    SMRZR_STATUS_PARTIAL =      4,  /* best effort summary, deadline hit */
+    SMRZR_STATUS_OVERLOADED =   5,  /* daemon is shedding load */
 } smrzr_status_t;
 
 /* Request header */
@@ -23,7 +62,18 @@ typedef struct {
     uint16_t           proto;
     uint16_t           ver;
     uint32_t           ratio;
+    uint32_t           flags;          /* SMRZR_VERSION_EXT only */
     uint32_t           filename_len;
+    uint32_t           doc_len;        /* SMRZR_REQ_INLINE_DOC only */
+    uint32_t           deadline_ms;    /* SMRZR_REQ_DEADLINE only */
+    uint32_t           range_off_hi;   /* SMRZR_REQ_RANGE only */
+    uint32_t           range_off_lo;   /* SMRZR_REQ_RANGE only */
+    uint32_t           range_len;      /* SMRZR_REQ_RANGE only */
+    uint32_t           priority;       /* SMRZR_REQ_PRIORITY only */
+    uint32_t           doc_raw_len;    /* SMRZR_REQ_DOC_DEFLATE only */
+    uint32_t           state_off_hi;   /* SMRZR_REQ_INCREMENTAL only */
+    uint32_t           state_off_lo;   /* SMRZR_REQ_INCREMENTAL only */
+    uint32_t           state_len;      /* SMRZR_REQ_INCREMENTAL only */
 } smrzr_request_header_t;
 
 /* Response header */
@@ -38,13 +88,30 @@ typedef struct {
     uint16_t           proto;
     uint16_t           ver;
     uint32_t           status;
+    uint32_t           flags;          /* SMRZR_VERSION_EXT only */
+    uint32_t           shm_generation; /* SMRZR_STATUS_SUMMARY_SHM only */
+    uint32_t           shm_offset;     /* SMRZR_STATUS_SUMMARY_SHM only */
     uint32_t           summary_len;
+    uint32_t           doc_size;       /* SMRZR_RESP_DOC_SIZE only */
+    uint32_t           raw_len;        /* SMRZR_RESP_DEFLATE only */
+    off_t              state_offset;   /* SMRZR_RESP_STATE only */
+    uint32_t           state_len;      /* SMRZR_RESP_STATE only */
+    ngx_str_t        * state;          /* SMRZR_RESP_STATE only */
 } smrzr_summary_header_t;
 
 /* Search input from URL */
 typedef struct {
-    ngx_str_t        * file_name;
+    ngx_str_t          file_name;
     float              ratio;
+    uint32_t           flags;
+    uint32_t           doc_len;
+    uint32_t           deadline_ms;
+    off_t              range_offset;
+    uint32_t           range_len;
+    uint32_t           priority;
+    uint32_t           doc_raw_len;
+    off_t              state_offset;
+    ngx_str_t          state;
 } smrzr_input_t;
 
 
@@ -54,8 +121,11 @@ ngx_int_t
 smrzr_create_summary_request(ngx_pool_t*, smrzr_input_t*, ngx_buf_t**);
 
 ngx_int_t
-smrzr_parse_summary_response_header(ngx_pool_t*, ngx_buf_t*, smrzr_status_t*,
-                                    uint32_t*);
+smrzr_update_summary_request_deadline(ngx_buf_t*, uint32_t);
+
+ngx_int_t
+smrzr_parse_summary_response_header(ngx_pool_t*, ngx_buf_t*,
+                                    smrzr_summary_header_t*);
 
 /* GLOBALS */
 
@@ -0,0 +1,193 @@
+/*
+ * Shared memory segment of a co-located summarizer daemon
+ *
+ * The daemon leaves summaries in a segment under /dev/shm and replies on
+ * the unix socket next to it with the offset and length only. A slot stays
+ * reserved by the daemon until the upstream connection is closed, which
+ * nginx does only after the summary has been sent to the client.
+ */
+
+#include <sys/mman.h>
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "ngx_http_summarizer_shm.h"
+
+/* FUNCTION DEFINITIONS */
+
+static smrzr_shm_map_t*
+s_smrzr_shm_map(smrzr_shm_t * shm, ngx_log_t * log)
+{
+    ngx_fd_t             fd;
+    ngx_file_info_t      fi;
+    size_t               size;
+    u_char             * addr;
+    smrzr_shm_map_t    * map;
+
+    fd = ngx_open_file(shm->path, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if(NGX_INVALID_FILE == fd) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+            ngx_open_file_n " \"%s\" failed", shm->path);
+        return(NULL);
+    }
+
+    if(NGX_FILE_ERROR == ngx_fd_info(fd, &fi)) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+            ngx_fd_info_n " \"%s\" failed", shm->path);
+        ngx_close_file(fd);
+        return(NULL);
+    }
+
+    size = (size_t)ngx_file_size(&fi);
+
+    if(size < sizeof(smrzr_shm_header_t)) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+            "summarizer shm \"%s\" is too small", shm->path);
+        ngx_close_file(fd);
+        return(NULL);
+    }
+
+    addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+
+    ngx_close_file(fd);
+
+    if(MAP_FAILED == addr) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+            "mmap(\"%s\") failed", shm->path);
+        return(NULL);
+    }
+
+    if(SMRZR_SHM_MAGIC != ((smrzr_shm_header_t*)addr)->magic) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+            "summarizer shm \"%s\" has bad magic", shm->path);
+        munmap(addr, size);
+        return(NULL);
+    }
+
+    if(NULL == (map = ngx_alloc(sizeof(smrzr_shm_map_t), log))) {
+        munmap(addr, size);
+        return(NULL);
+    }
+
+    map->addr = addr;
+    map->size = size;
+    map->uniq = ngx_file_uniq(&fi);
+    map->generation = ((smrzr_shm_header_t*)addr)->generation;
+    map->refs = 0;
+
+    return(map);
+}
+
+static void
+s_smrzr_shm_unmap(smrzr_shm_map_t * map)
+{
+    munmap(map->addr, map->size);
+    ngx_free(map);
+}
+
+/* create segment descriptor and the url of its notification socket */
+smrzr_shm_t*
+smrzr_shm_create(
+    ngx_conf_t     * cf,
+    ngx_str_t      * name,
+    ngx_str_t      * url)
+{
+    smrzr_shm_t    * shm;
+    u_char         * p;
+
+    if(0 == name->len || NULL != ngx_strlchr(name->data,
+                                        name->data + name->len, '/'))
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "invalid summarizer shm name \"%V\"", name);
+        return(NULL);
+    }
+
+    if(NULL == (shm = ngx_pcalloc(cf->pool, sizeof(smrzr_shm_t)))) {
+        return(NULL);
+    }
+
+    shm->name = *name;
+
+    if(NULL == (shm->path = ngx_pnalloc(cf->pool,
+                                 sizeof(SMRZR_SHM_DIR) + name->len)))
+    {
+        return(NULL);
+    }
+
+    p = ngx_sprintf(shm->path, SMRZR_SHM_DIR "%V", name);
+    *p = '\0';
+
+    url->len = sizeof("unix:" SMRZR_SHM_DIR) - 1 + name->len
+               + sizeof(SMRZR_SHM_SOCK_SUFFIX) - 1;
+
+    if(NULL == (url->data = ngx_pnalloc(cf->pool, url->len))) {
+        return(NULL);
+    }
+
+    ngx_sprintf(url->data, "unix:" SMRZR_SHM_DIR "%V" SMRZR_SHM_SOCK_SUFFIX,
+                name);
+
+    return(shm);
+}
+
+/* get a referenced mapping of the given segment generation */
+smrzr_shm_map_t*
+smrzr_shm_acquire(
+    smrzr_shm_t    * shm,
+    uint32_t         generation,
+    ngx_log_t      * log)
+{
+    smrzr_shm_map_t    * map = shm->current;
+    ngx_file_info_t      fi;
+
+    /* the daemon may resize or replace the segment, or rewrite its header
+     * in place: only the file itself tells what the mapping covers */
+    if(NGX_FILE_ERROR == ngx_file_info(shm->path, &fi)) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+            ngx_file_info_n " \"%s\" failed", shm->path);
+        return(NULL);
+    }
+
+    if(NULL == map
+       || generation != map->generation
+       || ngx_file_uniq(&fi) != map->uniq
+       || (size_t)ngx_file_size(&fi) != map->size)
+    {
+        /* first use in this worker or the daemon recreated the segment */
+        if(NULL == (map = s_smrzr_shm_map(shm, log))) {
+            return(NULL);
+        }
+
+        if(generation != map->generation) {
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                "summarizer shm \"%s\" generation %uD, expected %uD",
+                shm->path, map->generation, generation);
+            s_smrzr_shm_unmap(map);
+            return(NULL);
+        }
+
+        /* mappings in use stay until their last reply is sent */
+        if(NULL != shm->current && 0 == shm->current->refs) {
+            s_smrzr_shm_unmap(shm->current);
+        }
+
+        shm->current = map;
+    }
+
+    map->refs++;
+
+    return(map);
+}
+
+/* drop reference; unmaps mappings of replaced generations */
+void
+smrzr_shm_release(
+    smrzr_shm_t      * shm,
+    smrzr_shm_map_t  * map)
+{
+    if(0 == --map->refs && map != shm->current) {
+        s_smrzr_shm_unmap(map);
+    }
+}
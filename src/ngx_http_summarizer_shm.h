@@ -0,0 +1,51 @@
+/*
+ * Shared memory segment of a co-located summarizer daemon
+ */
+
+#ifndef NGX_HTTP_SUMMARIZER_SHM_H
+#define NGX_HTTP_SUMMARIZER_SHM_H
+
+/* TYPES */
+
+#define SMRZR_SHM_MAGIC        0x5a524d53   /* "SMRZ" */
+#define SMRZR_SHM_DIR          "/dev/shm/"
+#define SMRZR_SHM_SOCK_SUFFIX  ".sock"
+
+/* Segment header written by the daemon at offset 0 (host byte order) */
+typedef struct {
+    uint32_t           magic;
+    uint32_t           generation;
+    uint64_t           size;
+} smrzr_shm_header_t;
+
+/* A mapping of the segment in this worker */
+typedef struct {
+    u_char           * addr;
+    size_t             size;
+    ngx_file_uniq_t    uniq;
+    uint32_t           generation;     /* as mapped; the header may change */
+    ngx_uint_t         refs;
+} smrzr_shm_map_t;
+
+/* Segment named by "summarizer_pass shm:<name>" */
+typedef struct {
+    ngx_str_t          name;
+    u_char           * path;           /* null terminated */
+    smrzr_shm_map_t  * current;
+} smrzr_shm_t;
+
+/* PROTOTYPES */
+
+/* create segment descriptor and the url of its notification socket */
+smrzr_shm_t*
+smrzr_shm_create(ngx_conf_t * cf, ngx_str_t * name, ngx_str_t * url);
+
+/* get a referenced mapping of the given segment generation */
+smrzr_shm_map_t*
+smrzr_shm_acquire(smrzr_shm_t * shm, uint32_t generation, ngx_log_t * log);
+
+/* drop reference; unmaps mappings of replaced generations */
+void
+smrzr_shm_release(smrzr_shm_t * shm, smrzr_shm_map_t * map);
+
+#endif /* NGX_HTTP_SUMMARIZER_SHM_H */
@@ -0,0 +1,183 @@
+/*
+ * Sampled wire traces of daemon requests in a shared ring
+ *
+ * Workers claim slots by bumping the head atomically and guard each slot
+ * with a sequence number, odd while it is written, so neither writers nor
+ * readers take a lock. A writer that finds its slot still being written
+ * (the ring wrapped meanwhile) drops its record; a reader that sees the
+ * sequence change under it skips the record.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "ngx_http_summarizer_trace.h"
+
+/* FUNCTION DEFINITIONS */
+
+ngx_uint_t
+smrzr_trace_sample(
+    smrzr_trace_zone_t  * zone,
+    ngx_uint_t            every)
+{
+    return(0 == ngx_atomic_fetch_add(&zone->sh->count, 1) % every);
+}
+
+void
+smrzr_trace_write(
+    smrzr_trace_zone_t  * zone,
+    smrzr_trace_rec_t   * rec)
+{
+    smrzr_trace_rec_t   * slot;
+    ngx_atomic_uint_t     n, seq;
+
+    n = ngx_atomic_fetch_add(&zone->sh->head, 1);
+
+    slot = &zone->sh->recs[n % zone->sh->nrecs];
+
+    seq = slot->seq;
+
+    if((seq & 1) || !ngx_atomic_cmp_set(&slot->seq, seq, 2 * n + 1)) {
+        return;
+    }
+
+    ngx_memcpy((u_char *) slot + offsetof(smrzr_trace_rec_t, sec),
+               (u_char *) rec + offsetof(smrzr_trace_rec_t, sec),
+               sizeof(smrzr_trace_rec_t) - offsetof(smrzr_trace_rec_t, sec));
+
+    ngx_memory_barrier();
+
+    slot->seq = 2 * n + 2;
+}
+
+ngx_int_t
+smrzr_trace_read(
+    smrzr_trace_zone_t  * zone,
+    ngx_uint_t            age,
+    smrzr_trace_rec_t   * rec)
+{
+    smrzr_trace_rec_t   * slot;
+    ngx_atomic_uint_t     head, seq;
+
+    head = zone->sh->head;
+
+    if(age >= ngx_min(head, zone->sh->nrecs)) {
+        return(NGX_DONE);
+    }
+
+    slot = &zone->sh->recs[(head - 1 - age) % zone->sh->nrecs];
+
+    seq = slot->seq;
+
+    if(seq & 1) {
+        return(NGX_AGAIN);
+    }
+
+    ngx_memory_barrier();
+
+    ngx_memcpy(rec, slot, sizeof(smrzr_trace_rec_t));
+
+    ngx_memory_barrier();
+
+    if(slot->seq != seq || 0 == seq) {
+        return(NGX_AGAIN);
+    }
+
+    return(NGX_OK);
+}
+
+static ngx_int_t
+s_smrzr_trace_init_zone(ngx_shm_zone_t * shm_zone, void * data)
+{
+    smrzr_trace_zone_t  * ozone = data;
+    smrzr_trace_zone_t  * zone;
+    ngx_slab_pool_t     * shpool;
+    ngx_uint_t            n;
+
+    zone = shm_zone->data;
+
+    if(NULL != ozone) {
+        zone->sh = ozone->sh;
+        return(NGX_OK);
+    }
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if(shm_zone->shm.exists) {
+        zone->sh = shpool->data;
+        return(NGX_OK);
+    }
+
+    /* as many records as the slab allocator lets us have */
+    n = (shm_zone->shm.size - shm_zone->shm.size / 16 - 2 * ngx_pagesize)
+        / sizeof(smrzr_trace_rec_t);
+
+    for( ; n; n = n * 3 / 4) {
+        zone->sh = ngx_slab_alloc(shpool, sizeof(smrzr_trace_sh_t)
+                                  + (n - 1) * sizeof(smrzr_trace_rec_t));
+        if(NULL != zone->sh) {
+            break;
+        }
+    }
+
+    if(0 == n) {
+        return(NGX_ERROR);
+    }
+
+    ngx_memzero(zone->sh, sizeof(smrzr_trace_sh_t)
+                          + (n - 1) * sizeof(smrzr_trace_rec_t));
+
+    zone->sh->nrecs = n;
+
+    shpool->data = zone->sh;
+
+    return(NGX_OK);
+}
+
+smrzr_trace_zone_t*
+smrzr_trace_zone_get(ngx_shm_zone_t * shm_zone)
+{
+    if(shm_zone->init != s_smrzr_trace_init_zone) {
+        return(NULL);
+    }
+
+    return(shm_zone->data);
+}
+
+smrzr_trace_zone_t*
+smrzr_trace_zone_create(
+    ngx_conf_t          * cf,
+    ngx_str_t           * name,
+    size_t                size,
+    void                * tag)
+{
+    smrzr_trace_zone_t  * zone;
+    ngx_shm_zone_t      * shm_zone;
+
+    if(NULL == (shm_zone = ngx_shared_memory_add(cf, name, size, tag))) {
+        return(NULL);
+    }
+
+    /* shared by all locations naming it */
+    if(NULL != shm_zone->data) {
+        if(shm_zone->init != s_smrzr_trace_init_zone) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "zone \"%V\" is already used for a different purpose",
+                name);
+            return(NULL);
+        }
+
+        return(shm_zone->data);
+    }
+
+    if(NULL == (zone = ngx_pcalloc(cf->pool, sizeof(smrzr_trace_zone_t)))) {
+        return(NULL);
+    }
+
+    shm_zone->init = s_smrzr_trace_init_zone;
+    shm_zone->data = zone;
+
+    zone->shm_zone = shm_zone;
+
+    return(zone);
+}
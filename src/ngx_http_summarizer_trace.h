@@ -0,0 +1,68 @@
+/*
+ * Sampled wire traces of daemon requests in a shared ring
+ */
+
+#ifndef NGX_HTTP_SUMMARIZER_TRACE_H
+#define NGX_HTTP_SUMMARIZER_TRACE_H
+
+/* TYPES */
+
+#define SMRZR_TRACE_REQ_MAX    256     /* longer requests are cut */
+#define SMRZR_TRACE_RESP_MAX   48      /* fixed header is 44 at most, a
+                                          ranking state after it is cut */
+
+/* One traced request; times are ms since the request arrived */
+typedef struct {
+    ngx_atomic_t       seq;            /* odd while being written */
+    time_t             sec;            /* arrival */
+    ngx_msec_t         msec;
+    ngx_pid_t          pid;
+    ngx_int_t          rc;             /* of the upstream request */
+    uint32_t           sent_ms;        /* request encoded */
+    uint32_t           header_ms;      /* response header parsed */
+    uint32_t           done_ms;        /* upstream request finalized */
+    uint32_t           req_len;        /* may exceed what is kept */
+    uint32_t           resp_len;
+    u_char             req[SMRZR_TRACE_REQ_MAX];
+    u_char             resp[SMRZR_TRACE_RESP_MAX];
+} smrzr_trace_rec_t;
+
+typedef struct {
+    ngx_atomic_t       head;           /* records written so far */
+    ngx_atomic_t       count;          /* requests seen, for sampling */
+    ngx_uint_t         nrecs;
+    smrzr_trace_rec_t  recs[1];
+} smrzr_trace_sh_t;
+
+/* A summarizer_trace zone */
+typedef struct {
+    smrzr_trace_sh_t * sh;
+    ngx_shm_zone_t   * shm_zone;
+} smrzr_trace_zone_t;
+
+/* PROTOTYPES */
+
+/* create zone, or get the one of the same name */
+smrzr_trace_zone_t*
+smrzr_trace_zone_create(ngx_conf_t * cf, ngx_str_t * name, size_t size,
+                        void * tag);
+
+/* the trace zone of a shared memory zone, NULL if it is not one */
+smrzr_trace_zone_t*
+smrzr_trace_zone_get(ngx_shm_zone_t * shm_zone);
+
+/* whether to trace this request, one in every */
+ngx_uint_t
+smrzr_trace_sample(smrzr_trace_zone_t * zone, ngx_uint_t every);
+
+/* copy the record into the ring, over the oldest one */
+void
+smrzr_trace_write(smrzr_trace_zone_t * zone, smrzr_trace_rec_t * rec);
+
+/* copy the age-th newest record out; NGX_AGAIN if it is being written,
+ * NGX_DONE past the oldest one */
+ngx_int_t
+smrzr_trace_read(smrzr_trace_zone_t * zone, ngx_uint_t age,
+                 smrzr_trace_rec_t * rec);
+
+#endif /* NGX_HTTP_SUMMARIZER_TRACE_H */
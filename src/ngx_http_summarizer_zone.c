@@ -0,0 +1,308 @@
+/*
+ * Shared memory zones of keyed entries, dropped least recently used first
+ *
+ * Entries live in a shared rbtree keyed by the crc32 of their key, which
+ * is copied after the entry's own fields, and in a queue of most recent
+ * use. What makes room when the zone is full is up to each user of a
+ * zone: the oldest entry, or the oldest one it says may go.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "ngx_http_summarizer_zone.h"
+
+/* FUNCTION DEFINITIONS */
+
+static void
+s_smrzr_zone_rbtree_insert_value(
+    ngx_rbtree_node_t   * temp,
+    ngx_rbtree_node_t   * node,
+    ngx_rbtree_node_t   * sentinel)
+{
+    ngx_rbtree_node_t  ** p;
+    smrzr_zone_node_t   * zn, * znt;
+
+    for( ;; ) {
+
+        if(node->key < temp->key) {
+            p = &temp->left;
+
+        } else if(node->key > temp->key) {
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            zn = (smrzr_zone_node_t *) node;
+            znt = (smrzr_zone_node_t *) temp;
+
+            p = (ngx_memn2cmp(zn->key, znt->key, zn->len, znt->len) < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if(*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+smrzr_zone_node_t*
+smrzr_zone_find(smrzr_zone_t * zone, ngx_str_t * key)
+{
+    ngx_rbtree_node_t   * node, * sentinel;
+    ngx_rbtree_key_t      hash;
+    smrzr_zone_node_t   * zn;
+    ngx_int_t             rc;
+
+    hash = ngx_crc32_short(key->data, key->len);
+
+    node = zone->sh->rbtree.root;
+    sentinel = zone->sh->rbtree.sentinel;
+
+    while(node != sentinel) {
+
+        if(hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if(hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        zn = (smrzr_zone_node_t *) node;
+
+        rc = ngx_memn2cmp(key->data, zn->key, key->len, (size_t) zn->len);
+
+        if(0 == rc) {
+            return(zn);
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return(NULL);
+}
+
+void
+smrzr_zone_free(smrzr_zone_t * zone, smrzr_zone_node_t * zn)
+{
+    if(NULL != zone->cleanup) {
+        zone->cleanup(zone, zn);
+    }
+
+    ngx_queue_remove(&zn->queue);
+    ngx_rbtree_delete(&zone->sh->rbtree, &zn->node);
+    ngx_slab_free_locked(zone->shpool, zn);
+}
+
+/* the oldest entry that may be dropped, NULL if there is none */
+static smrzr_zone_node_t*
+s_smrzr_zone_victim(
+    smrzr_zone_t        * zone,
+    smrzr_zone_evict_pt   evict,
+    void                * data)
+{
+    ngx_queue_t         * q;
+    smrzr_zone_node_t   * zn;
+
+    for(q = ngx_queue_last(&zone->sh->queue);
+        q != ngx_queue_sentinel(&zone->sh->queue);
+        q = ngx_queue_prev(q))
+    {
+        zn = ngx_queue_data(q, smrzr_zone_node_t, queue);
+
+        if(NULL == evict || evict(zn, data)) {
+            return(zn);
+        }
+    }
+
+    return(NULL);
+}
+
+void*
+smrzr_zone_alloc(
+    smrzr_zone_t        * zone,
+    size_t                size,
+    smrzr_zone_evict_pt   evict,
+    void                * data)
+{
+    void                * p;
+    smrzr_zone_node_t   * zn;
+
+    while(NULL == (p = ngx_slab_alloc_locked(zone->shpool, size))) {
+
+        if(NULL == (zn = s_smrzr_zone_victim(zone, evict, data))) {
+            return(NULL);
+        }
+
+        smrzr_zone_free(zone, zn);
+    }
+
+    return(p);
+}
+
+smrzr_zone_node_t*
+smrzr_zone_insert(
+    smrzr_zone_t        * zone,
+    ngx_str_t           * key,
+    size_t                size,
+    smrzr_zone_evict_pt   evict,
+    void                * data)
+{
+    smrzr_zone_node_t   * zn;
+
+    if(NULL == (zn = smrzr_zone_alloc(zone, size + key->len, evict, data))) {
+        return(NULL);
+    }
+
+    ngx_memzero(zn, size);
+
+    zn->key = (u_char *) zn + size;
+    zn->len = (u_short) key->len;
+    ngx_memcpy(zn->key, key->data, key->len);
+
+    zn->node.key = ngx_crc32_short(key->data, key->len);
+
+    ngx_rbtree_insert(&zone->sh->rbtree, &zn->node);
+    ngx_queue_insert_head(&zone->sh->queue, &zn->queue);
+
+    return(zn);
+}
+
+void
+smrzr_zone_touch(smrzr_zone_t * zone, smrzr_zone_node_t * zn)
+{
+    ngx_queue_remove(&zn->queue);
+    ngx_queue_insert_head(&zone->sh->queue, &zn->queue);
+}
+
+smrzr_zone_node_t*
+smrzr_zone_oldest(smrzr_zone_t * zone)
+{
+    if(ngx_queue_empty(&zone->sh->queue)) {
+        return(NULL);
+    }
+
+    return(ngx_queue_data(ngx_queue_last(&zone->sh->queue),
+                          smrzr_zone_node_t, queue));
+}
+
+static ngx_int_t
+s_smrzr_zone_init_zone(ngx_shm_zone_t * shm_zone, void * data)
+{
+    smrzr_zone_t        * ozone = data;
+    smrzr_zone_t        * zone;
+    size_t                len;
+
+    zone = shm_zone->data;
+
+    if(NULL != ozone) {
+        if(NULL != zone->reuse && NGX_OK != zone->reuse(zone, ozone)) {
+            return(NGX_ERROR);
+        }
+
+        zone->sh = ozone->sh;
+        zone->shpool = ozone->shpool;
+        return(NGX_OK);
+    }
+
+    zone->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if(shm_zone->shm.exists) {
+        zone->sh = zone->shpool->data;
+        return(NGX_OK);
+    }
+
+    if(NULL == (zone->sh = ngx_slab_alloc(zone->shpool, zone->sh_size))) {
+        return(NGX_ERROR);
+    }
+
+    ngx_memzero(zone->sh, zone->sh_size);
+
+    zone->shpool->data = zone->sh;
+
+    ngx_rbtree_init(&zone->sh->rbtree, &zone->sh->sentinel,
+                    s_smrzr_zone_rbtree_insert_value);
+
+    ngx_queue_init(&zone->sh->queue);
+
+    len = sizeof(" in  zone \"\"") + ngx_strlen(zone->directive)
+          + shm_zone->shm.name.len;
+
+    if(NULL == (zone->shpool->log_ctx = ngx_slab_alloc(zone->shpool, len))) {
+        return(NGX_ERROR);
+    }
+
+    ngx_sprintf(zone->shpool->log_ctx, " in %s zone \"%V\"%Z",
+                zone->directive, &shm_zone->shm.name);
+
+    /* a full zone drops entries, and its users say when that fails */
+    zone->shpool->log_nomem = 0;
+
+    return(NGX_OK);
+}
+
+smrzr_zone_t*
+smrzr_zone_get(ngx_shm_zone_t * shm_zone, char * directive)
+{
+    smrzr_zone_t        * zone;
+
+    if(shm_zone->init != s_smrzr_zone_init_zone) {
+        return(NULL);
+    }
+
+    zone = shm_zone->data;
+
+    return((zone->directive == directive) ? zone : NULL);
+}
+
+smrzr_zone_t*
+smrzr_zone_create(
+    ngx_conf_t          * cf,
+    ngx_str_t           * name,
+    size_t                size,
+    void                * tag,
+    char                * directive)
+{
+    smrzr_zone_t        * zone;
+    ngx_shm_zone_t      * shm_zone;
+
+    if(NULL == (shm_zone = ngx_shared_memory_add(cf, name, size, tag))) {
+        return(NULL);
+    }
+
+    /* shared by all locations naming it */
+    if(NULL != shm_zone->data) {
+        if(NULL == (zone = smrzr_zone_get(shm_zone, directive))) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "zone \"%V\" is already used for a different purpose",
+                name);
+            return(NULL);
+        }
+
+        return(zone);
+    }
+
+    if(NULL == (zone = ngx_pcalloc(cf->pool, sizeof(smrzr_zone_t)))) {
+        return(NULL);
+    }
+
+    zone->shm_zone = shm_zone;
+    zone->directive = directive;
+    zone->sh_size = sizeof(smrzr_zone_shctx_t);
+
+    shm_zone->init = s_smrzr_zone_init_zone;
+    shm_zone->data = zone;
+
+    return(zone);
+}
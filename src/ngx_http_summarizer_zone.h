@@ -0,0 +1,91 @@
+/*
+ * Shared memory zones of keyed entries, dropped least recently used first
+ */
+
+#ifndef NGX_HTTP_SUMMARIZER_ZONE_H
+#define NGX_HTTP_SUMMARIZER_ZONE_H
+
+/* TYPES */
+
+/* Entry header; the entry's own fields follow, then its key */
+typedef struct {
+    ngx_rbtree_node_t  node;           /* key: crc32 of the key */
+    ngx_queue_t        queue;          /* most recently used first */
+    u_char           * key;
+    u_short            len;
+} smrzr_zone_node_t;
+
+/* Shared part; a zone may ask for more, following it */
+typedef struct {
+    ngx_rbtree_t       rbtree;
+    ngx_rbtree_node_t  sentinel;
+    ngx_queue_t        queue;
+} smrzr_zone_shctx_t;
+
+typedef struct smrzr_zone_s  smrzr_zone_t;
+
+/* release what an entry points to, before the entry itself */
+typedef void (*smrzr_zone_cleanup_pt)(smrzr_zone_t * zone,
+                                      smrzr_zone_node_t * zn);
+
+/* whether an entry may be dropped to make room; NULL drops any */
+typedef ngx_int_t (*smrzr_zone_evict_pt)(smrzr_zone_node_t * zn,
+                                         void * data);
+
+/* accept or refuse the zone of the previous configuration */
+typedef ngx_int_t (*smrzr_zone_reuse_pt)(smrzr_zone_t * zone,
+                                         smrzr_zone_t * ozone);
+
+struct smrzr_zone_s {
+    smrzr_zone_shctx_t    * sh;
+    ngx_slab_pool_t       * shpool;
+    ngx_shm_zone_t        * shm_zone;
+    char                  * directive; /* that created it; one string per
+                                          directive, compared by address */
+    size_t                  sh_size;
+    smrzr_zone_cleanup_pt   cleanup;
+    smrzr_zone_reuse_pt     reuse;
+    void                  * data;      /* of the directive */
+};
+
+/* PROTOTYPES */
+
+/* create zone, or get the one of the same name if the same directive
+ * created it */
+smrzr_zone_t*
+smrzr_zone_create(ngx_conf_t * cf, ngx_str_t * name, size_t size,
+                  void * tag, char * directive);
+
+/* the zone of a shared memory zone, NULL if directive did not create it */
+smrzr_zone_t*
+smrzr_zone_get(ngx_shm_zone_t * shm_zone, char * directive);
+
+/* the remaining functions need the zone locked */
+
+smrzr_zone_node_t*
+smrzr_zone_find(smrzr_zone_t * zone, ngx_str_t * key);
+
+/* allocate, dropping the oldest evictable entries until it fits; NULL if
+ * none are left */
+void*
+smrzr_zone_alloc(smrzr_zone_t * zone, size_t size, smrzr_zone_evict_pt evict,
+                 void * data);
+
+/* add an entry of size bytes (its header included) under key, zeroed but
+ * for the header, as the most recent one; NULL if it does not fit */
+smrzr_zone_node_t*
+smrzr_zone_insert(smrzr_zone_t * zone, ngx_str_t * key, size_t size,
+                  smrzr_zone_evict_pt evict, void * data);
+
+/* make an entry the most recent one */
+void
+smrzr_zone_touch(smrzr_zone_t * zone, smrzr_zone_node_t * zn);
+
+void
+smrzr_zone_free(smrzr_zone_t * zone, smrzr_zone_node_t * zn);
+
+/* the oldest entry, NULL if there are none */
+smrzr_zone_node_t*
+smrzr_zone_oldest(smrzr_zone_t * zone);
+
+#endif /* NGX_HTTP_SUMMARIZER_ZONE_H */
@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+#
+# Build a precomputed summary index for the "summarizer_index" directive.
+#
+# Usage: smrzr_build_index.py [-d host:port|unix:/path] [-r ratio ...]
+#                             -o summaries.idx < file-list
+#
+# Each line of file-list is a file name as the daemon (and $smrzr_filename)
+# sees it, optionally followed by ratios overriding -r. Summaries are fetched
+# from the summarizer daemon; files the daemon fails on are skipped.
+
+import argparse
+import socket
+import struct
+import sys
+import zlib
+
+SMRZR_DAEMON_PROTO = 0x1421
+SMRZR_VERSION = 1
+SMRZR_STATUS_SUMMARY = 0
+
+SMRZR_INDEX_MAGIC = 0x534d5249
+SMRZR_INDEX_VERSION = 1
+
+HEADER = struct.Struct('>IIII')
+ENTRY = struct.Struct('>IIIIIIII')
+
+
+def connect(daemon):
+    if daemon.startswith('unix:'):
+        s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        s.connect(daemon[5:])
+    else:
+        host, port = daemon.rsplit(':', 1)
+        s = socket.create_connection((host, int(port)))
+    return s
+
+
+def recv_exact(s, n):
+    buf = b''
+    while len(buf) < n:
+        chunk = s.recv(n - len(buf))
+        if not chunk:
+            raise IOError('daemon closed connection')
+        buf += chunk
+    return buf
+
+
+def summarize(daemon, name, ratio):
+    s = connect(daemon)
+    try:
+        s.sendall(struct.pack('>HHfI', SMRZR_DAEMON_PROTO, SMRZR_VERSION,
+                              ratio, len(name)) + name)
+        proto, ver, status = struct.unpack('>HHI', recv_exact(s, 8))
+        if proto != SMRZR_DAEMON_PROTO or status != SMRZR_STATUS_SUMMARY:
+            return None
+        (length,) = struct.unpack('>I', recv_exact(s, 4))
+        return recv_exact(s, length)
+    finally:
+        s.close()
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument('-d', '--daemon', default='127.0.0.1:9872')
+    ap.add_argument('-r', '--ratio', type=float, action='append')
+    ap.add_argument('-o', '--output', required=True)
+    args = ap.parse_args()
+
+    entries = []
+
+    for line in sys.stdin.buffer:
+        fields = line.split()
+        if not fields:
+            continue
+        name = fields[0]
+        ratios = [float(r) for r in fields[1:]] or args.ratio or [30.0]
+        for ratio in ratios:
+            summary = summarize(args.daemon, name, ratio)
+            if summary is None:
+                sys.stderr.write('skipped %s @ %.2f\n' % (name.decode(), ratio))
+                continue
+            entries.append((zlib.crc32(name) & 0xffffffff,
+                            int(ratio * 100 + 0.5), name, summary))
+
+    entries.sort(key=lambda e: (e[0], e[1]))
+
+    off = HEADER.size + ENTRY.size * len(entries)
+    table, data = [], []
+
+    for h, r, name, summary in entries:
+        name_off, off = off, off + len(name)
+        summary_off, off = off, off + len(summary)
+        table.append(ENTRY.pack(h, r, name_off >> 32, name_off & 0xffffffff,
+                                summary_off >> 32, summary_off & 0xffffffff,
+                                len(name), len(summary)))
+        data += [name, summary]
+
+    with open(args.output, 'wb') as f:
+        f.write(HEADER.pack(SMRZR_INDEX_MAGIC, SMRZR_INDEX_VERSION,
+                            len(entries), 0))
+        f.write(b''.join(table))
+        f.write(b''.join(data))
+
+
+if __name__ == '__main__':
+    main()